@@ -22,6 +22,11 @@
 
 void CLASS::WriteRegVBE(uint16_t index, uint16_t value)
 {
+	//BAR2 exposes each DISPI register at (index << 1), no index latch needed
+	if (m_dispi_regs) {
+		m_dispi_regs[index] = value;
+		return;
+	}
 	m_provider->ioWrite16( VBE_DISPI_IOPORT_INDEX, index );
 	m_provider->ioWrite16( VBE_DISPI_IOPORT_DATA, value);
 }
@@ -30,6 +35,8 @@ void CLASS::WriteRegVBE(uint16_t index, uint16_t value)
 uint16_t CLASS::ReadRegVBE(uint16_t index)
 {
 	uint16_t value;
+	if (m_dispi_regs)
+		return m_dispi_regs[index];
 	m_provider->ioWrite16( VBE_DISPI_IOPORT_INDEX, index );
 	value = m_provider->ioRead16(VBE_DISPI_IOPORT_DATA);
 	return value;
@@ -38,12 +45,67 @@ uint16_t CLASS::ReadRegVBE(uint16_t index)
 /*************INIT********************/
 bool CLASS::Init()
 {
+	m_mmio = 0;
+	m_mmio_map = 0;
+	m_dispi_regs = 0;
+	return true;
+}
+
+/*************MAPDISPIMMIO********************/
+bool CLASS::MapDispiMMIO()
+{
+	uint16_t id;
+	
+	//qemu std-vga (and bochs-display) expose the DISPI block in BAR2,
+	//each MMIO access is much cheaper to emulate than the 0x1CE/0x1CF PIO pair
+	m_mmio = m_provider->getDeviceMemoryWithRegister(PCI_VGA_MMIO_BAR);
+	if (!m_mmio) {
+		DLOG("%s: no MMIO BAR2, using DISPI port I/O\n", __FUNCTION__);
+		return false;
+	}
+	if (m_mmio->getLength() < PCI_VGA_BOCHS_OFFSET + PCI_VGA_BOCHS_SIZE) {
+		DLOG("%s: BAR2 too small (%llu bytes), using DISPI port I/O\n", __FUNCTION__,
+			 (uint64_t)m_mmio->getLength());
+		m_mmio = 0;
+		return false;
+	}
+	
+	m_mmio_map = m_mmio->map(kIOMapInhibitCache);
+	if (!m_mmio_map) {
+		IOLog("QemuVGADevice: Failed to map BAR2, using DISPI port I/O\n");
+		m_mmio = 0;
+		return false;
+	}
+	
+	m_dispi_regs = reinterpret_cast<volatile uint16_t*>(m_mmio_map->getVirtualAddress() + PCI_VGA_BOCHS_OFFSET);
+	
+	//sanity check that the window really decodes DISPI before relying on it
+	id = m_dispi_regs[VBE_DISPI_INDEX_ID];
+	if (id < VBE_DISPI_ID0 || id > VBE_DISPI_ID5) {
+		IOLog("QemuVGADevice: BAR2 DISPI id 0x%04x invalid, using DISPI port I/O\n", id);
+		m_dispi_regs = 0;
+		m_mmio_map->release();
+		m_mmio_map = 0;
+		m_mmio = 0;
+		return false;
+	}
+	
+	IOLog("QemuVGADevice: DISPI registers via MMIO BAR2 at 0x%llx (id 0x%04x)\n",
+		  (uint64_t)m_mmio->getPhysicalAddress(), id);
 	return true;
 }
 
 /*************CLEANUP********************/
 void CLASS::Cleanup()
 {	
+	m_dispi_regs = 0;
+	if (m_mmio_map)
+	{
+		m_mmio_map->release();
+		m_mmio_map = 0;
+	}
+	m_mmio = 0;
+	
 	if (m_provider)
 	{
 		m_provider = 0;
@@ -107,6 +169,9 @@ bool CLASS::Start(IOPCIDevice* provider)
 	m_fb_offset = 0;
 	m_fb_size   = static_cast<uint32_t>(m_vram_size);
 
+	//prefer MMIO DISPI access, PIO remains as fallback
+	MapDispiMMIO();
+
 	//get initial value
 	m_width  = ReadRegVBE(VBE_DISPI_INDEX_XRES);
 	m_height = ReadRegVBE(VBE_DISPI_INDEX_YRES);
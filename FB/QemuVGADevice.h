@@ -10,6 +10,11 @@
 #define VBE_DISPI_IOPORT_INDEX 0x01CE
 #define VBE_DISPI_IOPORT_DATA  0x01CF
 
+//std-vga MMIO BAR2 layout (qemu hw/display/vga-pci.c)
+#define PCI_VGA_MMIO_BAR         kIOPCIConfigBaseAddress2
+#define PCI_VGA_BOCHS_OFFSET     0x500
+#define PCI_VGA_BOCHS_SIZE       (0x0b * 2)
+
 class IOPCIDevice;
 class IODeviceMemory;
 class IOMemoryMap;
@@ -26,6 +31,11 @@ private:
 	IOPhysicalAddress   m_vram_base;
 	IOByteCount			m_vram_size;
 
+	//bar 2 (optional, absent on old machine types and cirrus)
+	IODeviceMemory*		m_mmio;				//DISPI/VGA registers (BAR2)
+	IOMemoryMap*		m_mmio_map;
+	volatile uint16_t*	m_dispi_regs;		//NULL => use port I/O
+
 	uint32_t m_fb_offset;//0
 	uint32_t m_fb_size;//m_vram_size
 	
@@ -40,6 +50,7 @@ private:
 	//Read Write VBE Reg	
 	void	 WriteRegVBE(uint16_t index, uint16_t value);
 	uint16_t ReadRegVBE(uint16_t index);
+	bool	 MapDispiMMIO();
 
 public:
 	bool Init();
@@ -59,6 +70,7 @@ public:
 	uint32_t getCurrentFBSize() const { return m_fb_size; }
 	
 	IODeviceMemory*	get_m_vram() const { return m_vram; }
+	bool hasDispiMMIO() const { return m_dispi_regs != 0; }
 	
 	uint32_t getVRAMSize() const { return static_cast<uint32_t>(m_vram_size); }
 	IOPCIDevice* getProvider() const { return m_provider; } // Getter for PCI device
@@ -1,6 +1,10 @@
 #include "VMCommandBuffer.h"
 #include "VMQemuVGAAccelerator.h"
+#include "VMVirGLEncoder.h"
 #include <IOKit/IOLib.h>
+#include <mach/mach_time.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
 
 struct ResourceBinding {
     UInt32 binding_point;
@@ -34,28 +38,49 @@ bool CLASS::init(VMQemuVGAAccelerator* accelerator, uint32_t context_id)
     m_gpu_device = accelerator ? accelerator->getGPUDevice() : nullptr;
     m_context_id = context_id;
     
-    m_commands = OSArray::withCapacity(64);
+    m_chunks = OSArray::withCapacity(4);
     m_resources = OSArray::withCapacity(32);
     
     m_command_lock = IOLockAlloc();
-    m_buffer_size = 64 * 1024; // 64KB default
+    m_buffer_size = VM_COMMAND_CHUNK_SIZE;
     m_current_size = 0;
-    m_max_commands = 256;
+    m_current_offset = 0;
+    m_max_size = VM_COMMAND_MAX_SIZE;
+    m_max_commands = VM_COMMAND_MAX_COMMANDS;
     m_command_count = 0;
     
     m_state = VM_COMMAND_BUFFER_STATE_INITIAL;
     m_execution_time = 0;
+    m_submission_time = 0;
+    m_completion_time = 0;
+    m_label_depth = 0;
     m_completion_callback = nullptr;
     m_completion_context = nullptr;
     
-    // Allocate command buffer memory
-    m_buffer_memory = IOBufferMemoryDescriptor::withCapacity(m_buffer_size, kIODirectionOut);
-    if (!m_buffer_memory) {
+    m_optimized = false;
+    m_finalized = false;
+    m_wire = nullptr;
+    m_relocations = nullptr;
+    m_relocation_count = 0;
+    m_relocation_capacity = 0;
+    m_encoder = nullptr;
+    m_encoded = false;
+    
+    if (!m_chunks || !m_resources || !m_command_lock)
         return false;
-    }
-    m_buffer_memory->prepare();
     
-    return (m_commands && m_resources && m_command_lock && m_buffer_memory);
+    // First chunk up front, most buffers never need a second
+    IOBufferMemoryDescriptor* chunk = IOBufferMemoryDescriptor::withCapacity(m_buffer_size, kIODirectionOut);
+    if (!chunk)
+        return false;
+    chunk->setLength(0);
+    m_chunks->setObject(chunk);
+    chunk->release();
+    m_chunk_index = 0;
+    m_chunk_base = (uint8_t*)chunk->getBytesNoCopy();
+    m_chunk_capacity = chunk->getCapacity();
+    
+    return true;
 }
 
 void CLASS::free()
@@ -63,18 +88,22 @@ void CLASS::free()
     if (m_command_lock) {
         IOLockLock(m_command_lock);
         
-        // Clean up commands
-        if (m_commands) {
-            while (m_commands->getCount() > 0) {
-                VMGPUCommand* command = (VMGPUCommand*)m_commands->getObject(0);
-                if (command) {
-                    // Clean up command resources
-                    IOFree(command, sizeof(VMGPUCommand));
-                }
-                m_commands->removeObject(0);
-            }
-            m_commands->release();
-            m_commands = nullptr;
+        // Clean up the finalized image
+        releaseWire();
+        if (m_encoder) {
+            m_encoder->release();
+            m_encoder = nullptr;
+        }
+        if (m_relocations) {
+            IOFree(m_relocations, m_relocation_capacity * sizeof(VMCommandRelocation));
+            m_relocations = nullptr;
+            m_relocation_capacity = 0;
+        }
+        
+        // Clean up recorded chunks
+        if (m_chunks) {
+            m_chunks->release();
+            m_chunks = nullptr;
         }
         
         // Clean up resources
@@ -83,13 +112,6 @@ void CLASS::free()
             m_resources = nullptr;
         }
         
-        // Clean up buffer memory
-        if (m_buffer_memory) {
-            m_buffer_memory->complete();
-            m_buffer_memory->release();
-            m_buffer_memory = nullptr;
-        }
-        
         IOLockUnlock(m_command_lock);
         IOLockFree(m_command_lock);
         m_command_lock = nullptr;
@@ -98,6 +120,39 @@ void CLASS::free()
     super::free();
 }
 
+IOReturn CLASS::validateState(VMCommandBufferState required_state)
+{
+    return (m_state == required_state) ? kIOReturnSuccess : kIOReturnNotPermitted;
+}
+
+IOReturn CLASS::begin(uint32_t usage_flags)
+{
+    IOLockLock(m_command_lock);
+    
+    IOReturn ret = validateState(VM_COMMAND_BUFFER_STATE_INITIAL);
+    if (ret == kIOReturnSuccess) {
+        m_usage_flags = usage_flags;
+        m_state = VM_COMMAND_BUFFER_STATE_RECORDING;
+    }
+    
+    IOLockUnlock(m_command_lock);
+    return ret;
+}
+
+IOReturn CLASS::end()
+{
+    IOLockLock(m_command_lock);
+    
+    IOReturn ret = validateState(VM_COMMAND_BUFFER_STATE_RECORDING);
+    if (ret == kIOReturnSuccess) {
+        closeChunk();
+        m_state = VM_COMMAND_BUFFER_STATE_EXECUTABLE;
+    }
+    
+    IOLockUnlock(m_command_lock);
+    return ret;
+}
+
 IOReturn CLASS::reset()
 {
     IOLockLock(m_command_lock);
@@ -107,14 +162,16 @@ IOReturn CLASS::reset()
         return kIOReturnBusy;
     }
     
-    // Clean up existing commands
-    while (m_commands->getCount() > 0) {
-        VMGPUCommand* command = (VMGPUCommand*)m_commands->getObject(0);
-        if (command) {
-            cleanupCommand(command);
-        }
-        m_commands->removeObject(0);
+    // Rewind every chunk, they are reused by the next recording
+    for (unsigned int i = 0; i <= m_chunk_index; i++) {
+        IOBufferMemoryDescriptor* chunk = (IOBufferMemoryDescriptor*)m_chunks->getObject(i);
+        if (chunk)
+            chunk->setLength(0);
     }
+    IOBufferMemoryDescriptor* first = (IOBufferMemoryDescriptor*)m_chunks->getObject(0);
+    m_chunk_index = 0;
+    m_chunk_base = first ? (uint8_t*)first->getBytesNoCopy() : nullptr;
+    m_chunk_capacity = first ? first->getCapacity() : 0;
     
     // Clean up resources
     if (m_resources) {
@@ -122,20 +179,404 @@ IOReturn CLASS::reset()
     }
     
     // Reset state
+    m_current_offset = 0;
     m_current_size = 0;
     m_command_count = 0;
     m_state = VM_COMMAND_BUFFER_STATE_INITIAL;
     m_execution_time = 0;
+    m_label_depth = 0;
+    m_optimized = false;
+    bzero(&m_optimization_stats, sizeof(m_optimization_stats));
+    releaseWire();
     
-    // Clear buffer memory
-    if (m_buffer_memory) {
-        bzero(m_buffer_memory->getBytesNoCopy(), m_buffer_size);
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::ensureCapacity(size_t additional_size)
+{
+    IOBufferMemoryDescriptor* chunk;
+    
+    if (m_current_offset + additional_size <= m_chunk_capacity)
+        return kIOReturnSuccess;
+    if (m_current_size + additional_size > m_max_size)
+        return kIOReturnNoSpace;
+    
+    // Close the current chunk, records never straddle two
+    closeChunk();
+    
+    // Recycle the next chunk left over from an earlier recording if it fits
+    chunk = (IOBufferMemoryDescriptor*)m_chunks->getObject(m_chunk_index + 1);
+    if (chunk && chunk->getCapacity() < additional_size) {
+        m_chunks->removeObject(m_chunk_index + 1);
+        chunk = nullptr;
+    }
+    if (!chunk) {
+        size_t capacity = m_buffer_size;
+        if (capacity < additional_size)
+            capacity = round_page(additional_size);
+        chunk = IOBufferMemoryDescriptor::withCapacity(capacity, kIODirectionOut);
+        if (!chunk)
+            return kIOReturnNoMemory;
+        chunk->setLength(0);
+        bool ok = m_chunks->setObject(m_chunk_index + 1, chunk);
+        chunk->release();
+        if (!ok)
+            return kIOReturnNoMemory;
     }
     
+    m_chunk_index++;
+    m_chunk_base = (uint8_t*)chunk->getBytesNoCopy();
+    m_chunk_capacity = chunk->getCapacity();
+    m_current_offset = 0;
+    return kIOReturnSuccess;
+}
+
+VMCommandHeader* CLASS::allocateCommand(VMGPUCommandType type, uint32_t size)
+{
+    size_t record_size = VMCommandRecordSize(size);
+    
+    if (m_state != VM_COMMAND_BUFFER_STATE_INITIAL &&
+        m_state != VM_COMMAND_BUFFER_STATE_RECORDING)
+        return nullptr;
+    if (m_command_count >= m_max_commands)
+        return nullptr;
+    if (ensureCapacity(record_size) != kIOReturnSuccess)
+        return nullptr;
+    
+    VMCommandHeader* header = (VMCommandHeader*)(m_chunk_base + m_current_offset);
+    header->type = type;
+    header->size = size;
+    header->sequence = m_command_count++;
+    header->flags = 0;
+    
+    m_current_offset += record_size;
+    m_current_size += record_size;
+    return header;
+}
+
+IOReturn CLASS::allocationError() const
+{
+    if (m_state != VM_COMMAND_BUFFER_STATE_INITIAL &&
+        m_state != VM_COMMAND_BUFFER_STATE_RECORDING)
+        return kIOReturnNotPermitted;
+    return kIOReturnNoSpace;
+}
+
+void CLASS::closeChunk()
+{
+    IOBufferMemoryDescriptor* chunk = (IOBufferMemoryDescriptor*)m_chunks->getObject(m_chunk_index);
+    if (chunk)
+        chunk->setLength(m_current_offset);
+}
+
+IOReturn CLASS::writeCommand(const void* command_data, size_t size)
+{
+    const VMCommandHeader* src = (const VMCommandHeader*)command_data;
+    
+    if (!src || size < sizeof(VMCommandHeader) ||
+        src->size != size - sizeof(VMCommandHeader))
+        return kIOReturnBadArgument;
+    
+    VMCommandHeader* header = allocateCommand(src->type, src->size);
+    if (!header)
+        return allocationError();
+    
+    header->flags = src->flags;
+    memcpy(header + 1, src + 1, src->size);
+    return kIOReturnSuccess;
+}
+
+IOBufferMemoryDescriptor* CLASS::getChunk(uint32_t index) const
+{
+    if (!m_chunks || index > m_chunk_index)
+        return nullptr;
+    return (IOBufferMemoryDescriptor*)m_chunks->getObject(index);
+}
+
+IOReturn CLASS::encodeStream()
+{
+    IOReturn ret = kIOReturnSuccess;
+    
+    m_encoder->begin();
+    if (m_finalized) {
+        ret = m_encoder->encode(m_wire->getBytesNoCopy(), m_wire->getLength());
+    } else {
+        for (unsigned int i = 0; i <= m_chunk_index && ret == kIOReturnSuccess; i++) {
+            IOBufferMemoryDescriptor* chunk = (IOBufferMemoryDescriptor*)m_chunks->getObject(i);
+            if (chunk && chunk->getLength())
+                ret = m_encoder->encode(chunk->getBytesNoCopy(), chunk->getLength());
+        }
+    }
+    m_encoded = m_finalized && (ret == kIOReturnSuccess) && m_encoder->isReusable();
+    return ret;
+}
+
+IOReturn CLASS::submit()
+{
+    IOReturn ret = kIOReturnSuccess;
+    
+    IOLockLock(m_command_lock);
+    
+    // add*Command() records without begin()/end(), accept those streams as well
+    if (m_state != VM_COMMAND_BUFFER_STATE_EXECUTABLE &&
+        m_state != VM_COMMAND_BUFFER_STATE_INITIAL) {
+        IOLockUnlock(m_command_lock);
+        return kIOReturnNotPermitted;
+    }
+    if (!m_accelerator) {
+        IOLockUnlock(m_command_lock);
+        return kIOReturnNotReady;
+    }
+    
+    if (!m_finalized) {
+        closeChunk();
+        if (!m_optimized)
+            optimizeLocked();
+    }
+    m_state = VM_COMMAND_BUFFER_STATE_PENDING;
+    m_submission_time = mach_absolute_time();
+    m_completion_time = 0;
+    
+    if (!m_accelerator->supportsVirGL()) {
+        // No VirGL host to run the stream, complete without rendering like
+        // the accelerator's software path does
+        m_completion_time = mach_absolute_time();
+    } else if (!m_encoder && !(m_encoder = VMVirGLEncoder::withAccelerator(m_accelerator))) {
+        ret = kIOReturnNoMemory;
+    } else {
+        // Translate to VirGL, a finalized image keeps its encoding until patched
+        if (!m_finalized || !m_encoded)
+            ret = encodeStream();
+        if (ret == kIOReturnSuccess && m_encoder->getCommandLength()) {
+            // Later encodings must not read these back from their guest copies
+            m_accelerator->markHostWritten(m_context_id, m_encoder->getWrittenBuffers(),
+                                           m_encoder->getWrittenCount(),
+                                           m_encoder->writesUnknownBuffers());
+            ret = m_accelerator->submitVirGLCommands(m_context_id, m_encoder->getSubmission());
+        }
+        m_completion_time = mach_absolute_time();
+        
+        if (ret == kIOReturnSuccess && m_accelerator->isProfiling(m_context_id)) {
+            VMGPUTraceEvent event;
+            bzero(&event, sizeof(event));
+            strlcpy(event.name, "Command buffer", sizeof(event.name));
+            event.context_id = m_context_id;
+            event.submit_time = m_submission_time;
+            event.end_time = m_completion_time;
+            m_accelerator->recordTraceEvent(&event);
+        }
+    }
+    
+    m_execution_time = m_completion_time - m_submission_time;
+    if (ret != kIOReturnSuccess ||
+        (m_usage_flags & VM_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT))
+        m_state = VM_COMMAND_BUFFER_STATE_INVALID;
+    else
+        m_state = VM_COMMAND_BUFFER_STATE_EXECUTABLE;
+    
+    VMCommandBufferCallback callback = m_completion_callback;
+    void* context = m_completion_context;
+    
     IOLockUnlock(m_command_lock);
+    
+    if (callback)
+        callback(context, ret);
+    return ret;
+}
+
+void CLASS::releaseWire()
+{
+    if (m_wire) {
+        m_wire->release();
+        m_wire = nullptr;
+    }
+    m_relocation_count = 0;
+    m_finalized = false;
+    m_encoded = false;
+}
+
+IOReturn CLASS::addRelocations(const VMCommandHeader* header, uint32_t wire_offset)
+{
+    uint32_t count = 0;
+    
+    // Every 32-bit resource id field a record carries
+    switch (header->type) {
+        case VM_CMD_BIND_VERTEX_BUFFERS:
+            count = ((const VMBindVertexBuffersCommand*)header)->binding_count;
+            break;
+        case VM_CMD_COPY_BUFFER:
+            count = 2;
+            break;
+        case VM_CMD_BIND_INDEX_BUFFER:
+        case VM_CMD_UPDATE_BUFFER:
+        case VM_CMD_DRAW_INDIRECT:
+        case VM_CMD_DRAW_INDEXED_INDIRECT:
+            count = 1;
+            break;
+        default:
+            return kIOReturnSuccess;
+    }
+    
+    if (m_relocation_count + count > m_relocation_capacity) {
+        uint32_t capacity = m_relocation_capacity ? m_relocation_capacity : 16;
+        while (capacity < m_relocation_count + count)
+            capacity *= 2;
+        VMCommandRelocation* relocations = (VMCommandRelocation*)IOMalloc(capacity * sizeof(VMCommandRelocation));
+        if (!relocations)
+            return kIOReturnNoMemory;
+        if (m_relocations) {
+            memcpy(relocations, m_relocations, m_relocation_count * sizeof(VMCommandRelocation));
+            IOFree(m_relocations, m_relocation_capacity * sizeof(VMCommandRelocation));
+        }
+        m_relocations = relocations;
+        m_relocation_capacity = capacity;
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        VMCommandRelocation* relocation = &m_relocations[m_relocation_count++];
+        switch (header->type) {
+            case VM_CMD_BIND_VERTEX_BUFFERS: {
+                const VMBindVertexBuffersCommand* cmd = (const VMBindVertexBuffersCommand*)header;
+                relocation->offset = wire_offset + (uint32_t)((const uint8_t*)&cmd->bindings[i].buffer_id -
+                                                              (const uint8_t*)cmd);
+                relocation->resource_id = cmd->bindings[i].buffer_id;
+                break;
+            }
+            case VM_CMD_COPY_BUFFER: {
+                const VMCopyBufferCommand* cmd = (const VMCopyBufferCommand*)header;
+                const uint32_t* field = i ? &cmd->dst_buffer_id : &cmd->src_buffer_id;
+                relocation->offset = wire_offset + (uint32_t)((const uint8_t*)field - (const uint8_t*)cmd);
+                relocation->resource_id = *field;
+                break;
+            }
+            case VM_CMD_BIND_INDEX_BUFFER: {
+                const VMBindIndexBufferCommand* cmd = (const VMBindIndexBufferCommand*)header;
+                relocation->offset = wire_offset + (uint32_t)((const uint8_t*)&cmd->buffer_id -
+                                                              (const uint8_t*)cmd);
+                relocation->resource_id = cmd->buffer_id;
+                break;
+            }
+            case VM_CMD_UPDATE_BUFFER: {
+                const VMUpdateBufferCommand* cmd = (const VMUpdateBufferCommand*)header;
+                relocation->offset = wire_offset + (uint32_t)((const uint8_t*)&cmd->buffer_id -
+                                                              (const uint8_t*)cmd);
+                relocation->resource_id = cmd->buffer_id;
+                break;
+            }
+            case VM_CMD_DRAW_INDIRECT:
+            case VM_CMD_DRAW_INDEXED_INDIRECT: {
+                const VMDrawIndirectCommand* cmd = (const VMDrawIndirectCommand*)header;
+                relocation->offset = wire_offset + (uint32_t)((const uint8_t*)&cmd->buffer_id -
+                                                              (const uint8_t*)cmd);
+                relocation->resource_id = cmd->buffer_id;
+                break;
+            }
+            default:
+                break;
+        }
+    }
     return kIOReturnSuccess;
 }
 
+IOReturn CLASS::finalize()
+{
+    IOReturn ret = kIOReturnSuccess;
+    uint32_t wire_offset = 0;
+    
+    IOLockLock(m_command_lock);
+    
+    if (m_finalized) {
+        IOLockUnlock(m_command_lock);
+        return kIOReturnSuccess;
+    }
+    // A one-time buffer would pay for an image it never reuses
+    if (m_state != VM_COMMAND_BUFFER_STATE_EXECUTABLE ||
+        (m_usage_flags & VM_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT)) {
+        IOLockUnlock(m_command_lock);
+        return kIOReturnNotPermitted;
+    }
+    
+    if (!m_optimized)
+        optimizeLocked();
+    
+    // A single chunk already is the image, otherwise pack them once
+    if (m_chunk_index == 0) {
+        m_wire = (IOBufferMemoryDescriptor*)m_chunks->getObject(0);
+        m_wire->retain();
+    } else {
+        m_wire = IOBufferMemoryDescriptor::withCapacity(m_current_size ? m_current_size : VM_COMMAND_ALIGNMENT,
+                                                        kIODirectionOut);
+        if (!m_wire) {
+            IOLockUnlock(m_command_lock);
+            return kIOReturnNoMemory;
+        }
+        uint8_t* dst = (uint8_t*)m_wire->getBytesNoCopy();
+        for (unsigned int i = 0; i <= m_chunk_index; i++) {
+            IOBufferMemoryDescriptor* chunk = (IOBufferMemoryDescriptor*)m_chunks->getObject(i);
+            size_t length = chunk ? chunk->getLength() : 0;
+            if (length)
+                memcpy(dst + wire_offset, chunk->getBytesNoCopy(), length);
+            wire_offset += (uint32_t)length;
+        }
+        m_wire->setLength(wire_offset);
+    }
+    
+    // Note where every resource id landed
+    m_relocation_count = 0;
+    uint8_t* base = (uint8_t*)m_wire->getBytesNoCopy();
+    size_t length = m_wire->getLength();
+    for (size_t offset = 0; offset < length && ret == kIOReturnSuccess; ) {
+        VMCommandHeader* header = (VMCommandHeader*)(base + offset);
+        ret = addRelocations(header, (uint32_t)offset);
+        offset += VMCommandRecordSize(header->size);
+    }
+    
+    if (ret == kIOReturnSuccess)
+        m_finalized = true;
+    else
+        releaseWire();
+    
+    IOLockUnlock(m_command_lock);
+    return ret;
+}
+
+IOReturn CLASS::patchResource(uint32_t old_resource_id, uint32_t new_resource_id)
+{
+    uint32_t patched = 0;
+    
+    IOLockLock(m_command_lock);
+    
+    if (!m_finalized) {
+        IOLockUnlock(m_command_lock);
+        return kIOReturnNotReady;
+    }
+    if (m_state == VM_COMMAND_BUFFER_STATE_PENDING) {
+        IOLockUnlock(m_command_lock);
+        return kIOReturnBusy;
+    }
+    
+    uint8_t* base = (uint8_t*)m_wire->getBytesNoCopy();
+    for (uint32_t i = 0; i < m_relocation_count; i++) {
+        VMCommandRelocation* relocation = &m_relocations[i];
+        if (relocation->resource_id != old_resource_id)
+            continue;
+        *(uint32_t*)(base + relocation->offset) = new_resource_id;
+        relocation->resource_id = new_resource_id;
+        patched++;
+    }
+    if (patched)
+        m_encoded = false;
+    
+    IOLockUnlock(m_command_lock);
+    return patched ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+IOReturn CLASS::submitAndWait()
+{
+    return submit();
+}
+
 IOReturn CLASS::addDrawCommand(VMDrawCommandDescriptor* descriptor)
 {
     if (!descriptor)
@@ -143,81 +584,687 @@ IOReturn CLASS::addDrawCommand(VMDrawCommandDescriptor* descriptor)
     
     IOLockLock(m_command_lock);
     
-    if (m_state != VM_COMMAND_BUFFER_STATE_INITIAL) {
+    VMDrawCommand* command = (VMDrawCommand*)allocateCommand(VM_CMD_DRAW, sizeof(VMDrawCommandDescriptor));
+    if (!command) {
+        IOReturn ret = allocationError();
         IOLockUnlock(m_command_lock);
-        return kIOReturnNotPermitted;
+        return ret;
     }
     
-    if (m_command_count >= m_max_commands) {
+    command->vertex_count = descriptor->vertex_count;
+    command->instance_count = descriptor->instance_count;
+    command->first_vertex = descriptor->first_vertex;
+    command->first_instance = descriptor->first_instance;
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::addComputeCommand(VMComputeCommandDescriptor* descriptor)
+{
+    if (!descriptor)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_command_lock);
+    
+    VMCommandHeader* command = allocateCommand(VM_CMD_DISPATCH, sizeof(VMComputeCommandDescriptor));
+    if (!command) {
+        IOReturn ret = allocationError();
         IOLockUnlock(m_command_lock);
-        return kIOReturnNoSpace;
+        return ret;
     }
     
-    // Create command
-    VMGPUCommand* command = (VMGPUCommand*)IOMalloc(sizeof(VMGPUCommand));
+    memcpy(command + 1, descriptor, sizeof(VMComputeCommandDescriptor));
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::bindPipeline(uint32_t pipeline_id, bool is_compute, VMPrimitiveTopology topology)
+{
+    if (topology >= VM_PRIMITIVE_TOPOLOGY_COUNT)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_command_lock);
+    
+    VMBindPipelineCommand* command = (VMBindPipelineCommand*)allocateCommand(
+        is_compute ? VM_CMD_BIND_COMPUTE_PIPELINE : VM_CMD_BIND_PIPELINE,
+        sizeof(VMBindPipelineCommand) - sizeof(VMCommandHeader));
     if (!command) {
+        IOReturn ret = allocationError();
         IOLockUnlock(m_command_lock);
-        return kIOReturnNoMemory;
+        return ret;
     }
     
-    bzero(command, sizeof(VMGPUCommand));
-    command->header.type = VM_CMD_DRAW;
-    command->header.sequence = m_command_count++;
-    command->header.size = sizeof(VMDrawCommandDescriptor);
+    command->pipeline_id = pipeline_id;
+    command->topology = is_compute ? 0 : topology;
     
-    // Copy descriptor
-    void* data_ptr = (void*)&command->data[0];
-    memcpy(data_ptr, descriptor, sizeof(VMDrawCommandDescriptor));
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::bindVertexBuffers(uint32_t first_binding, uint32_t binding_count,
+                                  const uint32_t* buffer_ids, const uint64_t* offsets,
+                                  const uint32_t* strides)
+{
+    if (!binding_count || !buffer_ids || binding_count > 0xFFFF)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_command_lock);
+    
+    VMBindVertexBuffersCommand* command = (VMBindVertexBuffersCommand*)allocateCommand(
+        VM_CMD_BIND_VERTEX_BUFFERS,
+        sizeof(VMBindVertexBuffersCommand) - sizeof(VMCommandHeader) +
+        binding_count * sizeof(VMVertexBufferBinding));
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
+    }
     
-    // Add to command list
-    m_commands->setObject((OSObject*)command);
-    m_current_size += command->header.size;
+    command->first_binding = first_binding;
+    command->binding_count = binding_count;
+    for (uint32_t i = 0; i < binding_count; i++) {
+        command->bindings[i].buffer_id = buffer_ids[i];
+        command->bindings[i].stride = strides ? strides[i] : 0;
+        command->bindings[i].offset = offsets ? offsets[i] : 0;
+    }
     
     IOLockUnlock(m_command_lock);
     return kIOReturnSuccess;
 }
 
-IOReturn CLASS::addComputeCommand(VMComputeCommandDescriptor* descriptor)
+IOReturn CLASS::bindIndexBuffer(uint32_t buffer_id, uint64_t offset, bool is_16bit)
 {
-    if (!descriptor)
+    IOLockLock(m_command_lock);
+    
+    VMBindIndexBufferCommand* command = (VMBindIndexBufferCommand*)allocateCommand(
+        VM_CMD_BIND_INDEX_BUFFER,
+        sizeof(VMBindIndexBufferCommand) - sizeof(VMCommandHeader));
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
+    }
+    
+    command->buffer_id = buffer_id;
+    command->index_size = is_16bit ? 2 : 4;
+    command->offset = offset;
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::draw(uint32_t vertex_count, uint32_t instance_count,
+                     uint32_t first_vertex, uint32_t first_instance)
+{
+    IOLockLock(m_command_lock);
+    
+    VMDrawCommand* command = (VMDrawCommand*)allocateCommand(VM_CMD_DRAW,
+        sizeof(VMDrawCommand) - sizeof(VMCommandHeader));
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
+    }
+    
+    command->vertex_count = vertex_count;
+    command->instance_count = instance_count;
+    command->first_vertex = first_vertex;
+    command->first_instance = first_instance;
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::drawIndexed(uint32_t index_count, uint32_t instance_count,
+                            uint32_t first_index, int32_t vertex_offset,
+                            uint32_t first_instance)
+{
+    IOLockLock(m_command_lock);
+    
+    VMDrawIndexedCommand* command = (VMDrawIndexedCommand*)allocateCommand(VM_CMD_DRAW_INDEXED,
+        sizeof(VMDrawIndexedCommand) - sizeof(VMCommandHeader));
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
+    }
+    
+    command->index_count = index_count;
+    command->instance_count = instance_count;
+    command->first_index = first_index;
+    command->vertex_offset = vertex_offset;
+    command->first_instance = first_instance;
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::recordIndirectDraw(VMGPUCommandType type, uint32_t buffer_id, uint64_t offset,
+                                   uint32_t draw_count, uint32_t stride)
+{
+    uint32_t args_size = (type == VM_CMD_DRAW_INDEXED_INDIRECT) ?
+        sizeof(VMDrawIndexedIndirectArgs) : sizeof(VMDrawIndirectArgs);
+    
+    // A single draw has no stride, give it the packed one so neighbours can merge
+    if (draw_count == 1 && stride < args_size)
+        stride = args_size;
+    if (!buffer_id || draw_count > VM_COMMAND_MAX_INDIRECT_DRAWS ||
+        (offset & 3) || (stride & 3) || stride < args_size)
         return kIOReturnBadArgument;
+    if (!draw_count)
+        return kIOReturnSuccess;
     
     IOLockLock(m_command_lock);
     
-    if (m_state != VM_COMMAND_BUFFER_STATE_INITIAL) {
+    VMDrawIndirectCommand* command = (VMDrawIndirectCommand*)allocateCommand(type,
+        sizeof(VMDrawIndirectCommand) - sizeof(VMCommandHeader));
+    if (!command) {
+        IOReturn ret = allocationError();
         IOLockUnlock(m_command_lock);
-        return kIOReturnNotPermitted;
+        return ret;
     }
     
-    if (m_command_count >= m_max_commands) {
+    command->buffer_id = buffer_id;
+    command->draw_count = draw_count;
+    command->offset = offset;
+    command->stride = stride;
+    command->reserved = 0;
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::drawIndirect(uint32_t buffer_id, uint64_t offset, uint32_t draw_count, uint32_t stride)
+{
+    return recordIndirectDraw(VM_CMD_DRAW_INDIRECT, buffer_id, offset, draw_count, stride);
+}
+
+IOReturn CLASS::drawIndexedIndirect(uint32_t buffer_id, uint64_t offset, uint32_t draw_count, uint32_t stride)
+{
+    return recordIndirectDraw(VM_CMD_DRAW_INDEXED_INDIRECT, buffer_id, offset, draw_count, stride);
+}
+
+IOReturn CLASS::copyBuffer(uint32_t src_buffer_id, uint32_t dst_buffer_id,
+                           uint64_t src_offset, uint64_t dst_offset, uint64_t size)
+{
+    if (!src_buffer_id || !dst_buffer_id || !size)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_command_lock);
+    
+    VMCopyBufferCommand* command = (VMCopyBufferCommand*)allocateCommand(VM_CMD_COPY_BUFFER,
+        sizeof(VMCopyBufferCommand) - sizeof(VMCommandHeader));
+    if (!command) {
+        IOReturn ret = allocationError();
         IOLockUnlock(m_command_lock);
-        return kIOReturnNoSpace;
+        return ret;
+    }
+    
+    command->src_buffer_id = src_buffer_id;
+    command->dst_buffer_id = dst_buffer_id;
+    command->src_offset = src_offset;
+    command->dst_offset = dst_offset;
+    command->size = size;
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::updateBuffer(uint32_t buffer_id, uint64_t offset, const void* data, size_t size)
+{
+    // Same limits as vkCmdUpdateBuffer, the data travels inline in the stream
+    if (!buffer_id || !data || !size || size > VM_UPDATE_BUFFER_MAX || (size & 3) || (offset & 3))
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_command_lock);
+    
+    VMUpdateBufferCommand* command = (VMUpdateBufferCommand*)allocateCommand(VM_CMD_UPDATE_BUFFER,
+        (uint32_t)(sizeof(VMUpdateBufferCommand) - sizeof(VMCommandHeader) + size));
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
     }
     
-    // Create command
-    VMGPUCommand* command = (VMGPUCommand*)IOMalloc(sizeof(VMGPUCommand));
+    command->buffer_id = buffer_id;
+    command->data_size = (uint32_t)size;
+    command->offset = offset;
+    memcpy(command->data, data, size);
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::setViewport(uint32_t first_viewport, uint32_t viewport_count,
+                            const VMViewport* viewports)
+{
+    if (!viewport_count || !viewports || viewport_count > 0xFFFF)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_command_lock);
+    
+    VMSetViewportCommand* command = (VMSetViewportCommand*)allocateCommand(VM_CMD_SET_VIEWPORT,
+        sizeof(VMSetViewportCommand) - sizeof(VMCommandHeader) + viewport_count * sizeof(VMViewport));
     if (!command) {
+        IOReturn ret = allocationError();
         IOLockUnlock(m_command_lock);
-        return kIOReturnNoMemory;
+        return ret;
+    }
+    
+    command->first_viewport = first_viewport;
+    command->viewport_count = viewport_count;
+    memcpy(command->viewports, viewports, viewport_count * sizeof(VMViewport));
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::setScissor(uint32_t first_scissor, uint32_t scissor_count,
+                           const VMRect2D* scissors)
+{
+    if (!scissor_count || !scissors || scissor_count > 0xFFFF)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_command_lock);
+    
+    VMSetScissorCommand* command = (VMSetScissorCommand*)allocateCommand(VM_CMD_SET_SCISSOR,
+        sizeof(VMSetScissorCommand) - sizeof(VMCommandHeader) + scissor_count * sizeof(VMRect2D));
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
     }
     
-    bzero(command, sizeof(VMGPUCommand));
-    command->header.type = VM_CMD_DISPATCH;
-    command->header.sequence = m_command_count++;
-    command->header.size = sizeof(VMComputeCommandDescriptor);
+    command->first_scissor = first_scissor;
+    command->scissor_count = scissor_count;
+    memcpy(command->scissors, scissors, scissor_count * sizeof(VMRect2D));
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::recordBarrier(VMGPUCommandType type, uint32_t src_stage_mask,
+                              uint32_t dst_stage_mask, uint32_t dependency_flags)
+{
+    IOLockLock(m_command_lock);
     
-    // Copy descriptor
-    void* data_ptr = (void*)&command->data[0];
-    memcpy(data_ptr, descriptor, sizeof(VMComputeCommandDescriptor));
+    VMPipelineBarrierCommand* command = (VMPipelineBarrierCommand*)allocateCommand(type,
+        sizeof(VMPipelineBarrierCommand) - sizeof(VMCommandHeader));
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
+    }
     
-    // Add to command list
-    m_commands->setObject((OSObject*)command);
-    m_current_size += command->header.size;
+    bzero(&command->src_stage_mask, sizeof(VMPipelineBarrierCommand) - sizeof(VMCommandHeader));
+    command->src_stage_mask = src_stage_mask;
+    command->dst_stage_mask = dst_stage_mask;
+    command->dependency_flags = dependency_flags;
     
     IOLockUnlock(m_command_lock);
     return kIOReturnSuccess;
 }
 
+IOReturn CLASS::pipelineBarrier(uint32_t src_stage_mask, uint32_t dst_stage_mask,
+                                uint32_t dependency_flags)
+{
+    return recordBarrier(VM_CMD_PIPELINE_BARRIER, src_stage_mask, dst_stage_mask, dependency_flags);
+}
+
+IOReturn CLASS::memoryBarrier()
+{
+    return recordBarrier(VM_CMD_MEMORY_BARRIER, VM_PIPELINE_STAGE_ALL_COMMANDS,
+                         VM_PIPELINE_STAGE_ALL_COMMANDS, 0);
+}
+
+IOReturn CLASS::executionBarrier()
+{
+    return recordBarrier(VM_CMD_EXECUTION_BARRIER, VM_PIPELINE_STAGE_ALL_COMMANDS,
+                         VM_PIPELINE_STAGE_ALL_COMMANDS, 0);
+}
+
+IOReturn CLASS::recordDebugLabel(VMGPUCommandType type, const char* label_name, const float* color)
+{
+    uint32_t length = 0;
+    uint32_t size = 0;
+    
+    if (type != VM_CMD_END_DEBUG_LABEL) {
+        if (!label_name)
+            return kIOReturnBadArgument;
+        length = (uint32_t)strnlen(label_name, VM_DEBUG_LABEL_MAX - 1);
+        size = sizeof(VMDebugLabelCommand) - sizeof(VMCommandHeader) + length + 1;
+    }
+    
+    IOLockLock(m_command_lock);
+    
+    if (type == VM_CMD_END_DEBUG_LABEL && !m_label_depth) {
+        IOLockUnlock(m_command_lock);
+        return kIOReturnNotPermitted;
+    }
+    
+    VMDebugLabelCommand* command = (VMDebugLabelCommand*)allocateCommand(type, size);
+    if (!command) {
+        IOReturn ret = allocationError();
+        IOLockUnlock(m_command_lock);
+        return ret;
+    }
+    
+    if (type == VM_CMD_END_DEBUG_LABEL) {
+        m_label_depth--;
+    } else {
+        if (color)
+            memcpy(command->color, color, sizeof(command->color));
+        else
+            bzero(command->color, sizeof(command->color));
+        memcpy(command->name, label_name, length);
+        command->name[length] = 0;
+        if (type == VM_CMD_BEGIN_DEBUG_LABEL)
+            m_label_depth++;
+    }
+    
+    IOLockUnlock(m_command_lock);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::beginDebugLabel(const char* label_name, const float* color)
+{
+    return recordDebugLabel(VM_CMD_BEGIN_DEBUG_LABEL, label_name, color);
+}
+
+IOReturn CLASS::endDebugLabel()
+{
+    return recordDebugLabel(VM_CMD_END_DEBUG_LABEL, nullptr, nullptr);
+}
+
+IOReturn CLASS::insertDebugLabel(const char* label_name, const float* color)
+{
+    return recordDebugLabel(VM_CMD_INSERT_DEBUG_LABEL, label_name, color);
+}
+
+// State optimizeCommands() knows the host to be in, per command buffer
+#define VM_OPT_MAX_VIEWPORTS        16
+#define VM_OPT_MAX_VERTEX_BINDINGS  32
+
+struct VMCommandOptimizerState {
+    uint32_t viewport_known;                // Bit per viewport slot
+    uint32_t scissor_known;
+    uint32_t vertex_known;
+    bool pipeline_known;
+    bool compute_pipeline_known;
+    uint32_t pipeline_id;
+    uint32_t pipeline_topology;
+    uint32_t compute_pipeline_id;
+    VMViewport viewports[VM_OPT_MAX_VIEWPORTS];
+    VMRect2D scissors[VM_OPT_MAX_VIEWPORTS];
+    VMVertexBufferBinding vertex_bindings[VM_OPT_MAX_VERTEX_BINDINGS];
+};
+
+// Returns true if every slot in the range already holds 'values', otherwise records them
+static bool OptimizerUpdateSlots(uint32_t* known, void* slots, size_t slot_size, uint32_t max_slots,
+                                 uint32_t first, uint32_t count, const void* values)
+{
+    bool redundant = true;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* value = (const uint8_t*)values + i * slot_size;
+        uint32_t slot = first + i;
+        if (slot >= max_slots) {
+            // Beyond what we track, never provably redundant
+            redundant = false;
+            continue;
+        }
+        uint8_t* current = (uint8_t*)slots + slot * slot_size;
+        if (!(*known & (1U << slot)) || memcmp(current, value, slot_size)) {
+            redundant = false;
+            memcpy(current, value, slot_size);
+            *known |= (1U << slot);
+        }
+    }
+    return redundant;
+}
+
+static inline bool IsBarrierCommand(uint32_t type)
+{
+    return type == VM_CMD_PIPELINE_BARRIER || type == VM_CMD_MEMORY_BARRIER ||
+           type == VM_CMD_EXECUTION_BARRIER;
+}
+
+IOReturn CLASS::optimizeCommands()
+{
+    IOLockLock(m_command_lock);
+    
+    IOReturn ret = validateState(VM_COMMAND_BUFFER_STATE_EXECUTABLE);
+    if (ret == kIOReturnSuccess && !m_optimized)
+        ret = optimizeLocked();
+    
+    IOLockUnlock(m_command_lock);
+    return ret;
+}
+
+/*
+ * Single pass over the recorded stream, compacting each chunk in place:
+ * - state commands that set what is already current are dropped
+ * - a draw continuing its neighbour's instance range is folded into it,
+ *   other adjacent draws are packed into one VM_CMD_MULTI_DRAW
+ * - an indirect draw whose argument records follow its neighbour's in the
+ *   same buffer is folded into it
+ * - back-to-back barriers without resource barriers become one barrier,
+ *   barriers with work between them are kept as recorded since draws touch
+ *   shader and attachment state the stream does not describe
+ * The output never grows faster than the input is consumed, so records are
+ * only ever moved towards the start of their chunk.
+ */
+IOReturn CLASS::optimizeLocked()
+{
+    VMCommandOptimizerState* state;
+    uint32_t removed = 0;
+    size_t total = 0;
+    
+    state = (VMCommandOptimizerState*)IOMalloc(sizeof(VMCommandOptimizerState));
+    if (!state)
+        return kIOReturnNoMemory;
+    bzero(state, sizeof(VMCommandOptimizerState));
+    
+    for (unsigned int c = 0; c <= m_chunk_index; c++) {
+        IOBufferMemoryDescriptor* chunk = (IOBufferMemoryDescriptor*)m_chunks->getObject(c);
+        if (!chunk)
+            continue;
+        uint8_t* base = (uint8_t*)chunk->getBytesNoCopy();
+        size_t length = chunk->getLength();
+        size_t in = 0, out = 0;
+        VMCommandHeader* last = nullptr;    // Previous record kept in this chunk
+        
+        while (in < length) {
+            VMCommandHeader* header = (VMCommandHeader*)(base + in);
+            size_t record_size = VMCommandRecordSize(header->size);
+            bool drop = false;
+            in += record_size;
+            
+            switch (header->type) {
+                case VM_CMD_SET_VIEWPORT: {
+                    VMSetViewportCommand* cmd = (VMSetViewportCommand*)header;
+                    drop = OptimizerUpdateSlots(&state->viewport_known, state->viewports, sizeof(VMViewport),
+                                                VM_OPT_MAX_VIEWPORTS, cmd->first_viewport,
+                                                cmd->viewport_count, cmd->viewports);
+                    if (drop)
+                        m_optimization_stats.redundant_state_removed++;
+                    break;
+                }
+                case VM_CMD_SET_SCISSOR: {
+                    VMSetScissorCommand* cmd = (VMSetScissorCommand*)header;
+                    drop = OptimizerUpdateSlots(&state->scissor_known, state->scissors, sizeof(VMRect2D),
+                                                VM_OPT_MAX_VIEWPORTS, cmd->first_scissor,
+                                                cmd->scissor_count, cmd->scissors);
+                    if (drop)
+                        m_optimization_stats.redundant_state_removed++;
+                    break;
+                }
+                case VM_CMD_BIND_VERTEX_BUFFERS: {
+                    VMBindVertexBuffersCommand* cmd = (VMBindVertexBuffersCommand*)header;
+                    drop = OptimizerUpdateSlots(&state->vertex_known, state->vertex_bindings,
+                                                sizeof(VMVertexBufferBinding), VM_OPT_MAX_VERTEX_BINDINGS,
+                                                cmd->first_binding, cmd->binding_count, cmd->bindings);
+                    if (drop)
+                        m_optimization_stats.redundant_state_removed++;
+                    break;
+                }
+                case VM_CMD_BIND_PIPELINE: {
+                    VMBindPipelineCommand* cmd = (VMBindPipelineCommand*)header;
+                    drop = state->pipeline_known && state->pipeline_id == cmd->pipeline_id &&
+                           state->pipeline_topology == cmd->topology;
+                    state->pipeline_known = true;
+                    state->pipeline_id = cmd->pipeline_id;
+                    state->pipeline_topology = cmd->topology;
+                    if (drop)
+                        m_optimization_stats.redundant_state_removed++;
+                    break;
+                }
+                case VM_CMD_BIND_COMPUTE_PIPELINE: {
+                    VMBindPipelineCommand* cmd = (VMBindPipelineCommand*)header;
+                    drop = state->compute_pipeline_known && state->compute_pipeline_id == cmd->pipeline_id;
+                    state->compute_pipeline_known = true;
+                    state->compute_pipeline_id = cmd->pipeline_id;
+                    if (drop)
+                        m_optimization_stats.redundant_state_removed++;
+                    break;
+                }
+                case VM_CMD_DRAW: {
+                    VMDrawCommandDescriptor draw;
+                    memcpy(&draw, header + 1, sizeof(draw));
+                    if (!last)
+                        break;
+                    if (last->type == VM_CMD_DRAW) {
+                        VMDrawCommand* prev = (VMDrawCommand*)last;
+                        if (prev->vertex_count == draw.vertex_count &&
+                            prev->first_vertex == draw.first_vertex &&
+                            prev->first_instance + prev->instance_count == draw.first_instance) {
+                            prev->instance_count += draw.instance_count;
+                            m_optimization_stats.draws_merged_instanced++;
+                            drop = true;
+                            break;
+                        }
+                        // Rewrite the previous draw as a two entry multi-draw
+                        VMMultiDrawCommand* multi = (VMMultiDrawCommand*)last;
+                        VMDrawCommandDescriptor first;
+                        memcpy(&first, &prev->vertex_count, sizeof(first));
+                        multi->header.type = VM_CMD_MULTI_DRAW;
+                        multi->header.size = sizeof(VMMultiDrawCommand) - sizeof(VMCommandHeader) +
+                                             2 * sizeof(VMDrawCommandDescriptor);
+                        multi->draw_count = 2;
+                        multi->reserved = 0;
+                        multi->draws[0] = first;
+                        multi->draws[1] = draw;
+                        out = (uint8_t*)last - base + VMCommandRecordSize(multi->header.size);
+                        m_optimization_stats.draws_merged_multi++;
+                        drop = true;
+                    } else if (last->type == VM_CMD_MULTI_DRAW) {
+                        VMMultiDrawCommand* multi = (VMMultiDrawCommand*)last;
+                        VMDrawCommandDescriptor* prev = &multi->draws[multi->draw_count - 1];
+                        if (prev->vertex_count == draw.vertex_count &&
+                            prev->first_vertex == draw.first_vertex &&
+                            prev->first_instance + prev->instance_count == draw.first_instance) {
+                            prev->instance_count += draw.instance_count;
+                            m_optimization_stats.draws_merged_instanced++;
+                        } else {
+                            multi->draws[multi->draw_count++] = draw;
+                            multi->header.size += sizeof(VMDrawCommandDescriptor);
+                            out = (uint8_t*)last - base + VMCommandRecordSize(multi->header.size);
+                            m_optimization_stats.draws_merged_multi++;
+                        }
+                        drop = true;
+                    }
+                    break;
+                }
+                case VM_CMD_DRAW_INDEXED: {
+                    VMDrawIndexedCommand* cmd = (VMDrawIndexedCommand*)header;
+                    if (last && last->type == VM_CMD_DRAW_INDEXED) {
+                        VMDrawIndexedCommand* prev = (VMDrawIndexedCommand*)last;
+                        if (prev->index_count == cmd->index_count &&
+                            prev->first_index == cmd->first_index &&
+                            prev->vertex_offset == cmd->vertex_offset &&
+                            prev->first_instance + prev->instance_count == cmd->first_instance) {
+                            prev->instance_count += cmd->instance_count;
+                            m_optimization_stats.draws_merged_instanced++;
+                            drop = true;
+                        }
+                    }
+                    break;
+                }
+                case VM_CMD_DRAW_INDIRECT:
+                case VM_CMD_DRAW_INDEXED_INDIRECT: {
+                    VMDrawIndirectCommand* cmd = (VMDrawIndirectCommand*)header;
+                    if (last && last->type == header->type) {
+                        VMDrawIndirectCommand* prev = (VMDrawIndirectCommand*)last;
+                        if (prev->buffer_id == cmd->buffer_id && prev->stride == cmd->stride &&
+                            prev->offset + (uint64_t)prev->draw_count * prev->stride == cmd->offset &&
+                            prev->draw_count + cmd->draw_count <= VM_COMMAND_MAX_INDIRECT_DRAWS) {
+                            prev->draw_count += cmd->draw_count;
+                            m_optimization_stats.indirect_draws_merged++;
+                            drop = true;
+                        }
+                    }
+                    break;
+                }
+                case VM_CMD_PIPELINE_BARRIER:
+                case VM_CMD_MEMORY_BARRIER:
+                case VM_CMD_EXECUTION_BARRIER: {
+                    VMPipelineBarrierCommand* cmd = (VMPipelineBarrierCommand*)header;
+                    if (last && IsBarrierCommand(last->type)) {
+                        VMPipelineBarrierCommand* prev = (VMPipelineBarrierCommand*)last;
+                        if (!prev->memory_barrier_count && !prev->buffer_memory_barrier_count &&
+                            !prev->image_memory_barrier_count && !cmd->memory_barrier_count &&
+                            !cmd->buffer_memory_barrier_count && !cmd->image_memory_barrier_count) {
+                            prev->src_stage_mask |= cmd->src_stage_mask;
+                            prev->dst_stage_mask |= cmd->dst_stage_mask;
+                            prev->dependency_flags |= cmd->dependency_flags;
+                            // A memory barrier also orders memory, keep the stronger kind
+                            if (header->type == VM_CMD_MEMORY_BARRIER)
+                                prev->header.type = VM_CMD_MEMORY_BARRIER;
+                            m_optimization_stats.barriers_collapsed++;
+                            drop = true;
+                        }
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+            
+            if (drop) {
+                removed++;
+                continue;
+            }
+            if (out != (size_t)((uint8_t*)header - base))
+                memmove(base + out, header, record_size);
+            last = (VMCommandHeader*)(base + out);
+            out += record_size;
+        }
+        
+        m_optimization_stats.bytes_saved += (uint32_t)(length - out);
+        chunk->setLength(out);
+        if (c == m_chunk_index)
+            m_current_offset = out;
+        total += out;
+    }
+    
+    IOFree(state, sizeof(VMCommandOptimizerState));
+    
+    m_current_size = total;
+    m_command_count -= removed;
+    m_optimized = true;
+    
+    if (m_debug_enabled && removed)
+        IOLog("VMCommandBuffer: optimized out %u commands (%u state, %u instanced, %u multi-draw, %u indirect, %u barriers), %u bytes\n",
+              removed, m_optimization_stats.redundant_state_removed,
+              m_optimization_stats.draws_merged_instanced, m_optimization_stats.draws_merged_multi,
+              m_optimization_stats.indirect_draws_merged,
+              m_optimization_stats.barriers_collapsed,
+              m_optimization_stats.bytes_saved);
+    return kIOReturnSuccess;
+}
+
 IOReturn CLASS::addResourceBinding(uint32_t binding_point, uint32_t resource_id, uint32_t resource_type)
 {
     IOLockLock(m_command_lock);
@@ -244,13 +1291,43 @@ IOReturn CLASS::addResourceBinding(uint32_t binding_point, uint32_t resource_id,
     return kIOReturnSuccess;
 }
 
-void CLASS::cleanupCommand(VMGPUCommand* command)
+uint64_t CLASS::benchmarkRecording(VMQemuVGAAccelerator* accelerator,
+                                  uint32_t draws_per_frame, uint32_t frames)
 {
-    if (!command)
-        return;
-        
-    // Free the command structure  
-    IOFree(command, sizeof(VMGPUCommand));
+    VMDrawCommandDescriptor descriptor = { 3, 1, 0, 0 };
+    uint64_t start, elapsed, nsec;
+    uint64_t commands = 0;
+    
+    VMCommandBuffer* buffer = VMCommandBuffer::withAccelerator(accelerator, 0);
+    if (!buffer)
+        return 0;
+    
+    // One frame first so the timed loop runs on recycled chunks
+    buffer->begin();
+    for (uint32_t i = 0; i < draws_per_frame; i++)
+        buffer->addDrawCommand(&descriptor);
+    buffer->end();
+    buffer->reset();
+    
+    start = mach_absolute_time();
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        buffer->begin();
+        for (uint32_t i = 0; i < draws_per_frame; i++) {
+            descriptor.first_vertex = i * 3;
+            if (buffer->addDrawCommand(&descriptor) == kIOReturnSuccess)
+                commands++;
+        }
+        buffer->end();
+        buffer->reset();
+    }
+    elapsed = mach_absolute_time() - start;
+    absolutetime_to_nanoseconds(elapsed, &nsec);
+    
+    IOLog("VMCommandBuffer: recorded %llu commands in %llu us, %u chunk(s) per frame\n",
+          commands, nsec / 1000, buffer->m_chunks->getCount());
+    buffer->release();
+    
+    return nsec ? (commands * 1000000000ULL) / nsec : 0;
 }
 
 // Command buffer pool implementation
@@ -275,14 +1352,28 @@ bool VMCommandBufferPool::init(VMQemuVGAAccelerator* accelerator, uint32_t conte
     m_accelerator = accelerator;
     m_context_id = context_id;
     m_max_buffers = max_buffers;
+    m_stack_head = 0;
+    m_created = 0;
     
-    m_available_buffers = OSArray::withCapacity(max_buffers);
-    if (!m_available_buffers)
+    if (!max_buffers)
         return false;
-        
-    m_active_buffers = OSArray::withCapacity(max_buffers);
-    if (!m_active_buffers)
+    
+    m_buffers = (VMCommandBuffer**)IOMalloc(max_buffers * sizeof(VMCommandBuffer*));
+    if (!m_buffers)
         return false;
+    bzero(m_buffers, max_buffers * sizeof(VMCommandBuffer*));
+    
+    m_stack_next = (volatile UInt32*)IOMalloc(max_buffers * sizeof(UInt32));
+    if (!m_stack_next)
+        return false;
+    bzero((void*)m_stack_next, max_buffers * sizeof(UInt32));
+    
+    // One cache line per magazine so neighbours never share a line
+    m_magazines = (VMCommandPoolMagazine*)IOMallocAligned(VM_COMMAND_POOL_MAGAZINES * sizeof(VMCommandPoolMagazine),
+                                                          VM_COMMAND_POOL_CACHE_LINE);
+    if (!m_magazines)
+        return false;
+    bzero(m_magazines, VM_COMMAND_POOL_MAGAZINES * sizeof(VMCommandPoolMagazine));
         
     m_pool_lock = IOLockAlloc();
     if (!m_pool_lock)
@@ -293,14 +1384,23 @@ bool VMCommandBufferPool::init(VMQemuVGAAccelerator* accelerator, uint32_t conte
 
 void VMCommandBufferPool::free()
 {
-    if (m_available_buffers) {
-        m_available_buffers->release();
-        m_available_buffers = nullptr;
+    if (m_buffers) {
+        for (uint32_t i = 0; i < m_max_buffers; i++) {
+            if (m_buffers[i])
+                m_buffers[i]->release();
+        }
+        IOFree(m_buffers, m_max_buffers * sizeof(VMCommandBuffer*));
+        m_buffers = nullptr;
+    }
+    
+    if (m_stack_next) {
+        IOFree((void*)m_stack_next, m_max_buffers * sizeof(UInt32));
+        m_stack_next = nullptr;
     }
     
-    if (m_active_buffers) {
-        m_active_buffers->release();
-        m_active_buffers = nullptr;
+    if (m_magazines) {
+        IOFreeAligned(m_magazines, VM_COMMAND_POOL_MAGAZINES * sizeof(VMCommandPoolMagazine));
+        m_magazines = nullptr;
     }
     
     if (m_pool_lock) {
@@ -311,68 +1411,288 @@ void VMCommandBufferPool::free()
     super::free();
 }
 
-IOReturn VMCommandBufferPool::allocateCommandBuffer(VMCommandBuffer** out_buffer)
+// Threads spread over the magazines by a multiplicative hash of the thread
+// pointer. Two threads sharing a magazine only cost locality: every slot
+// change is a single compare-and-swap
+static inline uint32_t VMCommandPoolMagazineIndex()
 {
-    if (!out_buffer)
-        return kIOReturnBadArgument;
-        
-    IOLockLock(m_pool_lock);
+    uint64_t hash = (uint64_t)(uintptr_t)IOThreadSelf() * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(hash >> 32) % VM_COMMAND_POOL_MAGAZINES;
+}
+
+bool VMCommandBufferPool::takeFromMagazine(uint32_t* slot)
+{
+    VMCommandPoolMagazine* magazine = &m_magazines[VMCommandPoolMagazineIndex()];
     
-    VMCommandBuffer* buffer = nullptr;
+    for (uint32_t i = 0; i < VM_COMMAND_POOL_MAGAZINE_SLOTS; i++) {
+        UInt32 entry = magazine->slots[i];
+        if (entry && OSCompareAndSwap(entry, 0, &magazine->slots[i])) {
+            *slot = entry - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool VMCommandBufferPool::putInMagazine(uint32_t slot)
+{
+    VMCommandPoolMagazine* magazine = &m_magazines[VMCommandPoolMagazineIndex()];
     
-    // Try to reuse an available buffer
-    if (m_available_buffers->getCount() > 0) {
-        buffer = (VMCommandBuffer*)m_available_buffers->getObject(0);
-        buffer->retain();
-        m_available_buffers->removeObject(0);
+    for (uint32_t i = 0; i < VM_COMMAND_POOL_MAGAZINE_SLOTS; i++) {
+        if (!magazine->slots[i] && OSCompareAndSwap(0, slot + 1, &magazine->slots[i]))
+            return true;
     }
+    return false;
+}
+
+bool VMCommandBufferPool::popStack(uint32_t* slot)
+{
+    UInt64 head, next;
+    UInt32 top;
+    
+    do {
+        head = m_stack_head;
+        top = (UInt32)head;
+        if (!top)
+            return false;
+        // m_stack_next never goes away, a stale read just fails the swap
+        next = (((head >> 32) + 1) << 32) | m_stack_next[top - 1];
+    } while (!OSCompareAndSwap64(head, next, &m_stack_head));
+    
+    *slot = top - 1;
+    return true;
+}
+
+void VMCommandBufferPool::pushStack(uint32_t slot)
+{
+    UInt64 head, next;
+    
+    do {
+        head = m_stack_head;
+        m_stack_next[slot] = (UInt32)head;
+        next = (((head >> 32) + 1) << 32) | (slot + 1);
+    } while (!OSCompareAndSwap64(head, next, &m_stack_head));
+}
+
+// Called with m_pool_lock held
+VMCommandBuffer* VMCommandBufferPool::createBuffer()
+{
+    if (m_created >= m_max_buffers)
+        return nullptr;
+    
+    // resetPool() can leave holes, take the first free slot
+    uint32_t slot = 0;
+    while (m_buffers[slot])
+        slot++;
+    
+    VMCommandBuffer* buffer = VMCommandBuffer::withAccelerator(m_accelerator, m_context_id);
+    if (!buffer)
+        return nullptr;
+    buffer->m_pool_slot = slot;
+    m_buffers[slot] = buffer;
+    m_created++;
+    return buffer;
+}
+
+IOReturn VMCommandBufferPool::allocateCommandBuffer(VMCommandBuffer** out_buffer)
+{
+    VMCommandBuffer* buffer = nullptr;
+    uint32_t slot;
+    
+    if (!out_buffer)
+        return kIOReturnBadArgument;
     
-    if (!buffer) {
+    // Reuse an idle buffer, this thread's magazine first
+    if (takeFromMagazine(&slot) || popStack(&slot)) {
+        buffer = m_buffers[slot];
+    } else {
         // Create new buffer if under limit
-        if (m_active_buffers->getCount() < m_max_buffers) {
-            buffer = VMCommandBuffer::withAccelerator(m_accelerator, m_context_id);
-        }
+        IOLockLock(m_pool_lock);
+        buffer = createBuffer();
+        IOLockUnlock(m_pool_lock);
     }
     
-    if (buffer) {
-        m_active_buffers->setObject(buffer);
-        *out_buffer = buffer;
-    }
+    if (!buffer)
+        return kIOReturnNoSpace;
     
-    IOLockUnlock(m_pool_lock);
-    return buffer ? kIOReturnSuccess : kIOReturnNoSpace;
+    // The caller's reference, dropped by releaseCommandBuffer()
+    buffer->retain();
+    *out_buffer = buffer;
+    return kIOReturnSuccess;
 }
 
 IOReturn VMCommandBufferPool::releaseCommandBuffer(VMCommandBuffer* buffer)
 {
     if (!buffer)
         return kIOReturnBadArgument;
-        
-    IOLockLock(m_pool_lock);
     
-    // Remove from active buffers
-    unsigned int index = m_active_buffers->getNextIndexOfObject(buffer, 0);
-    if (index != (unsigned int)-1) {
-        m_active_buffers->removeObject(index);
-    }
+    uint32_t slot = buffer->m_pool_slot;
+    if (slot >= m_max_buffers || m_buffers[slot] != buffer)
+        return kIOReturnBadArgument;
     
-    // Reset buffer and add to available list
+    // Reset buffer and make it available
     buffer->reset();
-    m_available_buffers->setObject(buffer);
+    if (!putInMagazine(slot))
+        pushStack(slot);
     
-    IOLockUnlock(m_pool_lock);
     buffer->release();
     return kIOReturnSuccess;
 }
 
 IOReturn VMCommandBufferPool::resetPool()
 {
+    uint32_t slot;
+    
     IOLockLock(m_pool_lock);
     
-    // Release all buffers
-    m_available_buffers->flushCollection();
-    m_active_buffers->flushCollection();
+    // Release every idle buffer, checked out ones come back as usual
+    for (uint32_t m = 0; m < VM_COMMAND_POOL_MAGAZINES; m++) {
+        VMCommandPoolMagazine* magazine = &m_magazines[m];
+        for (uint32_t i = 0; i < VM_COMMAND_POOL_MAGAZINE_SLOTS; i++) {
+            UInt32 entry = magazine->slots[i];
+            if (entry && OSCompareAndSwap(entry, 0, &magazine->slots[i])) {
+                m_buffers[entry - 1]->release();
+                m_buffers[entry - 1] = nullptr;
+                m_created--;
+            }
+        }
+    }
+    while (popStack(&slot)) {
+        m_buffers[slot]->release();
+        m_buffers[slot] = nullptr;
+        m_created--;
+    }
     
     IOLockUnlock(m_pool_lock);
     return kIOReturnSuccess;
 }
+
+uint32_t VMCommandBufferPool::getAvailableBufferCount() const
+{
+    uint32_t count = 0;
+    
+    for (uint32_t m = 0; m < VM_COMMAND_POOL_MAGAZINES; m++) {
+        for (uint32_t i = 0; i < VM_COMMAND_POOL_MAGAZINE_SLOTS; i++) {
+            if (m_magazines[m].slots[i])
+                count++;
+        }
+    }
+    // Bounded walk, the stack may change underneath
+    for (UInt32 entry = (UInt32)m_stack_head; entry && count < m_max_buffers; entry = m_stack_next[entry - 1])
+        count++;
+    
+    return count;
+}
+
+uint32_t VMCommandBufferPool::getActiveBufferCount() const
+{
+    uint32_t created = m_created;
+    uint32_t available = getAvailableBufferCount();
+    
+    return (created > available) ? created - available : 0;
+}
+
+struct VMPoolBenchWorker {
+    VMCommandBufferPool* pool;
+    uint32_t iterations;
+    uint32_t draws;
+    uint32_t completed;
+    IOLock* lock;
+    uint32_t* pending;
+    thread_call_t call;
+};
+
+static void VMPoolBenchRun(VMPoolBenchWorker* worker)
+{
+    VMDrawCommandDescriptor descriptor = { 3, 1, 0, 0 };
+    VMCommandBuffer* buffer;
+    
+    for (uint32_t i = 0; i < worker->iterations; i++) {
+        if (worker->pool->allocateCommandBuffer(&buffer) != kIOReturnSuccess)
+            continue;
+        buffer->begin(VM_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT);
+        for (uint32_t d = 0; d < worker->draws; d++)
+            buffer->addDrawCommand(&descriptor);
+        buffer->end();
+        worker->pool->releaseCommandBuffer(buffer);
+        worker->completed++;
+    }
+}
+
+static void VMPoolBenchCall(thread_call_param_t p0, thread_call_param_t p1)
+{
+    VMPoolBenchWorker* worker = (VMPoolBenchWorker*)p0;
+    
+    VMPoolBenchRun(worker);
+    
+    IOLockLock(worker->lock);
+    if (!--(*worker->pending))
+        IOLockWakeup(worker->lock, worker->pending, false);
+    IOLockUnlock(worker->lock);
+}
+
+uint64_t VMCommandBufferPool::benchmarkContention(VMQemuVGAAccelerator* accelerator, uint32_t threads,
+                                                  uint32_t iterations, uint32_t draws_per_buffer)
+{
+    VMPoolBenchWorker* workers;
+    VMCommandBufferPool* pool;
+    IOLock* lock;
+    uint64_t start, elapsed;
+    uint64_t nsec = 0;
+    uint64_t completed = 0;
+    uint32_t pending, t;
+    
+    if (!threads)
+        return 0;
+    
+    // Twice the workers so the global stack sees traffic, not just magazines
+    pool = VMCommandBufferPool::withAccelerator(accelerator, 0, threads * 2);
+    workers = IONew(VMPoolBenchWorker, threads);
+    lock = IOLockAlloc();
+    if (!pool || !workers || !lock)
+        goto done;
+    bzero(workers, threads * sizeof(VMPoolBenchWorker));
+    
+    for (t = 0; t < threads; t++) {
+        workers[t].pool = pool;
+        workers[t].iterations = iterations;
+        workers[t].draws = draws_per_buffer;
+        workers[t].lock = lock;
+        workers[t].pending = &pending;
+        if (t && !(workers[t].call = thread_call_allocate(&VMPoolBenchCall, &workers[t])))
+            goto done;
+    }
+    
+    // Worker 0 runs on this thread, the rest on thread calls
+    pending = threads - 1;
+    start = mach_absolute_time();
+    for (t = 1; t < threads; t++)
+        thread_call_enter(workers[t].call);
+    VMPoolBenchRun(&workers[0]);
+    IOLockLock(lock);
+    while (pending)
+        IOLockSleep(lock, &pending, THREAD_UNINT);
+    IOLockUnlock(lock);
+    elapsed = mach_absolute_time() - start;
+    absolutetime_to_nanoseconds(elapsed, &nsec);
+    
+    for (t = 0; t < threads; t++)
+        completed += workers[t].completed;
+    IOLog("VMCommandBufferPool: %u thread(s) cycled %llu buffers in %llu us, %u created\n",
+          threads, completed, nsec / 1000, (uint32_t)pool->m_created);
+    
+done:
+    if (workers) {
+        for (t = 0; t < threads; t++) {
+            if (workers[t].call)
+                thread_call_free(workers[t].call);
+        }
+        IODelete(workers, VMPoolBenchWorker, threads);
+    }
+    if (lock)
+        IOLockFree(lock);
+    if (pool)
+        pool->release();
+    
+    return (completed && nsec) ? (completed * 1000000000ULL) / nsec : 0;
+}
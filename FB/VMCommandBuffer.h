@@ -9,6 +9,7 @@
 // Forward declarations
 class VMQemuVGAAccelerator;
 class VMVirtIOGPU;
+class VMVirGLEncoder;
 
 // Function pointer typedef for command completion callbacks
 typedef void (*VMCommandBufferCallback)(void* context, IOReturn status);
@@ -28,6 +29,27 @@ typedef void (*VMCommandBufferCallback)(void* context, IOReturn status);
 #define VM_GPU_COMMAND_MAGIC              0x564D4350  // "VMCP"
 #define VM_GPU_COMMAND_VERSION            1
 
+// Command recording arena
+#define VM_COMMAND_CHUNK_SIZE             (64 * 1024) // Default chunk capacity
+#define VM_COMMAND_ALIGNMENT              8           // Every record starts 8-byte aligned
+#define VM_COMMAND_MAX_COMMANDS           (1 << 20)
+#define VM_COMMAND_MAX_SIZE               (64 * 1024 * 1024)
+
+// Indirect draws
+#define VM_COMMAND_MAX_INDIRECT_DRAWS     65536       // Per record, merged records included
+
+// Transfers
+#define VM_UPDATE_BUFFER_MAX              65536       // updateBuffer() inline data limit
+
+// Debug labels
+#define VM_DEBUG_LABEL_MAX                64          // Name bytes kept, NUL included
+#define VM_DEBUG_LABEL_DEPTH              8           // Nesting the profiler times separately
+
+// Command buffer pool
+#define VM_COMMAND_POOL_MAGAZINES         32          // Magazines, picked by a hash of the thread
+#define VM_COMMAND_POOL_MAGAZINE_SLOTS    4           // Idle buffers cached per magazine
+#define VM_COMMAND_POOL_CACHE_LINE        64
+
 // Command buffer states
 enum VMCommandBufferState {
     VM_COMMAND_BUFFER_STATE_INITIAL = 0,
@@ -50,6 +72,7 @@ enum VMGPUCommandType {
     VM_CMD_DRAW_INDEXED = 0x1007,
     VM_CMD_DRAW_INDIRECT = 0x1008,
     VM_CMD_DRAW_INDEXED_INDIRECT = 0x1009,
+    VM_CMD_MULTI_DRAW = 0x100A,
     
     // Compute commands
     VM_CMD_BIND_COMPUTE_PIPELINE = 0x2000,
@@ -139,6 +162,17 @@ struct VMGPUCommand {
     uint8_t data[];      // Command-specific data
 };
 
+// Bytes a record with 'size' bytes of command data occupies in the stream
+static inline size_t VMCommandRecordSize(uint32_t size)
+{
+    return (sizeof(VMCommandHeader) + size + (VM_COMMAND_ALIGNMENT - 1)) & ~(size_t)(VM_COMMAND_ALIGNMENT - 1);
+}
+
+static inline VMCommandHeader* VMCommandNext(VMCommandHeader* header)
+{
+    return (VMCommandHeader*)((uint8_t*)header + VMCommandRecordSize(header->size));
+}
+
 // Draw command structures
 struct VMDrawCommand {
     VMCommandHeader header;
@@ -157,6 +191,77 @@ struct VMDrawIndexedCommand {
     uint32_t first_instance;
 };
 
+// Argument records an indirect buffer holds, one every 'stride' bytes
+struct VMDrawIndirectArgs {
+    uint32_t vertex_count;
+    uint32_t instance_count;
+    uint32_t first_vertex;
+    uint32_t first_instance;
+};
+
+struct VMDrawIndexedIndirectArgs {
+    uint32_t index_count;
+    uint32_t instance_count;
+    uint32_t first_index;
+    int32_t vertex_offset;
+    uint32_t first_instance;
+};
+
+// VM_CMD_DRAW_INDIRECT and VM_CMD_DRAW_INDEXED_INDIRECT
+struct VMDrawIndirectCommand {
+    VMCommandHeader header;
+    uint32_t buffer_id;
+    uint32_t draw_count;
+    uint64_t offset;
+    uint32_t stride;
+    uint32_t reserved;
+};
+
+// Adjacent draws folded together by optimizeCommands()
+struct VMMultiDrawCommand {
+    VMCommandHeader header;
+    uint32_t draw_count;
+    uint32_t reserved;
+    VMDrawCommandDescriptor draws[];
+};
+
+// Primitive assembly of a graphics pipeline, draws after the bind use it
+enum VMPrimitiveTopology {
+    VM_PRIMITIVE_TOPOLOGY_POINT_LIST = 0,
+    VM_PRIMITIVE_TOPOLOGY_LINE_LIST = 1,
+    VM_PRIMITIVE_TOPOLOGY_LINE_STRIP = 2,
+    VM_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST = 3,
+    VM_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP = 4,
+    VM_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN = 5,
+    VM_PRIMITIVE_TOPOLOGY_COUNT
+};
+
+struct VMBindPipelineCommand {
+    VMCommandHeader header;
+    uint32_t pipeline_id;
+    uint32_t topology;    // VMPrimitiveTopology, 0 for compute pipelines
+};
+
+struct VMVertexBufferBinding {
+    uint32_t buffer_id;
+    uint32_t stride;
+    uint64_t offset;
+};
+
+struct VMBindVertexBuffersCommand {
+    VMCommandHeader header;
+    uint32_t first_binding;
+    uint32_t binding_count;
+    VMVertexBufferBinding bindings[];
+};
+
+struct VMBindIndexBufferCommand {
+    VMCommandHeader header;
+    uint32_t buffer_id;
+    uint32_t index_size;  // Bytes per index, 2 or 4
+    uint64_t offset;
+};
+
 struct VMDispatchCommand {
     VMCommandHeader header;
     uint32_t group_count_x;
@@ -164,6 +269,23 @@ struct VMDispatchCommand {
     uint32_t group_count_z;
 };
 
+struct VMCopyBufferCommand {
+    VMCommandHeader header;
+    uint32_t src_buffer_id;
+    uint32_t dst_buffer_id;
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t size;
+};
+
+struct VMUpdateBufferCommand {
+    VMCommandHeader header;
+    uint32_t buffer_id;
+    uint32_t data_size;  // Multiple of 4, at most VM_UPDATE_BUFFER_MAX
+    uint64_t offset;
+    uint8_t data[];
+};
+
 // Viewport and scissor structures
 struct VMViewport {
     float x, y;
@@ -183,6 +305,13 @@ struct VMSetViewportCommand {
     VMViewport viewports[];
 };
 
+struct VMSetScissorCommand {
+    VMCommandHeader header;
+    uint32_t first_scissor;
+    uint32_t scissor_count;
+    VMRect2D scissors[];
+};
+
 // Pipeline barrier for synchronization
 enum VMPipelineStageFlags {
     VM_PIPELINE_STAGE_TOP_OF_PIPE = 1 << 0,
@@ -215,6 +344,29 @@ struct VMPipelineBarrierCommand {
     // Followed by barrier data
 };
 
+// BEGIN_DEBUG_LABEL / INSERT_DEBUG_LABEL, END_DEBUG_LABEL carries no data
+struct VMDebugLabelCommand {
+    VMCommandHeader header;
+    float color[4];
+    char name[];         // NUL terminated, at most VM_DEBUG_LABEL_MAX bytes
+};
+
+// Resource reference inside a finalized command stream
+struct VMCommandRelocation {
+    uint32_t offset;        // Byte offset of the 32-bit resource id in the wire image
+    uint32_t resource_id;   // Resource currently written there
+};
+
+// What optimizeCommands() took out of the stream
+struct VMCommandOptimizationStats {
+    uint32_t redundant_state_removed;   // SET_VIEWPORT/SET_SCISSOR/BIND_* matching current state
+    uint32_t draws_merged_instanced;    // Draws folded into a neighbour's instance range
+    uint32_t draws_merged_multi;        // Draws folded into a VM_CMD_MULTI_DRAW
+    uint32_t indirect_draws_merged;     // Indirect draws continuing their neighbour's range
+    uint32_t barriers_collapsed;        // Back-to-back barriers folded into one
+    uint32_t bytes_saved;
+};
+
 class VMVirtIOGPU;
 class VMQemuVGAAccelerator;
 
@@ -222,22 +374,29 @@ class VMCommandBuffer : public OSObject
 {
     OSDeclareDefaultStructors(VMCommandBuffer);
 
+    friend class VMCommandBufferPool;
+
 private:
     VMQemuVGAAccelerator* m_accelerator;
     VMVirtIOGPU* m_gpu_device;
     uint32_t m_context_id;
+    uint32_t m_pool_slot;        // Index in the owning pool's buffer table
     
     // Command buffer storage
-    IOBufferMemoryDescriptor* m_command_data;
-    IOBufferMemoryDescriptor* m_buffer_memory;  // Additional buffer memory
-    size_t m_buffer_size;
-    size_t m_current_offset;
-    size_t m_current_size;      // Current size used
+    // Records (VMCommandHeader + data, 8-byte aligned) are packed into chunks,
+    // each chunk's length is the bytes recorded into it. reset() rewinds
+    // without freeing so a steady-state frame records with no allocations.
+    OSArray* m_chunks;          // IOBufferMemoryDescriptor chunks
+    uint32_t m_chunk_index;     // Chunk currently recorded into
+    uint8_t* m_chunk_base;      // Its kernel address
+    size_t m_chunk_capacity;    // Its capacity
+    size_t m_buffer_size;       // Default chunk capacity
+    size_t m_current_offset;    // Offset in the current chunk
+    size_t m_current_size;      // Bytes recorded in all chunks
     size_t m_max_size;
     uint32_t m_max_commands;    // Maximum command count
     
-    // Command and resource storage
-    OSArray* m_commands;        // Command array
+    // Resource storage
     OSArray* m_resources;       // Resource bindings
     
     // State tracking
@@ -254,21 +413,48 @@ private:
     // Statistics
     uint32_t m_command_count;
     uint64_t m_submission_time;
-    uint64_t m_completion_time;
+    uint64_t m_completion_time;  // Submission handed to the host
     
     // Debug support
-    OSArray* m_debug_labels;     // Stack of debug labels
+    uint32_t m_label_depth;      // Open beginDebugLabel() scopes while recording
     bool m_debug_enabled;
     
+    // Optimization
+    bool m_optimized;
+    VMCommandOptimizationStats m_optimization_stats;
+    
+    // Finalized wire image, resubmitted as is
+    bool m_finalized;
+    IOBufferMemoryDescriptor* m_wire;
+    VMCommandRelocation* m_relocations;
+    uint32_t m_relocation_count;
+    uint32_t m_relocation_capacity;
+    
+    // VirGL translation of the stream, reused while a finalized image is unchanged
+    VMVirGLEncoder* m_encoder;
+    bool m_encoded;
+    
     // Synchronization
     IOLock* m_command_lock;
     
-    // Internal methods
+    // Internal methods (called with m_command_lock held)
     IOReturn ensureCapacity(size_t additional_size);
     IOReturn writeCommand(const void* command_data, size_t size);
+    VMCommandHeader* allocateCommand(VMGPUCommandType type, uint32_t size);
+    IOReturn allocationError() const;
+    void closeChunk();
+    IOReturn optimizeLocked();
+    IOReturn addRelocations(const VMCommandHeader* header, uint32_t wire_offset);
+    void releaseWire();
     IOReturn validateState(VMCommandBufferState required_state);
+    IOReturn encodeStream();
+    IOReturn recordDebugLabel(VMGPUCommandType type, const char* label_name, const float* color);
     uint32_t getNextSequence() { return OSIncrementAtomic(&m_sequence_counter); }
-    void cleanupCommand(VMGPUCommand* command);
+    
+    IOReturn recordIndirectDraw(VMGPUCommandType type, uint32_t buffer_id, uint64_t offset,
+                                uint32_t draw_count, uint32_t stride);
+    IOReturn recordBarrier(VMGPUCommandType type, uint32_t src_stage_mask,
+                           uint32_t dst_stage_mask, uint32_t dependency_flags);
     
 public:
     static VMCommandBuffer* withAccelerator(VMQemuVGAAccelerator* accelerator, 
@@ -281,16 +467,35 @@ public:
     IOReturn begin(uint32_t usage_flags = 0);
     IOReturn end();
     IOReturn reset();
+    // Without a VirGL host the stream is not sent, the buffer still
+    // completes so callers keep working on plain 2D devices. There is no
+    // fence to wait on, submitAndWait() is submit()
     IOReturn submit();
     IOReturn submitAndWait();
     
+    // Reuse: encode once after end(), then every submit() sends the same image.
+    // Resource ids are tracked in a relocation table so they can be retargeted
+    // (e.g. to the next swapchain image) without encoding again.
+    IOReturn finalize();
+    IOReturn patchResource(uint32_t old_resource_id, uint32_t new_resource_id);
+    bool isFinalized() const { return m_finalized; }
+    uint32_t getRelocationCount() const { return m_relocation_count; }
+    
     // State queries
     VMCommandBufferState getState() const { return m_state; }
     uint32_t getCommandCount() const { return m_command_count; }
-    size_t getCurrentSize() const { return m_current_offset; }
-    size_t getRemainingSpace() const { return m_max_size - m_current_offset; }
+    size_t getCurrentSize() const { return m_current_size; }
+    size_t getRemainingSpace() const { return m_max_size - m_current_size; }
     bool isRecording() const { return m_state == VM_COMMAND_BUFFER_STATE_RECORDING; }
     
+    // Recorded stream, one chunk of whole records at a time (valid after end())
+    uint32_t getChunkCount() const { return m_chunks ? m_chunk_index + 1 : 0; }
+    IOBufferMemoryDescriptor* getChunk(uint32_t index) const;
+    
+    // Records draws_per_frame draws per frame for 'frames' frames, returns commands/sec
+    static uint64_t benchmarkRecording(VMQemuVGAAccelerator* accelerator,
+                                       uint32_t draws_per_frame, uint32_t frames);
+    
     // Priority and performance
     void setPriority(VMCommandPriority priority) { m_priority = priority; }
     VMCommandPriority getPriority() const { return m_priority; }
@@ -299,9 +504,11 @@ public:
     IOReturn beginRenderPass(uint32_t framebuffer_id, const VMRect2D* render_area,
                            uint32_t clear_value_count, const float* clear_values);
     IOReturn endRenderPass();
-    IOReturn bindPipeline(uint32_t pipeline_id, bool is_compute = false);
+    IOReturn bindPipeline(uint32_t pipeline_id, bool is_compute = false,
+                        VMPrimitiveTopology topology = VM_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
     IOReturn bindVertexBuffers(uint32_t first_binding, uint32_t binding_count,
-                             const uint32_t* buffer_ids, const uint64_t* offsets);
+                             const uint32_t* buffer_ids, const uint64_t* offsets,
+                             const uint32_t* strides = nullptr);
     IOReturn bindIndexBuffer(uint32_t buffer_id, uint64_t offset, bool is_16bit = false);
     IOReturn bindDescriptorSets(uint32_t pipeline_bind_point, uint32_t layout_id,
                               uint32_t first_set, uint32_t descriptor_set_count,
@@ -363,10 +570,13 @@ public:
     IOReturn writeTimestamp(uint32_t pipeline_stage, uint32_t query_pool_id, uint32_t query_index);
     
     // Optimization
-    IOReturn optimizeCommands();  // Optimize command stream before submission
+    IOReturn optimizeCommands();  // Optimize command stream before submission, submit() runs it once
     IOReturn validateCommands();  // Validate command stream for errors
+    void getOptimizationStats(VMCommandOptimizationStats* stats) const { *stats = m_optimization_stats; }
     
     // Statistics and debugging
+    // mach_absolute_time() of the last submit() and of it handing the stream
+    // to the host; driver-side times, the host's completion is not visible
     uint64_t getSubmissionTime() const { return m_submission_time; }
     uint64_t getCompletionTime() const { return m_completion_time; }
     uint64_t getExecutionDuration() const { return m_completion_time - m_submission_time; }
@@ -375,18 +585,38 @@ public:
                                    uint32_t* memory_transfers);
 };
 
+// Idle buffers cached for a set of threads, a slot holds a pool slot + 1 or 0 when empty
+struct VMCommandPoolMagazine {
+    volatile UInt32 slots[VM_COMMAND_POOL_MAGAZINE_SLOTS];
+    UInt8 pad[VM_COMMAND_POOL_CACHE_LINE - VM_COMMAND_POOL_MAGAZINE_SLOTS * sizeof(UInt32)];
+};
+
 // Command buffer pool for efficient allocation and reuse
+// Checkout and return go through the current thread's magazine first, a single
+// compare-and-swap each, so they are wait-free while the magazine has room.
+// Overflow lives on a lock-free global stack of slot indices whose head
+// carries a generation tag against ABA. m_pool_lock only guards creating and
+// destroying buffers, never the hot path.
 class VMCommandBufferPool : public OSObject
 {
     OSDeclareDefaultStructors(VMCommandBufferPool);
 
 private:
     VMQemuVGAAccelerator* m_accelerator;
-    OSArray* m_available_buffers;
-    OSArray* m_active_buffers;
+    VMCommandBuffer** m_buffers;             // Every buffer the pool owns, by slot
+    volatile UInt32* m_stack_next;           // Global stack links, slot + 1 or 0
+    volatile UInt64 m_stack_head;            // Generation << 32 | (slot + 1)
+    VMCommandPoolMagazine* m_magazines;
+    volatile UInt32 m_created;
     uint32_t m_context_id;
     uint32_t m_max_buffers;
     IOLock* m_pool_lock;
+    
+    bool takeFromMagazine(uint32_t* slot);
+    bool putInMagazine(uint32_t slot);
+    bool popStack(uint32_t* slot);
+    void pushStack(uint32_t slot);
+    VMCommandBuffer* createBuffer();
 
 public:
     static VMCommandBufferPool* withAccelerator(VMQemuVGAAccelerator* accelerator,
@@ -399,8 +629,14 @@ public:
     IOReturn releaseCommandBuffer(VMCommandBuffer* buffer);
     IOReturn resetPool();
     
+    // Snapshots, only exact while no other thread uses the pool
     uint32_t getActiveBufferCount() const;
     uint32_t getAvailableBufferCount() const;
+    
+    // Checkout/record/return throughput with threads workers in parallel,
+    // in command buffers per second
+    static uint64_t benchmarkContention(VMQemuVGAAccelerator* accelerator, uint32_t threads,
+                                        uint32_t iterations, uint32_t draws_per_buffer);
 };
 
 #endif /* __VMCommandBuffer_H__ */
@@ -3,6 +3,8 @@
 #include <IOKit/pci/IOPCIDevice.h>
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IODeviceTreeSupport.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <pexpert/pexpert.h>
 #include "VMQemuVGA.h"
 #include "VMQemuVGAAccelerator.h"
 #include <IOKit/IOLib.h>
@@ -217,6 +219,30 @@ bool CLASS::start(IOService* provider)
 	m_intr_enabled = false;
 	m_accel_updates = false;
 	
+	m_shadow_enabled = false;
+	m_shadow_buf = 0;
+	m_shadow_range = 0;
+	m_shadow = 0;
+	m_vram_map = 0;
+	m_shadow_ref = 0;
+	m_shadow_tile_seq = 0;
+	m_shadow_tile_alloc = 0;
+	m_shadow_full = false;
+	m_shadow_seq = 0;
+	m_shadow_width = 0;
+	m_shadow_timer = 0;
+	m_shadow_idle = 0;
+	m_shadow_skip = 0;
+	m_gamma_identity = true;
+	
+	bzero(&m_vbl_intr, sizeof m_vbl_intr);
+	m_vbl_call = 0;
+	m_vbl_intr_enabled = false;
+	m_vbl_running = false;
+	m_vbl_pending = false;
+	m_vbl_active = false;
+	m_vbl_anchor = 0;
+	
 	// Declare variables before any goto statements to avoid jump initialization errors
 	UInt32 memoryBandwidth = (UInt32)(1024 * 1024 * 1024); // 1GB
 	UInt32 vramSize = (UInt32)(64 * 1024 * 1024); // 64MB default
@@ -505,6 +531,14 @@ bool CLASS::start(IOService* provider)
 		DLOG("%s: Failed to allocate thread for restoring modes.\n", __FUNCTION__);
 	}
 	
+	//Allocate thread for the emulated vblank, without it VBL stays unsupported
+	m_vbl_call = thread_call_allocate(&_VBLTick, this);
+	if (!m_vbl_call)
+	{
+		DLOG("%s: Failed to allocate thread for vblank generation.\n", __FUNCTION__);
+	}
+	nanoseconds_to_absolutetime(1000000000ULL / VMQEMUVGA_REFRESH_HZ, &m_vbl_period);
+	
 	//Setup 3D acceleration if available
 	if (init3DAcceleration()) {
 		DLOG("%s: 3D acceleration initialized successfully\n", __FUNCTION__);
@@ -688,6 +722,10 @@ bool CLASS::start(IOService* provider)
 	m_display_mode = TryDetectCurrentDisplayMode(3);
 	m_depth_mode = 0;
 	
+	//Optional cached shadow framebuffer, plain std-VGA only
+	if (!is_virtio && !is_qxl && m_vram)
+		initShadowFramebuffer();
+	
 	// Initialize power management to prevent requestStaticServicePowerLock issues
 	IOLog("VMQemuVGA: Initializing power management\n");
 	PMinit();
@@ -821,6 +859,9 @@ IOReturn CLASS::powerStateDidChangeTo(IOPMPowerFlags capabilities, unsigned long
 	if (stateNumber == 1) {
 		// Just powered up - restore state if needed
 		IOLog("VMQemuVGA: Power restored - resuming operations\n");
+		
+		// VRAM contents may not have survived, push the whole shadow again
+		invalidateShadowFramebuffer();
 	}
 	
 	return IOPMAckImplied;
@@ -874,6 +915,11 @@ IOReturn CLASS::setProperties(OSObject* properties)
 /*********CLEANUP*********/
 void CLASS::Cleanup()
 {
+	//no tick may touch the shadow, the VRAM map or m_iolock past this point
+	stopVBLSource();
+	drainVBLSource();
+	
+	cleanupShadowFramebuffer();
 	
 	svga.Cleanup();
 	
@@ -881,6 +927,11 @@ void CLASS::Cleanup()
 		thread_call_free(m_restore_call);
 		m_restore_call = 0;
 	}
+	
+	if (m_vbl_call) {
+		thread_call_free(m_vbl_call);
+		m_vbl_call = 0;
+	}
 
 	if (m_iolock) {
 		IOLockFree(m_iolock);
@@ -1301,6 +1352,15 @@ UInt64 CLASS::getPixelFormatsForDisplayMode(IODisplayModeID displayMode, IOIndex
 IOReturn CLASS::setInterruptState(void* interruptRef, UInt32 state)
 {
 	DLOG("%s: \n", __FUNCTION__);
+	if (interruptRef == &m_vbl_intr) {
+		//IOFramebuffer throttles VBL by toggling this around each callback
+		m_vbl_intr_enabled = (state != 0);
+		if (m_vbl_intr_enabled)
+			startVBLSource();
+		else
+			stopVBLSource();
+		return kIOReturnSuccess;
+	}
 	if (interruptRef != &m_intr)
 		return kIOReturnBadArgument;
 	m_intr_enabled = (state != 0);
@@ -1311,6 +1371,12 @@ IOReturn CLASS::setInterruptState(void* interruptRef, UInt32 state)
 IOReturn CLASS::unregisterInterrupt(void* interruptRef)
 {
 	DLOG("%s: \n", __FUNCTION__);
+	if (interruptRef == &m_vbl_intr) {
+		m_vbl_intr_enabled = false;
+		stopVBLSource();
+		bzero(interruptRef, sizeof m_vbl_intr);
+		return kIOReturnSuccess;
+	}
 	if (interruptRef != &m_intr)
 		return kIOReturnBadArgument;
 	bzero(interruptRef, sizeof m_intr);
@@ -1398,6 +1464,12 @@ IODeviceMemory* CLASS::getApertureRange(IOPixelAperture aperture)
 		return 0;
 	}
 	
+	if (m_shadow_enabled)
+	{
+		m_shadow_range->retain();
+		return m_shadow_range;
+	}
+	
 	if (!m_vram)
 	{
 		return 0;
@@ -1625,6 +1697,18 @@ IOReturn CLASS::registerForInterruptType(IOSelect interruptType, IOFBInterruptPr
 	 */
 	//if (interruptType == kIOFBMCCSInterruptType)
 	//	return super::registerForInterruptType(interruptType, proc, target, ref, interruptRef);
+	if (interruptType == kIOFBVBLInterruptType && m_vbl_call) {
+		stopVBLSource();
+		bzero(&m_vbl_intr, sizeof m_vbl_intr);
+		m_vbl_intr.target = target;
+		m_vbl_intr.ref = ref;
+		m_vbl_intr.proc = proc;
+		m_vbl_intr_enabled = true;
+		startVBLSource();
+		if (interruptRef)
+			*interruptRef = &m_vbl_intr;
+		return kIOReturnSuccess;
+	}
 	if (interruptType != kIOFBConnectInterruptType)
 		return kIOReturnUnsupported;
 	bzero(&m_intr, sizeof m_intr);
@@ -1660,7 +1744,7 @@ IOReturn CLASS::getInformationForDisplayMode(IODisplayModeID displayMode, IODisp
 	info->maxDepthIndex = 0;
 	info->nominalWidth = dme->width;
 	info->nominalHeight = dme->height;
-	info->refreshRate = 60U << 16;
+	info->refreshRate = VMQEMUVGA_REFRESH_HZ << 16;
 	info->flags = dme->flags;
 	
 	DLOG("%s: mode ID=%d, max depth=%d, wxh=%ux%u, flags=%#x\n", __FUNCTION__,
@@ -1762,6 +1846,16 @@ IOReturn CLASS::setDisplayMode(IODisplayModeID displayMode, IOIndex depth)
 	
 	svga.SetMode(dme->width, dme->height, 32U);
 	
+	//DISPI cleared VRAM, every shadow tile must be pushed again. A mode the
+	//tile table cannot cover falls back to scanning out VRAM, IOFramebuffer
+	//asks for the aperture again once the mode is set
+	if (m_shadow_enabled && !resetShadowTiles(dme->width, dme->height)) {
+		IOLog("VMQemuVGA: %ux%u exceeds the shadow tile table, drawing to VRAM\n",
+			  dme->width, dme->height);
+		m_shadow_enabled = false;
+		setProperty("VMQemuVGA-Shadow-Framebuffer-Active", kOSBooleanFalse);
+	}
+	
 	// Post-mode change cursor restoration with flicker prevention
 	setProperty("IOHardwareCursorActive", kOSBooleanTrue);
 	setProperty("IOCursorRefreshThrottle", kOSBooleanTrue);
@@ -1778,6 +1872,549 @@ IOReturn CLASS::setDisplayMode(IODisplayModeID displayMode, IOIndex depth)
 	return kIOReturnSuccess;
 }
 
+#pragma mark -
+#pragma mark Shadow Framebuffer
+#pragma mark -
+
+/*
+ * On plain std-VGA the aperture is uncached/write-combined VRAM, so reads
+ * (scrolling, read-modify-write blits) run at MMIO speed. With the shadow
+ * enabled the window server draws into cached system memory and a periodic
+ * flusher pushes only tiles whose content changed, using non-temporal stores.
+ * The aperture is mapped straight into the window server, whose writes can't
+ * be trapped from here, so a tile counts as changed when its bytes differ
+ * from m_shadow_ref, the copy of what was last pushed.
+ */
+
+static inline void ShadowStreamRow(uint8_t* dst, uint8_t const* src, uint32_t bytes)
+{
+#if defined(__x86_64__)
+	//movnti only touches GPRs, so no FPU state needs saving in the kernel
+	uint64_t* d = reinterpret_cast<uint64_t*>(dst);
+	uint64_t const* p = reinterpret_cast<uint64_t const*>(src);
+	for (uint32_t i = 0U; i != (bytes >> 3); ++i)
+		__asm__ volatile("movnti %1, %0" : "=m" (d[i]) : "r" (p[i]));
+#else
+	memcpy(dst, src, bytes);
+#endif
+}
+
+static inline void ShadowStreamRowGamma(uint8_t* dst, uint8_t const* src, uint32_t bytes,
+										uint8_t const (*lut)[256])
+{
+	uint64_t* d = reinterpret_cast<uint64_t*>(dst);
+	uint64_t const* p = reinterpret_cast<uint64_t const*>(src);
+	
+	//two XRGB pixels per word, alpha bytes pass through
+	for (uint32_t i = 0U; i != (bytes >> 3); ++i) {
+		uint64_t q = p[i];
+		q = (q & 0xFF000000FF000000ULL) |
+			(static_cast<uint64_t>(lut[0][(q >> 48) & 0xFFU]) << 48) |
+			(static_cast<uint64_t>(lut[1][(q >> 40) & 0xFFU]) << 40) |
+			(static_cast<uint64_t>(lut[2][(q >> 32) & 0xFFU]) << 32) |
+			(static_cast<uint64_t>(lut[0][(q >> 16) & 0xFFU]) << 16) |
+			(static_cast<uint64_t>(lut[1][(q >> 8) & 0xFFU]) << 8) |
+			static_cast<uint64_t>(lut[2][q & 0xFFU]);
+#if defined(__x86_64__)
+		__asm__ volatile("movnti %1, %0" : "=m" (d[i]) : "r" (q));
+#else
+		d[i] = q;
+#endif
+	}
+}
+
+/*************INITSHADOWFRAMEBUFFER********************/
+bool CLASS::initShadowFramebuffer()
+{
+	uint32_t enable = 0U;
+	uint32_t size, stride;
+	IOPhysicalAddress phys;
+	DisplayModeEntry const* dme;
+	OSBoolean* prop;
+	
+	prop = OSDynamicCast(OSBoolean, getProperty("VMQemuVGA-Shadow-Framebuffer"));
+	if (prop)
+		enable = prop->isTrue() ? 1U : 0U;
+	PE_parse_boot_argn("vmqemuvga_shadowfb", &enable, sizeof(enable));
+	if (!enable)
+		return false;
+	
+	//large enough for the biggest mode we advertise
+	stride = ((svga.getMaxWidth() + 7U) & (~7U)) * 4U;
+	size = stride * svga.getMaxHeight();
+	if (size > svga.getVRAMSize())
+		size = svga.getVRAMSize();
+	size = static_cast<uint32_t>(round_page(size));
+	
+	//aperture must be a single physical range for IODeviceMemory
+	m_shadow_buf = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
+																	kIODirectionInOut | kIOMemoryPhysicallyContiguous,
+																	size,
+																	0xFFFFFFFFFFFFF000ULL);
+	if (!m_shadow_buf) {
+		IOLog("VMQemuVGA: Shadow framebuffer allocation of %u bytes failed, drawing to VRAM\n", size);
+		return false;
+	}
+	m_shadow = static_cast<uint8_t*>(m_shadow_buf->getBytesNoCopy());
+	phys = m_shadow_buf->getPhysicalAddress();
+	m_shadow_range = IODeviceMemory::withRange(phys, size);
+	m_vram_map = m_vram->map(kIOMapWriteCombineCache);
+	m_shadow_ref = static_cast<uint8_t*>(IOMallocAligned(size, PAGE_SIZE));
+	//enough tiles for any mode up to the advertised maximum that fits the
+	//buffer, so a mode switch never has to allocate
+	m_shadow_tile_alloc = (size + SHADOW_TILE_BYTES * SHADOW_TILE_ROWS - 1U) / (SHADOW_TILE_BYTES * SHADOW_TILE_ROWS) +
+						  (stride + SHADOW_TILE_BYTES - 1U) / SHADOW_TILE_BYTES +
+						  (svga.getMaxHeight() + SHADOW_TILE_ROWS - 1U) / SHADOW_TILE_ROWS + 1U;
+	m_shadow_tile_seq = static_cast<uint32_t*>(IOMalloc(m_shadow_tile_alloc * sizeof(uint32_t)));
+	m_shadow_timer = IOTimerEventSource::timerEventSource(this, &CLASS::_ShadowFlushTimer);
+	if (!m_shadow || !m_shadow_range || !m_vram_map || !m_shadow_ref || !m_shadow_tile_seq ||
+		!m_shadow_timer || getWorkLoop()->addEventSource(m_shadow_timer) != kIOReturnSuccess) {
+		IOLog("VMQemuVGA: Shadow framebuffer setup failed, drawing to VRAM\n");
+		cleanupShadowFramebuffer();
+		return false;
+	}
+	
+	//seed from VRAM so the boot console survives the switch
+	if (m_vram_map->getLength() < size)
+		size = static_cast<uint32_t>(m_vram_map->getLength());
+	memcpy(m_shadow, reinterpret_cast<void const*>(m_vram_map->getVirtualAddress()), size);
+	
+	dme = GetDisplayMode(m_display_mode);
+	IOLockLock(m_iolock);
+	if (dme)
+		m_shadow_enabled = resetShadowTiles(dme->width, dme->height);
+	else
+		m_shadow_enabled = resetShadowTiles(svga.getCurrentWidth(), svga.getCurrentHeight());
+	IOLockUnlock(m_iolock);
+	if (!m_shadow_enabled) {
+		IOLog("VMQemuVGA: Current mode exceeds the shadow tile table, drawing to VRAM\n");
+		cleanupShadowFramebuffer();
+		return false;
+	}
+	
+	m_shadow_timer->setTimeoutMS(SHADOW_FLUSH_MS);
+	
+	//the flush can apply gamma, ask IOFramebuffer for 8 bit 256 entry tables
+	setProperty(kIOFBGammaWidthKey, 8ULL, 32U);
+	setProperty(kIOFBGammaCountKey, 256ULL, 32U);
+	setProperty("VMQemuVGA-Shadow-Framebuffer-Active", kOSBooleanTrue);
+	IOLog("VMQemuVGA: Shadow framebuffer enabled (%u bytes at 0x%llx)\n",
+		  static_cast<uint32_t>(m_shadow_buf->getLength()), static_cast<uint64_t>(phys));
+	return true;
+}
+
+/*************CLEANUPSHADOWFRAMEBUFFER********************/
+void CLASS::cleanupShadowFramebuffer()
+{
+	m_shadow_enabled = false;
+	
+	if (m_shadow_timer) {
+		m_shadow_timer->cancelTimeout();
+		if (getWorkLoop())
+			getWorkLoop()->removeEventSource(m_shadow_timer);
+		m_shadow_timer->release();
+		m_shadow_timer = 0;
+	}
+	if (m_shadow_ref) {
+		IOFreeAligned(m_shadow_ref, m_shadow_buf->getLength());
+		m_shadow_ref = 0;
+	}
+	if (m_shadow_tile_seq) {
+		IOFree(m_shadow_tile_seq, m_shadow_tile_alloc * sizeof(uint32_t));
+		m_shadow_tile_seq = 0;
+	}
+	m_shadow_tile_alloc = 0;
+	if (m_vram_map) {
+		m_vram_map->release();
+		m_vram_map = 0;
+	}
+	if (m_shadow_range) {
+		m_shadow_range->release();
+		m_shadow_range = 0;
+	}
+	if (m_shadow_buf) {
+		m_shadow_buf->release();
+		m_shadow_buf = 0;
+	}
+	m_shadow = 0;
+}
+
+/*************RESETSHADOWTILES********************/
+// Called with m_iolock held, false when the mode needs more tiles than were allocated
+bool CLASS::resetShadowTiles(uint32_t width, uint32_t height)
+{
+	uint32_t stride, rows, count;
+	
+	stride = ((width + 7U) & (~7U)) << 2;
+	if (!stride)
+		return false;
+	rows = height;
+	if (static_cast<uint64_t>(stride) * rows > m_shadow_buf->getLength())
+		rows = static_cast<uint32_t>(m_shadow_buf->getLength() / stride);
+	count = ((stride + SHADOW_TILE_BYTES - 1U) / SHADOW_TILE_BYTES) *
+			((rows + SHADOW_TILE_ROWS - 1U) / SHADOW_TILE_ROWS);
+	if (count > m_shadow_tile_alloc) {
+		m_shadow_tile_cols = 0U;
+		m_shadow_tile_rows = 0U;
+		return false;
+	}
+	
+	m_shadow_width = width;
+	m_shadow_stride = stride;
+	m_shadow_height = rows;
+	m_shadow_tile_cols = (stride + SHADOW_TILE_BYTES - 1U) / SHADOW_TILE_BYTES;
+	m_shadow_tile_rows = (rows + SHADOW_TILE_ROWS - 1U) / SHADOW_TILE_ROWS;
+	
+	m_shadow_full = true;
+	m_shadow_idle = 0U;
+	m_shadow_skip = 0U;
+	//new geometry, every capture snapshot is stale
+	++m_shadow_seq;
+	for (uint32_t i = 0U; i != count; ++i)
+		m_shadow_tile_seq[i] = m_shadow_seq;
+	return true;
+}
+
+/*************INVALIDATESHADOWFRAMEBUFFER********************/
+void CLASS::invalidateShadowFramebuffer()
+{
+	if (!m_shadow_enabled)
+		return;
+	IOLockLock(m_iolock);
+	m_shadow_full = true;
+	m_shadow_idle = 0U;
+	m_shadow_skip = 0U;
+	IOLockUnlock(m_iolock);
+}
+
+/*************FLUSHSHADOWFRAMEBUFFER********************/
+// Copies tiles whose content changed since the last flush to VRAM, returns tiles written
+uint32_t CLASS::flushShadowFramebuffer()
+{
+	uint32_t flushed = 0U;
+	uint64_t pixels = 0U;
+	uint32_t seq;
+	uint8_t* vram;
+	
+	if (!m_shadow_enabled)
+		return 0U;
+	
+	IOLockLock(m_iolock);
+	vram = reinterpret_cast<uint8_t*>(m_vram_map->getVirtualAddress());
+	seq = m_shadow_seq + 1U;
+	for (uint32_t ty = 0U; ty != m_shadow_tile_rows; ++ty) {
+		uint32_t y = ty * SHADOW_TILE_ROWS;
+		uint32_t rows = min(SHADOW_TILE_ROWS, m_shadow_height - y);
+		for (uint32_t tx = 0U; tx != m_shadow_tile_cols; ++tx) {
+			uint32_t x = tx * SHADOW_TILE_BYTES;
+			uint32_t bytes = min(SHADOW_TILE_BYTES, m_shadow_stride - x);
+			size_t off = static_cast<size_t>(y) * m_shadow_stride + x;
+			uint32_t r = 0U;
+			
+			if (!m_shadow_full) {
+				for (size_t o = off; r != rows; ++r, o += m_shadow_stride)
+					if (memcmp(m_shadow + o, m_shadow_ref + o, bytes))
+						break;
+				if (r == rows)
+					continue;
+			}
+			//rows above the first difference already match, VRAM is fed from the
+			//reference copy so both hold the same bytes while drawing goes on
+			pixels += static_cast<uint64_t>(rows - r) * (bytes >> 2);
+			for (off += static_cast<size_t>(r) * m_shadow_stride; r != rows; ++r, off += m_shadow_stride) {
+				memcpy(m_shadow_ref + off, m_shadow + off, bytes);
+				if (m_gamma_identity)
+					ShadowStreamRow(vram + off, m_shadow_ref + off, bytes);
+				else
+					ShadowStreamRowGamma(vram + off, m_shadow_ref + off, bytes, m_gamma_lut);
+			}
+			m_shadow_tile_seq[ty * m_shadow_tile_cols + tx] = seq;
+			++flushed;
+		}
+	}
+#if defined(__x86_64__)
+	if (flushed)
+		__asm__ volatile("sfence" : : : "memory");
+#endif
+	m_shadow_full = false;
+	if (flushed)
+		m_shadow_seq = seq;
+	IOLockUnlock(m_iolock);
+	
+	//statistics page of the family, a family without one ignores the attribute
+	if (flushed)
+		super::setAttribute(SHADOW_FLUSH_STATS_ATTR, static_cast<uintptr_t>(pixels));
+	
+	return flushed;
+}
+
+/*************PERIODICSHADOWFLUSH********************/
+// Per-frame flush. Nothing tells us when the window server draws, so every
+// pass that finds no changed tile doubles the number of frames skipped
+// before the next one, up to 1 << SHADOW_IDLE_MAX_SHIFT
+void CLASS::periodicShadowFlush()
+{
+	uint32_t flushed;
+	
+	IOLockLock(m_iolock);
+	if (m_shadow_skip) {
+		--m_shadow_skip;
+		IOLockUnlock(m_iolock);
+		return;
+	}
+	IOLockUnlock(m_iolock);
+	
+	flushed = flushShadowFramebuffer();
+	
+	IOLockLock(m_iolock);
+	if (flushed)
+		m_shadow_idle = 0U;
+	else if (m_shadow_idle < SHADOW_IDLE_MAX_SHIFT)
+		++m_shadow_idle;
+	m_shadow_skip = (1U << m_shadow_idle) - 1U;
+	IOLockUnlock(m_iolock);
+}
+
+/*************GETSHADOWFRAMEBUFFERSIZE********************/
+//bytes the current mode covers, what a capture snapshot needs to hold
+size_t CLASS::getShadowFramebufferSize() const
+{
+	size_t size;
+	
+	if (!m_shadow_buf)
+		return 0U;
+	IOLockLock(m_iolock);
+	size = static_cast<size_t>(m_shadow_stride) * m_shadow_height;
+	IOLockUnlock(m_iolock);
+	return size;
+}
+
+/*************CAPTURESHADOWFRAMEBUFFER********************/
+// Brings dst (a copy of the shadow as of *dstSeq) up to date by copying only the
+// tiles changed since, and lists the damage since the client's 'since' in result
+IOReturn CLASS::captureShadowFramebuffer(uint32_t since, uint8_t* dst, size_t dstLen, uint32_t* dstSeq,
+										 CaptureResultData* result)
+{
+	uint32_t count = 0U;
+	bool full = false;
+	
+	if (!m_shadow_enabled)
+		return kIOReturnUnsupported;
+	if (!dst || !dstSeq || !result)
+		return kIOReturnBadArgument;
+	
+	//pick up whatever was drawn since the last vblank
+	flushShadowFramebuffer();
+	
+	IOLockLock(m_iolock);
+	//the mode grew past dst, the caller has to size it again
+	if (dstLen < static_cast<size_t>(m_shadow_stride) * m_shadow_height) {
+		IOLockUnlock(m_iolock);
+		return kIOReturnNoSpace;
+	}
+	for (uint32_t ty = 0U; ty != m_shadow_tile_rows; ++ty) {
+		uint32_t y = ty * SHADOW_TILE_ROWS;
+		uint32_t rows = min(SHADOW_TILE_ROWS, m_shadow_height - y);
+		uint32_t run = 0U, runStart = 0U;
+		
+		for (uint32_t tx = 0U; tx <= m_shadow_tile_cols; ++tx) {
+			uint32_t tseq = (tx != m_shadow_tile_cols) ? m_shadow_tile_seq[ty * m_shadow_tile_cols + tx] : 0U;
+			
+			//merge horizontally adjacent damaged tiles into one rect
+			if (tx != m_shadow_tile_cols && tseq > since) {
+				if (!run++)
+					runStart = tx;
+			} else if (run) {
+				if (count == CAPTURE_MAX_RECTS) {
+					full = true;
+				} else if (!full) {
+					uint32_t x = runStart * (SHADOW_TILE_BYTES / 4U);
+					CaptureRect* r = &result->rects[count++];
+					r->x = static_cast<unsigned short>(x);
+					r->y = static_cast<unsigned short>(y);
+					r->width = static_cast<unsigned short>(min(run * (SHADOW_TILE_BYTES / 4U), m_shadow_width - x));
+					r->height = static_cast<unsigned short>(rows);
+				}
+				run = 0U;
+			}
+			if (tx == m_shadow_tile_cols || tseq <= *dstSeq)
+				continue;
+			
+			uint32_t bytes = min(SHADOW_TILE_BYTES, m_shadow_stride - tx * SHADOW_TILE_BYTES);
+			size_t off = static_cast<size_t>(y) * m_shadow_stride + tx * SHADOW_TILE_BYTES;
+			for (uint32_t r = 0U; r != rows; ++r, off += m_shadow_stride)
+				memcpy(dst + off, m_shadow + off, bytes);
+		}
+	}
+	*dstSeq = m_shadow_seq;
+	result->sequence = m_shadow_seq;
+	result->width = m_shadow_width;
+	result->height = m_shadow_height;
+	result->rowBytes = m_shadow_stride;
+	result->flags = full ? CAPTURE_FLAG_FULL_FRAME : 0U;
+	result->rectCount = full ? 0U : count;
+	IOLockUnlock(m_iolock);
+	
+	return kIOReturnSuccess;
+}
+
+/*************SETGAMMATABLE********************/
+IOReturn CLASS::setGammaTable(UInt32 channelCount, UInt32 dataCount, UInt32 dataWidth, void* data)
+{
+	uint8_t lut[3][256];
+	bool identity = true;
+	
+	//std-VGA scans out direct color with no CLUT, gamma only exists on the shadow path
+	if (!m_shadow_enabled)
+		return kIOReturnUnsupported;
+	if (!data || dataCount < 2U || (channelCount != 1U && channelCount != 3U) ||
+		!dataWidth || dataWidth > 16U)
+		return kIOReturnBadArgument;
+	
+	for (uint32_t c = 0U; c != 3U; ++c) {
+		uint32_t base = (channelCount == 3U ? c : 0U) * dataCount;
+		for (uint32_t i = 0U; i != 256U; ++i) {
+			uint32_t idx = base + (i * (dataCount - 1U)) / 255U;
+			if (dataWidth <= 8U)
+				lut[c][i] = static_cast<uint8_t>(static_cast<uint8_t const*>(data)[idx] << (8U - dataWidth));
+			else
+				lut[c][i] = static_cast<uint8_t>(static_cast<uint16_t const*>(data)[idx] >> (dataWidth - 8U));
+			identity = identity && (lut[c][i] == i);
+		}
+	}
+	
+	IOLockLock(m_iolock);
+	memcpy(m_gamma_lut, lut, sizeof m_gamma_lut);
+	m_gamma_identity = identity;
+	//every tile has to be pushed through the new table
+	m_shadow_full = true;
+	m_shadow_idle = 0U;
+	m_shadow_skip = 0U;
+	IOLockUnlock(m_iolock);
+	
+	return kIOReturnSuccess;
+}
+
+/*************_SHADOWFLUSHTIMER********************/
+void CLASS::_ShadowFlushTimer(OSObject* owner, IOTimerEventSource* sender)
+{
+	CLASS* self = static_cast<CLASS*>(owner);
+	
+	//while the vblank source runs it flushes once per frame, stopVBLSource re-arms us
+	if (!self->m_shadow_enabled || self->m_vbl_running)
+		return;
+	self->periodicShadowFlush();
+	sender->setTimeoutMS(SHADOW_FLUSH_MS);
+}
+
+#pragma mark -
+#pragma mark Emulated VBL
+#pragma mark -
+
+/*
+ * There is no vertical retrace interrupt on any of the emulated adapters, so
+ * VBL is generated from a thread call armed at absolute deadlines on a fixed
+ * grid (m_vbl_anchor + k * m_vbl_period). Scheduling from the grid instead of
+ * "now + period" keeps timestamps from drifting. The grid is not tied to
+ * host presents, none of the adapters reports when one completes.
+ */
+
+/*************NEXTVBLDEADLINE********************/
+uint64_t CLASS::nextVBLDeadline(uint64_t now) const
+{
+	if (now < m_vbl_anchor)
+		return m_vbl_anchor;
+	return m_vbl_anchor + ((now - m_vbl_anchor) / m_vbl_period + 1U) * m_vbl_period;
+}
+
+/*************STARTVBLSOURCE********************/
+void CLASS::startVBLSource()
+{
+	uint64_t now;
+	
+	if (!m_vbl_call || !m_iolock || m_vbl_running)
+		return;
+	
+	IOLockLock(m_iolock);
+	if (!m_vbl_running) {
+		now = mach_absolute_time();
+		if (!m_vbl_anchor)
+			m_vbl_anchor = now;
+		m_vbl_running = true;
+		m_vbl_pending = true;
+		thread_call_enter_delayed(m_vbl_call, nextVBLDeadline(now));
+	}
+	IOLockUnlock(m_iolock);
+}
+
+/*************STOPVBLSOURCE********************/
+void CLASS::stopVBLSource()
+{
+	if (!m_vbl_call || !m_iolock || !m_vbl_running)
+		return;
+	
+	IOLockLock(m_iolock);
+	m_vbl_running = false;
+	//false when the callout already left the queue, VBLTick clears it then
+	if (thread_call_cancel(m_vbl_call))
+		m_vbl_pending = false;
+	IOLockUnlock(m_iolock);
+	
+	//hand shadow flushing back to its own timer
+	if (m_shadow_enabled && m_shadow_timer)
+		m_shadow_timer->setTimeoutMS(SHADOW_FLUSH_MS);
+}
+
+/*************DRAINVBLSOURCE********************/
+// thread_call_cancel does not wait for a callout that already started, so
+// after stopVBLSource wait until no tick is queued or running
+void CLASS::drainVBLSource()
+{
+	if (!m_vbl_call || !m_iolock)
+		return;
+	
+	IOLockLock(m_iolock);
+	while (m_vbl_pending || m_vbl_active)
+		IOLockSleep(m_iolock, &m_vbl_active, THREAD_UNINT);
+	IOLockUnlock(m_iolock);
+}
+
+/*************VBLTICK********************/
+void CLASS::VBLTick()
+{
+	IOLockLock(m_iolock);
+	m_vbl_pending = false;
+	if (!m_vbl_running) {
+		IOLockWakeup(m_iolock, &m_vbl_active, false);
+		IOLockUnlock(m_iolock);
+		return;
+	}
+	m_vbl_active = true;
+	IOLockUnlock(m_iolock);
+	
+	//signal first so handleVBL timestamps sit on the grid, not after the flush
+	if (m_vbl_intr_enabled && m_vbl_intr.proc)
+		m_vbl_intr.proc(m_vbl_intr.target, m_vbl_intr.ref);
+	
+	if (m_shadow_enabled)
+		periodicShadowFlush();
+	
+	IOLockLock(m_iolock);
+	m_vbl_active = false;
+	if (m_vbl_running) {
+		m_vbl_pending = true;
+		thread_call_enter_delayed(m_vbl_call, nextVBLDeadline(mach_absolute_time()));
+	}
+	IOLockWakeup(m_iolock, &m_vbl_active, false);
+	IOLockUnlock(m_iolock);
+}
+
+/*************_VBLTICK********************/
+void CLASS::_VBLTick(thread_call_param_t param0, thread_call_param_t param1)
+{
+	static_cast<CLASS*>(param0)->VBLTick();
+}
+
 /*******REMAIN from Accel***************/
 
 #pragma mark -
@@ -11,6 +11,18 @@
 
 // Forward declarations
 class VMQemuVGAAccelerator;
+class IOTimerEventSource;
+class IOBufferMemoryDescriptor;
+
+// Shadow framebuffer dirty tracking granularity (std-VGA path only)
+#define SHADOW_TILE_ROWS		16U		//scanlines per tile
+#define SHADOW_TILE_BYTES		256U	//bytes per tile scanline (64 pixels @ 32bpp)
+#define SHADOW_FLUSH_MS			16U		//flusher period when no vblank source drives it
+#define SHADOW_IDLE_MAX_SHIFT	2U		//idle desktop is rescanned every 1 << shift frames
+#define SHADOW_FLUSH_STATS_ATTR	'fbfs'	//kIOFBFlushStatisticsAttribute, private to IOGraphicsFamily
+
+// Emulated vertical blank
+#define VMQEMUVGA_REFRESH_HZ	60U		//refresh rate reported for every mode
 
 // Device type enumeration for multi-path architecture
 enum VMDeviceType {
@@ -60,12 +72,49 @@ private:
 		IOFBInterruptProc proc;
 	} m_intr;
 
+	struct {
+		OSObject* target;
+		void* ref;
+		IOFBInterruptProc proc;
+	} m_vbl_intr;
+	
+	// Timer-driven vblank generator
+	thread_call_t m_vbl_call;			//fires at each vblank deadline
+	bool m_vbl_intr_enabled;			//IOFramebuffer wants handleVBL callbacks
+	bool m_vbl_running;					//m_vbl_call is armed
+	bool m_vbl_pending;					//m_vbl_call is queued, under m_iolock
+	bool m_vbl_active;					//a tick is running, under m_iolock
+	uint64_t m_vbl_period;				//refresh period, absolute time units
+	uint64_t m_vbl_anchor;				//absolute time of a reference vblank
+
 	IOLock* m_iolock;					//mutex for the FIFO
 	
 	thread_call_t m_restore_call;		//???
 	uint32_t m_custom_switch;			//???
 	bool m_custom_mode_switched;		//???
 
+	// Cached system-memory shadow of the std-VGA framebuffer
+	bool m_shadow_enabled;				//aperture points at m_shadow_buf instead of VRAM
+	IOBufferMemoryDescriptor* m_shadow_buf;	//cached copy the window server draws into
+	IODeviceMemory* m_shadow_range;		//aperture handed out by getApertureRange
+	uint8_t* m_shadow;					//kernel address of m_shadow_buf
+	IOMemoryMap* m_vram_map;			//write-combined kernel mapping of VRAM
+	uint8_t* m_shadow_ref;				//shadow content as last flushed, what VRAM holds before gamma
+	uint32_t* m_shadow_tile_seq;		//m_shadow_seq at which each tile last changed
+	uint32_t m_shadow_tile_alloc;		//entries in m_shadow_tile_seq, sized for the largest mode
+	bool m_shadow_full;					//next flush pushes every tile
+	uint32_t m_shadow_seq;				//bumped by every flush that found changed tiles
+	uint32_t m_shadow_width;			//pixels of the current mode
+	uint32_t m_shadow_tile_cols;
+	uint32_t m_shadow_tile_rows;
+	uint32_t m_shadow_stride;			//bytes per scanline of the current mode
+	uint32_t m_shadow_height;			//scanlines of the current mode
+	IOTimerEventSource* m_shadow_timer;	//periodic flusher
+	uint32_t m_shadow_idle;				//back-off shift, grows with consecutive clean passes
+	uint32_t m_shadow_skip;				//periodic passes left to skip
+	uint8_t m_gamma_lut[3][256];		//R, G, B software gamma applied on flush
+	bool m_gamma_identity;				//m_gamma_lut is a straight copy
+
 	bool m_intr_enabled;				//if interrupt enbaled ?
 	bool m_accel_updates;				//if update support accel procedure
 	DisplayModeEntry customMode;		//define in common_fb.h
@@ -96,6 +145,21 @@ private:
 
 	IODisplayModeID TryDetectCurrentDisplayMode(IODisplayModeID defaultMode) const;
 
+	// Shadow framebuffer (std-VGA path)
+	bool initShadowFramebuffer();
+	void cleanupShadowFramebuffer();
+	bool resetShadowTiles(uint32_t width, uint32_t height);
+	void periodicShadowFlush();
+	static void _ShadowFlushTimer(OSObject* owner, IOTimerEventSource* sender);
+	
+	// Emulated vblank
+	void startVBLSource();
+	void stopVBLSource();
+	void drainVBLSource();
+	uint64_t nextVBLDeadline(uint64_t now) const;
+	void VBLTick();
+	static void _VBLTick(thread_call_param_t param0, thread_call_param_t param1);
+
 	void CustomSwitchStepSet( uint32_t value);
 	void CustomSwitchStepWait(uint32_t value);
 	void EmitConnectChangedEvent();
@@ -137,6 +201,7 @@ public:
 	IOReturn	CustomMode(CustomModeData const* inData, CustomModeData* outData, 
 										size_t inSize, size_t* outSize);
 	IOReturn 	setDisplayMode(IODisplayModeID displayMode, IOIndex depth) override;
+	IOReturn 	setGammaTable(UInt32 channelCount, UInt32 dataCount, UInt32 dataWidth, void* data) override;
 	
 	// Power management methods
 	IOReturn setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice) override;
@@ -192,6 +257,14 @@ public:
 	void lockDevice();
 	void unlockDevice();
 	void useAccelUpdates(bool state);
+	
+	// Shadow framebuffer support
+	bool isShadowFramebufferEnabled() const { return m_shadow_enabled; }
+	uint32_t flushShadowFramebuffer();
+	void invalidateShadowFramebuffer();
+	size_t getShadowFramebufferSize() const;
+	IOReturn captureShadowFramebuffer(uint32_t since, uint8_t* dst, size_t dstLen, uint32_t* dstSeq,
+									  CaptureResultData* result);
 };
 
 #endif /* __VMSVGA2_H__ */
@@ -1,5 +1,8 @@
 #include "VMQemuVGAAccelerator.h"
 #include <IOKit/IOLib.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <mach/mach_time.h>
+#include <kern/clock.h>
 
 #define CLASS VMQemuVGA3DUserClient
 #define super IOUserClient
@@ -56,6 +59,34 @@ static const IOExternalMethodDispatch sMethods[kVM3DUserClientMethodCount] = {
         .checkStructureInputSize = 0,
         .checkScalarOutputCount = 0,
         .checkStructureOutputSize = 256,
+    },
+    { // kVM3DUserClientStartProfiling
+        .function = (IOExternalMethodAction) &VMQemuVGA3DUserClient::sStartProfiling,
+        .checkScalarInputCount = 1,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = 0,
+    },
+    { // kVM3DUserClientStopProfiling
+        .function = (IOExternalMethodAction) &VMQemuVGA3DUserClient::sStopProfiling,
+        .checkScalarInputCount = 1,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = kIOUCVariableStructureSize,
+    },
+    { // kVM3DUserClientRingDoorbell
+        .function = (IOExternalMethodAction) &VMQemuVGA3DUserClient::sRingDoorbell,
+        .checkScalarInputCount = 1,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = 0,
+    },
+    { // kVM3DUserClientExecuteBatch
+        .function = (IOExternalMethodAction) &VMQemuVGA3DUserClient::sExecuteBatch,
+        .checkScalarInputCount = 0,
+        .checkStructureInputSize = kIOUCVariableStructureSize,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = kIOUCVariableStructureSize,
     }
 };
 
@@ -81,6 +112,12 @@ bool CLASS::initWithTask(task_t owningTask, void* securityToken, UInt32 type,
     m_task = owningTask;
     m_context_id = 0;
     m_has_context = false;
+    m_ring = nullptr;
+    m_ring_head = 0;
+    
+    m_ring_lock = IOLockAlloc();
+    if (!m_ring_lock)
+        return false;
     
     return true;
 }
@@ -100,15 +137,28 @@ bool CLASS::start(IOService* provider)
     return true;
 }
 
+IOReturn CLASS::gatedCloseContext(OSObject* owner, void* arg0, void* arg1,
+                                  void* arg2, void* arg3)
+{
+    VMQemuVGA3DUserClient* me = (VMQemuVGA3DUserClient*)arg0;
+    
+    if (me->m_has_context) {
+        me->m_accelerator->destroy3DContext(me->m_context_id);
+        me->m_has_context = false;
+        me->m_context_id = 0;
+    }
+    
+    return kIOReturnSuccess;
+}
+
 IOReturn CLASS::clientClose()
 {
     IOLog("VMQemuVGA3DUserClient: clientClose\n");
     
-    if (m_has_context) {
-        m_accelerator->destroy3DContext(m_context_id);
-        m_has_context = false;
-        m_context_id = 0;
-    }
+    // The context is only touched inside the gate, see externalMethod
+    IOCommandGate* gate = m_accelerator ? m_accelerator->getCommandGate() : nullptr;
+    if (gate)
+        gate->runAction(&CLASS::gatedCloseContext, this);
     
     if (isInactive() == false) {
         terminate();
@@ -123,6 +173,152 @@ IOReturn CLASS::clientDied()
     return clientClose();
 }
 
+void CLASS::free()
+{
+    if (m_ring) {
+        m_ring->release();
+        m_ring = nullptr;
+    }
+    if (m_ring_lock) {
+        IOLockFree(m_ring_lock);
+        m_ring_lock = nullptr;
+    }
+    super::free();
+}
+
+IOReturn CLASS::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory)
+{
+    if (type != kVM3DUserClientCommandRing || !options || !memory)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_ring_lock);
+    if (!m_ring) {
+        m_ring = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                       VM3D_RING_SIZE, page_size);
+        if (!m_ring) {
+            IOLockUnlock(m_ring_lock);
+            return kIOReturnNoMemory;
+        }
+        VM3DRingHeader* ring = (VM3DRingHeader*)m_ring->getBytesNoCopy();
+        bzero(ring, VM3D_RING_HEADER_SIZE);
+        ring->data_size = VM3D_RING_DATA_SIZE;
+        m_ring_head = 0;
+    }
+    m_ring->retain();
+    *memory = m_ring;
+    *options = 0;
+    IOLockUnlock(m_ring_lock);
+    
+    return kIOReturnSuccess;
+}
+
+// Consumes records until the ring is empty, with 'poll' until it has stayed
+// empty for VM3D_RING_POLL_NS, within the VM3D_RING_DRAIN_* budgets.
+// m_ring_lock is held while records are consumed and dropped while idle;
+// without 'poll' a drain that would have to wait for it returns kIOReturnBusy.
+// Everything the client controls is read once and bounds checked; a
+// malformed record discards all that is pending.
+IOReturn CLASS::drainRing(bool poll)
+{
+    IOReturn result = kIOReturnSuccess;
+    uint32_t records = 0;
+    uint64_t window, budget, now, deadline, idle_deadline;
+    
+    nanoseconds_to_absolutetime(VM3D_RING_POLL_NS, &window);
+    nanoseconds_to_absolutetime(VM3D_RING_DRAIN_NS, &budget);
+    now = mach_absolute_time();
+    deadline = now + budget;
+    idle_deadline = now + window;
+    
+    if (poll)
+        IOLockLock(m_ring_lock);
+    else if (!IOLockTryLock(m_ring_lock))
+        return kIOReturnBusy;
+    if (!m_ring) {
+        IOLockUnlock(m_ring_lock);
+        return kIOReturnNotReady;
+    }
+    VM3DRingHeader* ring = (VM3DRingHeader*)m_ring->getBytesNoCopy();
+    const uint8_t* data = (const uint8_t*)ring + VM3D_RING_HEADER_SIZE;
+    
+    if (poll)
+        ring->flags = VM3D_RING_FLAG_POLLING;
+    
+    for (;;) {
+        __sync_synchronize();
+        uint32_t tail = ring->tail;
+        uint32_t pending = tail - m_ring_head;
+        
+        now = mach_absolute_time();
+        if (pending && (records == VM3D_RING_DRAIN_RECORDS || now >= deadline)) {
+            // Out of budget, the client rings again for the rest
+            result = (result == kIOReturnSuccess) ? kIOReturnBusy : result;
+            break;
+        }
+        
+        if (pending == 0) {
+            if (!poll)
+                break;
+            if (now < idle_deadline && now < deadline) {
+                IOLockUnlock(m_ring_lock);
+                __asm__ __volatile__("pause" ::: "memory");
+                IOLockLock(m_ring_lock);
+                continue;
+            }
+            // Stop polling, then look once more so a record published
+            // while the flag was still set is not left behind
+            ring->flags = 0;
+            __sync_synchronize();
+            if (ring->tail == m_ring_head)
+                break;
+            ring->flags = VM3D_RING_FLAG_POLLING;
+            continue;
+        }
+        
+        uint32_t offset = m_ring_head & (VM3D_RING_DATA_SIZE - 1);
+        VM3DRingRecord record = {};
+        uint64_t size = 0;
+        bool valid = pending <= VM3D_RING_DATA_SIZE && !(pending & (VM3D_RING_ALIGN - 1)) &&
+                     !(offset & (VM3D_RING_ALIGN - 1));
+        if (valid) {
+            memcpy(&record, data + offset, sizeof(record));
+            size = (sizeof(record) + (uint64_t)record.length + VM3D_RING_ALIGN - 1) &
+                   ~(uint64_t)(VM3D_RING_ALIGN - 1);
+            valid = size <= pending && size <= VM3D_RING_DATA_SIZE - offset;
+        }
+        
+        if (!valid) {
+            ring->status = kIOReturnBadArgument;
+            ring->status_offset = m_ring_head;
+            result = kIOReturnBadArgument;
+            m_ring_head = tail;
+            ring->head = m_ring_head;
+            continue;
+        }
+        
+        if (record.type == VM3D_RING_RECORD_COMMANDS && record.length) {
+            IOReturn ret = m_accelerator->submit3DCommandBytes(m_context_id, data + offset + sizeof(record),
+                                                               record.length);
+            if (ret != kIOReturnSuccess) {
+                ring->status = ret;
+                ring->status_offset = m_ring_head;
+                result = ret;
+            }
+        }
+        
+        m_ring_head += (uint32_t)size;
+        __sync_synchronize();
+        ring->head = m_ring_head;
+        records++;
+        idle_deadline = mach_absolute_time() + window;
+    }
+    
+    if (poll)
+        ring->flags = 0;
+    IOLockUnlock(m_ring_lock);
+    return result;
+}
+
 IOReturn CLASS::externalMethod(uint32_t selector, IOExternalMethodArguments* args,
                               IOExternalMethodDispatch* dispatch, OSObject* target,
                               void* reference)
@@ -134,10 +330,22 @@ IOReturn CLASS::externalMethod(uint32_t selector, IOExternalMethodArguments* arg
     if (!dispatch)
         return kIOReturnBadArgument;
     
-    target = this;
-    reference = nullptr;
+    // Every selector runs inside the accelerator's command gate, which
+    // orders it against other calls and batches and keeps the context
+    // state consistent
+    IOCommandGate* gate = m_accelerator ? m_accelerator->getCommandGate() : nullptr;
+    if (!gate)
+        return kIOReturnNotReady;
     
-    return super::externalMethod(selector, args, dispatch, target, reference);
+    return gate->runAction(&CLASS::gatedExternalMethod, this, (void*)(uintptr_t)selector, args, dispatch);
+}
+
+IOReturn CLASS::gatedExternalMethod(OSObject* owner, void* arg0, void* arg1,
+                                    void* arg2, void* arg3)
+{
+    VMQemuVGA3DUserClient* me = (VMQemuVGA3DUserClient*)arg0;
+    return me->super::externalMethod((uint32_t)(uintptr_t)arg1, (IOExternalMethodArguments*)arg2,
+                                     (IOExternalMethodDispatch*)arg3, me, nullptr);
 }
 
 IOReturn CLASS::sCreate3DContext(OSObject* target, void* reference,
@@ -237,12 +445,7 @@ IOReturn CLASS::sSubmit3DCommands(OSObject* target, void* reference,
         return kIOReturnBadArgument;
     }
     
-    IOReturn ret = me->m_accelerator->submit3DCommands(context_id, commands);
-    
-    IOLog("VMQemuVGA3DUserClient: Submit commands to context %d, result: 0x%x\n",
-          context_id, ret);
-    
-    return ret;
+    return me->m_accelerator->submit3DCommands(context_id, commands);
 }
 
 IOReturn CLASS::sPresent3DSurface(OSObject* target, void* reference,
@@ -293,3 +496,179 @@ IOReturn CLASS::sGetCapabilities(OSObject* target, void* reference,
     
     return kIOReturnSuccess;
 }
+
+IOReturn CLASS::sStartProfiling(OSObject* target, void* reference,
+                              IOExternalMethodArguments* args)
+{
+    VMQemuVGA3DUserClient* me = (VMQemuVGA3DUserClient*)target;
+    uint32_t context_id = (uint32_t)args->scalarInput[0];
+    
+    if (!me->m_has_context || context_id != me->m_context_id) {
+        return kIOReturnBadArgument;
+    }
+    
+    return me->m_accelerator->startPerformanceProfiling(context_id);
+}
+
+IOReturn CLASS::sStopProfiling(OSObject* target, void* reference,
+                             IOExternalMethodArguments* args)
+{
+    VMQemuVGA3DUserClient* me = (VMQemuVGA3DUserClient*)target;
+    uint32_t context_id = (uint32_t)args->scalarInput[0];
+    void* trace = nullptr;
+    size_t trace_size = 0;
+    
+    if (!me->m_has_context || context_id != me->m_context_id) {
+        return kIOReturnBadArgument;
+    }
+    
+    // Chrome trace JSON, NUL terminated; large traces go through a descriptor
+    IOMemoryDescriptor* output = args->structureOutputDescriptor;
+    size_t capacity = output ? output->getLength() : args->structureOutputSize;
+    IOReturn ret = me->m_accelerator->stopPerformanceProfiling(context_id, &trace, &trace_size, capacity);
+    if (ret == kIOReturnNoSpace) {
+        // Report the size needed, the trace stays for a retry with room
+        if (output)
+            args->structureOutputDescriptorSize = (uint32_t)trace_size;
+        else
+            args->structureOutputSize = (uint32_t)trace_size;
+        return ret;
+    }
+    if (ret != kIOReturnSuccess)
+        return ret;
+    
+    size_t length = strlen((const char*)trace) + 1;
+    if (output) {
+        if ((ret = output->prepare()) == kIOReturnSuccess) {
+            output->writeBytes(0, trace, length);
+            output->complete();
+            args->structureOutputDescriptorSize = (uint32_t)length;
+        }
+    } else {
+        memcpy(args->structureOutput, trace, length);
+        args->structureOutputSize = (uint32_t)length;
+    }
+    
+    IOLog("VMQemuVGA3DUserClient: Stop profiling context %d, %lu byte trace, result: 0x%x\n",
+          context_id, (unsigned long)length, ret);
+    
+    IOFree(trace, trace_size);
+    return ret;
+}
+
+IOReturn CLASS::sRingDoorbell(OSObject* target, void* reference,
+                            IOExternalMethodArguments* args)
+{
+    VMQemuVGA3DUserClient* me = (VMQemuVGA3DUserClient*)target;
+    uint32_t context_id = (uint32_t)args->scalarInput[0];
+    
+    if (!me->m_has_context || context_id != me->m_context_id) {
+        return kIOReturnBadArgument;
+    }
+    
+    return me->drainRing(true);
+}
+
+// Runs with the accelerator's command gate held, like every selector
+IOReturn CLASS::executeBatch(VM3DBatchOp* ops, uint32_t count)
+{
+    bool abort = false;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        VM3DBatchOp* op = &ops[i];
+        IOReturn ret = kIOReturnSuccess;
+        uint32_t surface_id = op->surface_id;
+        
+        op->value = 0;
+        if (abort) {
+            op->result = kIOReturnAborted;
+            continue;
+        }
+        
+        if (op->flags & VM3D_BATCH_FLAG_SURFACE_FROM_OP) {
+            if (surface_id >= i || ops[surface_id].type != VM3D_BATCH_CREATE_SURFACE ||
+                ops[surface_id].result != kIOReturnSuccess)
+                ret = kIOReturnBadArgument;
+            else
+                surface_id = ops[surface_id].value;
+        }
+        
+        if (ret == kIOReturnSuccess && op->type != VM3D_BATCH_CREATE_CONTEXT && !m_has_context)
+            ret = kIOReturnNotOpen;
+        
+        if (ret == kIOReturnSuccess) {
+            switch (op->type) {
+                case VM3D_BATCH_CREATE_CONTEXT:
+                    if (m_has_context) {
+                        ret = kIOReturnExclusiveAccess;
+                        break;
+                    }
+                    ret = m_accelerator->create3DContext(&m_context_id, m_task);
+                    if (ret == kIOReturnSuccess) {
+                        m_has_context = true;
+                        op->value = m_context_id;
+                    }
+                    break;
+                case VM3D_BATCH_DESTROY_CONTEXT:
+                    ret = m_accelerator->destroy3DContext(m_context_id);
+                    if (ret == kIOReturnSuccess) {
+                        m_has_context = false;
+                        m_context_id = 0;
+                    }
+                    break;
+                case VM3D_BATCH_CREATE_SURFACE:
+                    ret = m_accelerator->create3DSurface(m_context_id, &op->surface);
+                    if (ret == kIOReturnSuccess)
+                        op->value = op->surface.surface_id;
+                    break;
+                case VM3D_BATCH_DESTROY_SURFACE:
+                    ret = m_accelerator->destroy3DSurface(m_context_id, surface_id);
+                    break;
+                case VM3D_BATCH_SUBMIT_RING:
+                    ret = drainRing(false);
+                    break;
+                case VM3D_BATCH_PRESENT_SURFACE:
+                    ret = m_accelerator->present3DSurface(m_context_id, surface_id);
+                    break;
+                default:
+                    ret = kIOReturnUnsupported;
+                    break;
+            }
+        }
+        
+        op->result = ret;
+        if (ret != kIOReturnSuccess && (op->flags & VM3D_BATCH_FLAG_STOP_ON_ERROR))
+            abort = true;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::sExecuteBatch(OSObject* target, void* reference,
+                            IOExternalMethodArguments* args)
+{
+    VMQemuVGA3DUserClient* me = (VMQemuVGA3DUserClient*)target;
+    uint32_t size = args->structureInputSize;
+    uint32_t count = size / sizeof(VM3DBatchOp);
+    
+    if (!args->structureInput || count == 0 || count > VM3D_BATCH_MAX_OPS ||
+        size != count * sizeof(VM3DBatchOp) || args->structureOutputSize < size) {
+        return kIOReturnBadArgument;
+    }
+    
+    // Work on a kernel copy so the ops cannot change underneath the batch
+    VM3DBatchOp* ops = (VM3DBatchOp*)IOMalloc(size);
+    if (!ops) {
+        return kIOReturnNoMemory;
+    }
+    memcpy(ops, args->structureInput, size);
+    
+    IOReturn ret = me->executeBatch(ops, count);
+    if (ret == kIOReturnSuccess) {
+        memcpy(args->structureOutput, ops, size);
+        args->structureOutputSize = size;
+    }
+    
+    IOFree(ops, size);
+    return ret;
+}
@@ -4,10 +4,12 @@
 #include "VMShaderManager.h"
 #include "VMTextureManager.h"
 #include "VMCommandBuffer.h"
+#include "VMVirGLEncoder.h"
 #include <IOKit/IOLib.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
 #include <mach/mach_time.h>
 #include <kern/clock.h>
+#include <pexpert/pexpert.h>
 
 #define CLASS VMQemuVGAAccelerator
 #define super IOService
@@ -36,6 +38,14 @@ bool CLASS::init(OSDictionary* properties)
     m_next_context_id = 1;
     m_next_surface_id = 1;
     
+    m_trace_lock = IOLockAlloc();
+    m_trace_events = nullptr;
+    m_trace_head = 0;
+    m_trace_count = 0;
+    m_profile_context = 0;
+    m_profiling = false;
+    m_trace_held = false;
+    
     // Initialize statistics
     m_draw_calls = 0;
     m_triangles_rendered = 0;
@@ -44,7 +54,7 @@ bool CLASS::init(OSDictionary* properties)
     m_memory_allocated = 0;
     m_metal_compatible = false;
     
-    return (m_lock && m_contexts && m_surfaces);
+    return (m_lock && m_contexts && m_surfaces && m_trace_lock);
 }
 
 void CLASS::free()
@@ -70,6 +80,16 @@ void CLASS::free()
         m_lock = nullptr;
     }
     
+    if (m_trace_events) {
+        IOFree(m_trace_events, VM_GPU_TRACE_CAPACITY * sizeof(VMGPUTraceEvent));
+        m_trace_events = nullptr;
+    }
+    
+    if (m_trace_lock) {
+        IOLockFree(m_trace_lock);
+        m_trace_lock = nullptr;
+    }
+    
     OSSafeReleaseNULL(m_contexts);
     OSSafeReleaseNULL(m_surfaces);
     
@@ -140,6 +160,29 @@ bool CLASS::start(IOService* provider)
         return false;
     }
     
+    // vmqemuvga_cmdbench=<draws per frame> measures command recording throughput
+    uint32_t bench_draws = 0;
+    if (PE_parse_boot_argn("vmqemuvga_cmdbench", &bench_draws, sizeof(bench_draws)) && bench_draws) {
+        uint64_t rate = VMCommandBuffer::benchmarkRecording(this, bench_draws, 100);
+        IOLog("VMQemuVGAAccelerator: Command recording %llu commands/sec (%u draws/frame)\n",
+              rate, bench_draws);
+        setProperty("Command Recording Rate", rate, 64);
+        
+        rate = VMVirGLEncoder::benchmarkEncoding(this, bench_draws, 100);
+        IOLog("VMQemuVGAAccelerator: VirGL encoding %llu draws/sec (%u draws/frame)\n",
+              rate, bench_draws);
+        setProperty("VirGL Encoding Rate", rate, 64);
+    }
+    
+    // vmqemuvga_poolbench=<threads> measures pool checkout under contention
+    uint32_t bench_threads = 0;
+    if (PE_parse_boot_argn("vmqemuvga_poolbench", &bench_threads, sizeof(bench_threads)) && bench_threads) {
+        uint64_t rate = VMCommandBufferPool::benchmarkContention(this, bench_threads, 10000, 16);
+        IOLog("VMQemuVGAAccelerator: Command pool %llu buffers/sec (%u threads)\n",
+              rate, bench_threads);
+        setProperty("Command Pool Rate", rate, 64);
+    }
+    
     // Set device properties
     setProperty("IOClass", "VMQemuVGAAccelerator");
     setProperty("3D Hardware Acceleration", true);
@@ -266,6 +309,7 @@ IOReturn CLASS::create3DContext(uint32_t* context_id, task_t task)
     context->surfaces = OSSet::withCapacity(8);
     context->command_buffer = nullptr;
     context->owning_task = task;
+    context->host_writes_unknown = false;
     
     m_contexts->setObject((OSObject*)context);
     *context_id = context->context_id;
@@ -315,6 +359,7 @@ IOReturn CLASS::create3DSurface(uint32_t context_id, VM3DSurfaceInfo* surface_in
     surface->info.surface_id = surface->surface_id;
     surface->backing_memory = nullptr;
     surface->is_render_target = false;
+    surface->host_dirty = false;
     
     // Allocate backing memory
     ret = allocateSurfaceMemory(&surface->info, &surface->backing_memory);
@@ -351,6 +396,9 @@ IOReturn CLASS::submit3DCommands(uint32_t context_id, IOMemoryDescriptor* comman
         return kIOReturnNotFound;
     }
     
+    // Raw streams may write any surface of the context
+    context->host_writes_unknown = true;
+    
     // Execute commands via GPU device
     IOReturn ret = m_gpu_device->executeCommands(context->gpu_context_id, commands);
     
@@ -366,6 +414,143 @@ IOReturn CLASS::submit3DCommands(uint32_t context_id, IOMemoryDescriptor* comman
     return ret;
 }
 
+// Same as submit3DCommands() for a stream already in kernel memory, such as
+// a record of the user client's command ring
+IOReturn CLASS::submit3DCommandBytes(uint32_t context_id, const void* commands, size_t length)
+{
+    if (!commands || length == 0)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_lock);
+    
+    AccelContext* context = findContext(context_id);
+    if (!context) {
+        IOLockUnlock(m_lock);
+        return kIOReturnNotFound;
+    }
+    
+    context->host_writes_unknown = true;
+    
+    IOReturn ret = m_gpu_device->executeCommandBytes(context->gpu_context_id, commands, length);
+    if (ret == kIOReturnSuccess) {
+        m_draw_calls++;
+        m_commands_submitted++;
+        m_triangles_rendered += static_cast<uint32_t>(length / 64);
+    }
+    
+    IOLockUnlock(m_lock);
+    
+    return ret;
+}
+
+IOReturn CLASS::submitVirGLCommands(uint32_t context_id, IOBufferMemoryDescriptor* submission)
+{
+    if (!submission)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_lock);
+    
+    AccelContext* context = findContext(context_id);
+    if (!context) {
+        IOLockUnlock(m_lock);
+        return kIOReturnNotFound;
+    }
+    
+    IOReturn ret = m_gpu_device->executeEncodedCommands(context->gpu_context_id, submission);
+    if (ret == kIOReturnSuccess)
+        m_commands_submitted++;
+    
+    IOLockUnlock(m_lock);
+    
+    return ret;
+}
+
+IOReturn CLASS::getVirGLResourceHandle(uint32_t surface_id, uint32_t* resource_handle)
+{
+    if (!resource_handle)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_lock);
+    
+    AccelSurface* surface = findSurface(surface_id);
+    if (surface)
+        *resource_handle = surface->gpu_resource_id;
+    
+    IOLockUnlock(m_lock);
+    return (surface && *resource_handle) ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+uint32_t CLASS::getVirGLCapabilities() const
+{
+    return m_gpu_device ? m_gpu_device->getVirGLCapabilities() : 0;
+}
+
+bool CLASS::supportsVirGL() const
+{
+    return m_gpu_device && m_gpu_device->supports3D();
+}
+
+// Guest copy of a surface, what the CPU last wrote to its backing store.
+// Nothing transfers host writes back, so a surface any submission may have
+// written on the host is refused with kIOReturnNotReadable.
+IOReturn CLASS::readSurfaceData(uint32_t surface_id, uint64_t offset, void* data, size_t length)
+{
+    IOReturn ret = kIOReturnSuccess;
+    
+    if (!data)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_lock);
+    
+    AccelSurface* surface = findSurface(surface_id);
+    if (!surface || !surface->backing_memory) {
+        ret = kIOReturnNotFound;
+    } else if (isHostDirtyLocked(surface)) {
+        ret = kIOReturnNotReadable;
+    } else if (offset > surface->backing_memory->getLength() ||
+               length > surface->backing_memory->getLength() - offset) {
+        ret = kIOReturnOverrun;
+    } else if (surface->backing_memory->readBytes(offset, data, length) != length) {
+        ret = kIOReturnIOError;
+    }
+    
+    IOLockUnlock(m_lock);
+    return ret;
+}
+
+// Called before a VirGL submission with the surfaces it writes on the host,
+// 'unknown' when it also writes surfaces it does not name
+void CLASS::markHostWritten(uint32_t context_id, const uint32_t* surface_ids, uint32_t count, bool unknown)
+{
+    IOLockLock(m_lock);
+    
+    if (unknown) {
+        AccelContext* context = findContext(context_id);
+        if (context)
+            context->host_writes_unknown = true;
+    }
+    for (uint32_t i = 0; surface_ids && i < count; i++) {
+        AccelSurface* surface = findSurface(surface_ids[i]);
+        if (surface)
+            surface->host_dirty = true;
+    }
+    
+    IOLockUnlock(m_lock);
+}
+
+bool CLASS::isHostDirtyLocked(AccelSurface* surface)
+{
+    if (surface->host_dirty)
+        return true;
+    for (unsigned int i = 0; i < m_contexts->getCount(); i++) {
+        AccelContext* context = (AccelContext*)m_contexts->getObject(i);
+        if (context && context->host_writes_unknown && context->surfaces &&
+            context->surfaces->containsObject((OSObject*)surface))
+            return true;
+    }
+    return false;
+}
+
 CLASS::AccelContext* CLASS::findContext(uint32_t context_id)
 {
     for (unsigned int i = 0; i < m_contexts->getCount(); i++) {
@@ -3492,8 +3677,8 @@ IOReturn CLASS::getCommandPoolStatistics(void* stats)
     }* pool_stats = (typeof(pool_stats))stats;
     
     // Provide basic statistics
-    pool_stats->buffers_allocated = 16; // Default pool size
-    pool_stats->buffers_in_use = 1;
+    pool_stats->buffers_in_use = m_command_pool->getActiveBufferCount();
+    pool_stats->buffers_allocated = pool_stats->buffers_in_use + m_command_pool->getAvailableBufferCount();
     pool_stats->peak_usage = 4;
     pool_stats->total_commands_processed = m_commands_submitted;
     
@@ -3504,6 +3689,143 @@ IOReturn CLASS::getCommandPoolStatistics(void* stats)
     return kIOReturnSuccess;
 }
 
+// GPU timeline profiling
+
+#define VM_GPU_TRACE_EVENT_JSON_MAX     256     // Worst case for one event's JSON object
+
+// Trace timestamps are microseconds with nanosecond fraction
+static void VMTraceMicros(uint64_t delta, uint64_t* us, uint64_t* ns_frac)
+{
+    uint64_t ns;
+    absolutetime_to_nanoseconds(delta, &ns);
+    *us = ns / 1000;
+    *ns_frac = ns % 1000;
+}
+
+void CLASS::recordTraceEvent(const VMGPUTraceEvent* event)
+{
+    IOLockLock(m_trace_lock);
+    
+    if (m_trace_events) {
+        VMGPUTraceEvent* slot = &m_trace_events[m_trace_head];
+        memcpy(slot, event, sizeof(*slot));
+        
+        // Names are written out as JSON strings
+        slot->name[VM_GPU_TRACE_NAME_MAX - 1] = 0;
+        for (char* c = slot->name; *c; c++) {
+            if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20)
+                *c = '_';
+        }
+        
+        m_trace_head = (m_trace_head + 1) % VM_GPU_TRACE_CAPACITY;
+        if (m_trace_count < VM_GPU_TRACE_CAPACITY)
+            m_trace_count++;
+    }
+    
+    IOLockUnlock(m_trace_lock);
+}
+
+IOReturn CLASS::startPerformanceProfiling(uint32_t context_id)
+{
+    VMGPUTraceEvent* events = nullptr;
+    
+    if (!m_trace_events) {
+        events = (VMGPUTraceEvent*)IOMalloc(VM_GPU_TRACE_CAPACITY * sizeof(VMGPUTraceEvent));
+        if (!events)
+            return kIOReturnNoMemory;
+    }
+    
+    IOLockLock(m_trace_lock);
+    
+    if (!m_trace_events) {
+        m_trace_events = events;
+        events = nullptr;
+    }
+    m_trace_head = 0;
+    m_trace_count = 0;
+    m_profile_context = context_id;
+    m_profiling = true;
+    m_trace_held = false;
+    
+    IOLockUnlock(m_trace_lock);
+    
+    if (events)
+        IOFree(events, VM_GPU_TRACE_CAPACITY * sizeof(VMGPUTraceEvent));
+    
+    IOLog("VMQemuVGAAccelerator: GPU profiling started for context %u\n", context_id);
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::stopPerformanceProfiling(uint32_t context_id, void** results_buffer, size_t* buffer_size,
+                                         size_t max_length)
+{
+    if (!results_buffer || !buffer_size)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_trace_lock);
+    
+    if ((!m_profiling && !m_trace_held) || context_id != m_profile_context) {
+        IOLockUnlock(m_trace_lock);
+        return kIOReturnNotOpen;
+    }
+    m_profiling = false;
+    
+    size_t capacity = 32 + (size_t)m_trace_count * VM_GPU_TRACE_EVENT_JSON_MAX;
+    char* json = (char*)IOMalloc(capacity);
+    if (!json) {
+        IOLockUnlock(m_trace_lock);
+        return kIOReturnNoMemory;
+    }
+    
+    // Timestamps count from the oldest submission
+    uint32_t first = (m_trace_head + VM_GPU_TRACE_CAPACITY - m_trace_count) % VM_GPU_TRACE_CAPACITY;
+    uint64_t base = ~0ULL;
+    for (uint32_t i = 0; i < m_trace_count; i++) {
+        const VMGPUTraceEvent* event = &m_trace_events[(first + i) % VM_GPU_TRACE_CAPACITY];
+        if (event->submit_time < base)
+            base = event->submit_time;
+    }
+    
+    // One CPU span per command buffer, submit() to the submission being handed
+    // to the host, measured by the driver
+    size_t pos = snprintf(json, capacity, "{\"traceEvents\":[");
+    for (uint32_t i = 0; i < m_trace_count && pos < capacity; i++) {
+        const VMGPUTraceEvent* event = &m_trace_events[(first + i) % VM_GPU_TRACE_CAPACITY];
+        uint64_t end = (event->end_time > event->submit_time) ? event->end_time : event->submit_time;
+        uint64_t ts, ts_frac, dur, dur_frac;
+        
+        VMTraceMicros(event->submit_time - base, &ts, &ts_frac);
+        VMTraceMicros(end - event->submit_time, &dur, &dur_frac);
+        pos += snprintf(json + pos, capacity - pos,
+                        "%s{\"name\":\"%s\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":%u,\"tid\":0,"
+                        "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+                        pos > 16 ? "," : "", event->name, event->context_id,
+                        ts, ts_frac, dur, dur_frac);
+    }
+    if (pos < capacity)
+        snprintf(json + pos, capacity - pos, "]}");
+    
+    // Too big for the caller, keep the events so it can retry with room
+    size_t length = strnlen(json, capacity - 1) + 1;
+    m_trace_held = (length > max_length);
+    if (m_trace_held) {
+        IOLockUnlock(m_trace_lock);
+        IOFree(json, capacity);
+        *results_buffer = nullptr;
+        *buffer_size = length;
+        return kIOReturnNoSpace;
+    }
+    
+    IOLog("VMQemuVGAAccelerator: GPU profiling stopped for context %u, %u events\n",
+          context_id, m_trace_count);
+    
+    IOLockUnlock(m_trace_lock);
+    
+    *results_buffer = json;
+    *buffer_size = capacity;
+    return kIOReturnSuccess;
+}
+
 // Shader Manager Helper Methods
 IOReturn CLASS::setShaderUniform(uint32_t program_id, const char* name, const void* data, size_t size)
 {
@@ -70,6 +70,93 @@ struct VM3DSurfaceInfo {
     uint32_t flags;
 };
 
+// Command ring shared with user space, one per VMQemuVGA3DUserClient and
+// mapped with memory type kVM3DUserClientCommandRing. The client appends
+// records at 'tail' and publishes them by storing the new tail, the kernel
+// consumes them from 'head'. Both offsets run freely and wrap modulo
+// VM3D_RING_DATA_SIZE; a record never wraps, when it does not fit before
+// the end of the data area the client first fills the rest with a
+// VM3D_RING_RECORD_PAD record. While the kernel drains the ring it sets
+// VM3D_RING_FLAG_POLLING and keeps picking up new records, so the client
+// only calls kVM3DUserClientRingDoorbell after publishing if it is clear.
+// One drain handles at most VM3D_RING_DRAIN_RECORDS records or runs for
+// VM3D_RING_DRAIN_NS, then clears the flag and returns kIOReturnBusy if
+// records are left; the client rings again for those. The doorbell runs
+// inside the accelerator's command gate like every other selector, so the
+// budget also bounds how long it holds off other clients.
+#define VM3D_RING_HEADER_SIZE           64
+#define VM3D_RING_DATA_SIZE             (256 * 1024)        // Power of two
+#define VM3D_RING_SIZE                  (VM3D_RING_HEADER_SIZE + VM3D_RING_DATA_SIZE)
+#define VM3D_RING_ALIGN                 8
+#define VM3D_RING_FLAG_POLLING          0x1
+#define VM3D_RING_POLL_NS               50000               // Idle time before the kernel stops polling
+#define VM3D_RING_DRAIN_NS              1000000             // Budget of one drain, polling included
+#define VM3D_RING_DRAIN_RECORDS         256
+
+enum VM3DRingRecordType {
+    VM3D_RING_RECORD_COMMANDS = 1,                          // Payload goes to submit3DCommands
+    VM3D_RING_RECORD_PAD                                    // Skipped
+};
+
+struct VM3DRingHeader {
+    volatile uint32_t head;                                 // Written by the kernel
+    volatile uint32_t tail;                                 // Written by the client
+    volatile uint32_t flags;                                // VM3D_RING_FLAG_*, written by the kernel
+    volatile uint32_t status;                               // IOReturn of the last failed record
+    volatile uint32_t status_offset;                        // Its ring offset
+    uint32_t data_size;                                     // VM3D_RING_DATA_SIZE
+    uint32_t reserved[10];
+};
+
+// Occupies sizeof(VM3DRingRecord) + length rounded up to VM3D_RING_ALIGN
+struct VM3DRingRecord {
+    uint32_t type;                                          // VM3DRingRecordType
+    uint32_t length;                                        // Payload bytes
+};
+
+// kVM3DUserClientExecuteBatch runs an array of these in order inside one
+// acquisition of the accelerator's command gate, all against the client's
+// own context. Every selector of the user client goes through that gate, so
+// no other call on any client interleaves with a batch. Each op gets its own result; with VM3D_BATCH_FLAG_STOP_ON_ERROR
+// a failure leaves the remaining ops kIOReturnAborted. The array is passed
+// inline and comes back with 'result' and 'value' filled in.
+#define VM3D_BATCH_MAX_OPS              64
+#define VM3D_BATCH_FLAG_SURFACE_FROM_OP 0x1                 // surface_id indexes an earlier CREATE_SURFACE op
+#define VM3D_BATCH_FLAG_STOP_ON_ERROR   0x2
+
+enum VM3DBatchOpType {
+    VM3D_BATCH_CREATE_CONTEXT = 1,                          // value: context id
+    VM3D_BATCH_DESTROY_CONTEXT,
+    VM3D_BATCH_CREATE_SURFACE,                              // surface in, value: surface id
+    VM3D_BATCH_DESTROY_SURFACE,
+    VM3D_BATCH_SUBMIT_RING,                                 // Drains the ring without polling or waiting on it
+    VM3D_BATCH_PRESENT_SURFACE
+};
+
+struct VM3DBatchOp {
+    uint32_t type;                                          // VM3DBatchOpType
+    uint32_t flags;                                         // VM3D_BATCH_FLAG_*
+    uint32_t surface_id;                                    // DESTROY_SURFACE, PRESENT_SURFACE
+    uint32_t result;                                        // Out: IOReturn
+    uint32_t value;                                         // Out
+    uint32_t reserved;
+    VM3DSurfaceInfo surface;                                // CREATE_SURFACE
+};
+
+// GPU timeline profiling
+#define VM_GPU_TRACE_CAPACITY           4096
+#define VM_GPU_TRACE_NAME_MAX           48
+
+// One submitted command buffer on the timeline, times in mach_absolute_time().
+// Both are taken by the driver: the control queue has no used ring to read a
+// fence back from, so there is no host start or completion to record.
+struct VMGPUTraceEvent {
+    char name[VM_GPU_TRACE_NAME_MAX];
+    uint32_t context_id;
+    uint64_t submit_time;       // CPU reached submit()
+    uint64_t end_time;          // The submission was handed to the host
+};
+
 class VMQemuVGAAccelerator : public IOService
 {
     OSDeclareDefaultStructors(VMQemuVGAAccelerator);
@@ -98,6 +185,7 @@ private:
         OSSet* surfaces;
         IOMemoryDescriptor* command_buffer;
         task_t owning_task;
+        bool host_writes_unknown;   // Ran streams whose host writes are not known
     };
     
     // Surface management
@@ -107,6 +195,7 @@ private:
         VM3DSurfaceInfo info;
         IOMemoryDescriptor* backing_memory;
         bool is_render_target;
+        bool host_dirty;            // Written on the host, never read back
     };
     
     OSArray* m_contexts;
@@ -114,6 +203,15 @@ private:
     uint32_t m_next_context_id;
     uint32_t m_next_surface_id;
     
+    // Timeline profiling, a ring of the newest VM_GPU_TRACE_CAPACITY events
+    IOLock* m_trace_lock;
+    VMGPUTraceEvent* m_trace_events;
+    uint32_t m_trace_head;
+    uint32_t m_trace_count;
+    uint32_t m_profile_context;     // 0 profiles every context
+    volatile bool m_profiling;
+    bool m_trace_held;              // Stopped, trace not yet handed out
+    
     // Statistics
     uint32_t m_draw_calls;
     uint32_t m_triangles_rendered;
@@ -125,6 +223,7 @@ private:
     // Internal methods
     AccelContext* findContext(uint32_t context_id);
     AccelSurface* findSurface(uint32_t surface_id);
+    bool isHostDirtyLocked(AccelSurface* surface);
     IOReturn createContextInternal(uint32_t* context_id, task_t task);
     IOReturn destroyContextInternal(uint32_t context_id);
     IOReturn createSurfaceInternal(uint32_t context_id, VM3DSurfaceInfo* info);
@@ -160,6 +259,15 @@ public:
     IOReturn create3DSurface(uint32_t context_id, VM3DSurfaceInfo* surface_info);
     IOReturn destroy3DSurface(uint32_t context_id, uint32_t surface_id);
     IOReturn submit3DCommands(uint32_t context_id, IOMemoryDescriptor* commands);
+    IOReturn submit3DCommandBytes(uint32_t context_id, const void* commands, size_t length);
+    IOReturn submitVirGLCommands(uint32_t context_id, IOBufferMemoryDescriptor* submission);
+    
+    // VirGL lookups for VMVirGLEncoder
+    IOReturn getVirGLResourceHandle(uint32_t surface_id, uint32_t* resource_handle);
+    uint32_t getVirGLCapabilities() const;
+    bool supportsVirGL() const;
+    IOReturn readSurfaceData(uint32_t surface_id, uint64_t offset, void* data, size_t length);
+    void markHostWritten(uint32_t context_id, const uint32_t* surface_ids, uint32_t count, bool unknown);
     IOReturn present3DSurface(uint32_t context_id, uint32_t surface_id);
     
     // Performance monitoring
@@ -178,6 +286,7 @@ public:
     // Integration with framebuffer
     VMQemuVGA* getFramebuffer() const { return m_framebuffer; }
     VMVirtIOGPU* getGPUDevice() const { return m_gpu_device; }
+    IOCommandGate* getCommandGate() const { return m_command_gate; }
     
     // Advanced 3D subsystems
     VMShaderManager* getShaderManager() const { return m_shader_manager; }
@@ -258,8 +367,17 @@ public:
     IOReturn synchronize();
     
     // Performance profiling
+    // stop returns a NUL-terminated Chrome trace (chrome://tracing, Perfetto)
+    // in an IOMalloc()ed buffer of *buffer_size bytes, the caller IOFree()s it.
+    // A trace longer than max_length fails with kIOReturnNoSpace and the
+    // length needed in *buffer_size; recording stops but the events are kept
+    // for the next stop call.
     IOReturn startPerformanceProfiling(uint32_t context_id);
-    IOReturn stopPerformanceProfiling(uint32_t context_id, void** results_buffer, size_t* buffer_size);
+    IOReturn stopPerformanceProfiling(uint32_t context_id, void** results_buffer, size_t* buffer_size,
+                                      size_t max_length);
+    bool isProfiling(uint32_t context_id) const
+        { return m_profiling && (!m_profile_context || m_profile_context == context_id); }
+    void recordTraceEvent(const VMGPUTraceEvent* event);
     
     // Performance and timing utilities
     uint64_t getCurrentTimestamp();
@@ -285,12 +403,28 @@ private:
     uint32_t m_context_id;
     bool m_has_context;
     
+    // Shared command ring, allocated on first map; m_ring_head is the
+    // kernel's own copy of the consumer offset
+    IOLock* m_ring_lock;
+    IOBufferMemoryDescriptor* m_ring;
+    uint32_t m_ring_head;
+    
+    IOReturn drainRing(bool poll);
+    IOReturn executeBatch(VM3DBatchOp* ops, uint32_t count);
+    static IOReturn gatedExternalMethod(OSObject* owner, void* arg0, void* arg1,
+                                        void* arg2, void* arg3);
+    static IOReturn gatedCloseContext(OSObject* owner, void* arg0, void* arg1,
+                                      void* arg2, void* arg3);
+    
 public:
     virtual bool initWithTask(task_t owningTask, void* securityToken, UInt32 type,
                              OSDictionary* properties) override;
     virtual bool start(IOService* provider) override;
     virtual IOReturn clientClose() override;
     virtual IOReturn clientDied() override;
+    virtual void free() override;
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options,
+                                         IOMemoryDescriptor** memory) override;
     
     // Method dispatch table
     virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments* args,
@@ -314,8 +448,16 @@ public:
                                     IOExternalMethodArguments* args);
     static IOReturn sPresent3DSurface(OSObject* target, void* reference,
                                     IOExternalMethodArguments* args);
+    static IOReturn sStartProfiling(OSObject* target, void* reference,
+                                  IOExternalMethodArguments* args);
+    static IOReturn sStopProfiling(OSObject* target, void* reference,
+                                 IOExternalMethodArguments* args);
     static IOReturn sGetCapabilities(OSObject* target, void* reference,
                                    IOExternalMethodArguments* args);
+    static IOReturn sRingDoorbell(OSObject* target, void* reference,
+                                IOExternalMethodArguments* args);
+    static IOReturn sExecuteBatch(OSObject* target, void* reference,
+                                IOExternalMethodArguments* args);
 };
 
 // Method selectors for user client
@@ -327,7 +469,16 @@ enum {
     kVM3DUserClientSubmit3DCommands,
     kVM3DUserClientPresent3DSurface,
     kVM3DUserClientGetCapabilities,
+    kVM3DUserClientStartProfiling,
+    kVM3DUserClientStopProfiling,
+    kVM3DUserClientRingDoorbell,
+    kVM3DUserClientExecuteBatch,
     kVM3DUserClientMethodCount
 };
 
+// Memory types for IOConnectMapMemory64()
+enum {
+    kVM3DUserClientCommandRing = 0
+};
+
 #endif /* __VMQemuVGAAccelerator_H__ */
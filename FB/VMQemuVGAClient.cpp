@@ -34,22 +34,29 @@
 
 #include "VMQemuVGAClient.h"
 #include "VMQemuVGA.h"
+#include <IOKit/IOBufferMemoryDescriptor.h>
 
 #define super IOUserClient
 
 OSDefineMetaClassAndStructors(VMQemuVGAClient, IOUserClient);
 
 
-static IOExternalMethod const iofbFuncsCache[1] =
+static IOExternalMethod const iofbFuncsCache[2] =
 {
-	{nullptr, reinterpret_cast<IOMethod>(&VMQemuVGA::CustomMode), kIOUCStructIStructO, sizeof(CustomModeData), sizeof(CustomModeData)}
+	{nullptr, reinterpret_cast<IOMethod>(&VMQemuVGA::CustomMode), kIOUCStructIStructO, sizeof(CustomModeData), sizeof(CustomModeData)},
+	{nullptr, reinterpret_cast<IOMethod>(&VMQemuVGAClient::Capture), kIOUCStructIStructO, sizeof(CaptureRequestData), sizeof(CaptureResultData)}
 };
 
 IOExternalMethod* VMQemuVGAClient::getTargetAndMethodForIndex(IOService** targetP, UInt32 index)
 {
-	IOLog( "%s: index=%u.\n", __FUNCTION__, static_cast<unsigned>(index));
 	if (!targetP)
 		return 0;
+	//polled at frame rate, keep it out of the log
+	if (index == CAPTURE_METHOD_INDEX) {
+		*targetP = this;
+		return const_cast<IOExternalMethod*>(&iofbFuncsCache[1]);
+	}
+	IOLog( "%s: index=%u.\n", __FUNCTION__, static_cast<unsigned>(index));
 	if (index != 0 && index != 3) {
 		IOLog( "%s: Invalid index %u.\n",
 				  __FUNCTION__, static_cast<unsigned>(index));
@@ -72,5 +79,108 @@ bool VMQemuVGAClient::initWithTask(task_t owningTask, void* securityToken, UInt3
 	if (!super::initWithTask(owningTask, securityToken, type) ||
 		clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
 		return false;
+	m_capture_lock = IOLockAlloc();
+	return m_capture_lock != 0;
+}
+
+void VMQemuVGAClient::free()
+{
+	for (uint32_t i = 0U; i != 2U; ++i)
+		if (m_snapshot[i]) {
+			m_snapshot[i]->release();
+			m_snapshot[i] = 0;
+		}
+	if (m_capture_lock) {
+		IOLockFree(m_capture_lock);
+		m_capture_lock = 0;
+	}
+	super::free();
+}
+
+// Called with m_capture_lock held. Snapshots are sized to the current mode and
+// replaced when it changes, *resized tells the client's mappings are now stale
+bool VMQemuVGAClient::allocSnapshots(bool* resized)
+{
+	VMQemuVGA* fb = OSDynamicCast(VMQemuVGA, getProvider());
+	size_t size;
+	
+	if (!fb || !fb->isShadowFramebufferEnabled())
+		return false;
+	size = fb->getShadowFramebufferSize();
+	if (!size)
+		return false;
+	for (uint32_t i = 0U; i != 2U; ++i) {
+		if (m_snapshot[i]) {
+			if (m_snapshot[i]->getLength() == size)
+				continue;
+			m_snapshot[i]->release();
+			m_snapshot[i] = 0;
+			m_snapshot_replaced = true;
+		}
+		m_snapshot[i] = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+															  size, page_size);
+		if (!m_snapshot[i])
+			return false;
+		m_snapshot_seq[i] = 0U;
+	}
+	*resized = m_snapshot_replaced;
+	m_snapshot_replaced = false;
 	return true;
 }
+
+IOReturn VMQemuVGAClient::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory)
+{
+	IOReturn ret = kIOReturnUnsupported;
+	bool resized;
+	
+	if (type > 1U || !options || !memory)
+		return kIOReturnBadArgument;
+	IOLockLock(m_capture_lock);
+	//the client is mapping again, its old mappings are no longer stale
+	if (allocSnapshots(&resized)) {
+		m_snapshot[type]->retain();
+		*memory = m_snapshot[type];
+		*options = kIOMapReadOnly;
+		ret = kIOReturnSuccess;
+	}
+	IOLockUnlock(m_capture_lock);
+	return ret;
+}
+
+IOReturn VMQemuVGAClient::Capture(CaptureRequestData const* inData, CaptureResultData* outData,
+								  size_t inSize, size_t* outSize)
+{
+	VMQemuVGA* fb = OSDynamicCast(VMQemuVGA, getProvider());
+	uint32_t idx;
+	IOReturn ret;
+	bool resized;
+	
+	if (!fb || !inData || !outData || !outSize ||
+		inSize < sizeof(CaptureRequestData) || *outSize < sizeof(CaptureResultData))
+		return kIOReturnBadArgument;
+	
+	IOLockLock(m_capture_lock);
+	if (!allocSnapshots(&resized)) {
+		IOLockUnlock(m_capture_lock);
+		return kIOReturnUnsupported;
+	}
+	//the mode changed size, the client must map both snapshots again
+	if (resized) {
+		IOLockUnlock(m_capture_lock);
+		return kIOReturnNoSpace;
+	}
+	//fill the snapshot the client is not looking at, then swap
+	idx = m_snapshot_next;
+	ret = fb->captureShadowFramebuffer(inData->sequence,
+									   static_cast<uint8_t*>(m_snapshot[idx]->getBytesNoCopy()),
+									   m_snapshot[idx]->getLength(),
+									   &m_snapshot_seq[idx],
+									   outData);
+	if (ret == kIOReturnSuccess) {
+		outData->buffer = idx;
+		m_snapshot_next = idx ^ 1U;
+		*outSize = sizeof(CaptureResultData);
+	}
+	IOLockUnlock(m_capture_lock);
+	return ret;
+}
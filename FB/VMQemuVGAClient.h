@@ -36,15 +36,32 @@
 #define _VMQemuVGAClient_H_
 
 #include <IOKit/IOUserClient.h>
+#include "common_fb.h"
+
+class IOBufferMemoryDescriptor;
 
 class VMQemuVGAClient: public IOUserClient
 {
 	OSDeclareDefaultStructors(VMQemuVGAClient);
 
+private:
+	IOLock* m_capture_lock;
+	IOBufferMemoryDescriptor* m_snapshot[2];	//capture snapshots, swapped on each capture
+	uint32_t m_snapshot_seq[2];				//shadow sequence each snapshot is current to
+	uint32_t m_snapshot_next;				//snapshot the next capture fills
+	bool m_snapshot_replaced;				//snapshots changed size since the client last mapped them
+
+	bool allocSnapshots(bool* resized);
+
 public:
 	IOExternalMethod* getTargetAndMethodForIndex(IOService** targetP, UInt32 index) override;
 	IOReturn clientClose() override;
+	IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) override;
 	bool initWithTask(task_t owningTask, void* securityToken, UInt32 type) override;
+	void free() override;
+
+	IOReturn Capture(CaptureRequestData const* inData, CaptureResultData* outData,
+					 size_t inSize, size_t* outSize);
 };
 
 #endif /* _VMQemuVGAClient_H_ */
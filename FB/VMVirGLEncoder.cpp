@@ -0,0 +1,981 @@
+#include "VMVirGLEncoder.h"
+#include "VMQemuVGAAccelerator.h"
+#include "virtio_gpu.h"
+#include <IOKit/IOLib.h>
+#include <mach/mach_time.h>
+#include <kern/clock.h>
+
+#define CLASS VMVirGLEncoder
+#define super OSObject
+
+static_assert(VM_VIRGL_SUBMIT_HEADER_SIZE == sizeof(virtio_gpu_cmd_submit),
+              "submission header must match virtio_gpu_cmd_submit");
+
+#define VM_VIRGL_INVALID        0xFFFFFFFF  // Sizer verdict for a malformed record
+#define VM_VIRGL_FLUSH_VERTEX   0x1         // Entry draws, send deferred vertex buffers first
+
+typedef uint32_t (*VMVirGLSizer)(const VMCommandHeader* header);
+typedef uint32_t* (*VMVirGLEmitter)(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out);
+
+struct VMVirGLEncoderEntry {
+    uint32_t flags;
+    VMVirGLSizer dwords;        // Upper bound on what emit writes
+    VMVirGLEmitter emit;        // Returns the new end, nullptr on error
+};
+
+// Record carries at least 'bytes' of command data
+static inline bool VMVirGLRecordHolds(const VMCommandHeader* header, size_t bytes)
+{
+    return header->size >= bytes;
+}
+
+// IEEE single <-> 16.16 fixed point, the kernel never touches the FPU
+static int64_t VMFloatBitsToFixed(uint32_t bits)
+{
+    int32_t exponent = (bits >> 23) & 0xFF;
+    int64_t mantissa = (bits & 0x7FFFFF) | 0x800000;
+    int32_t shift = exponent - 134;     // value * 2^16 = mantissa * 2^(exponent - 150 + 16)
+    int64_t value;
+
+    // Zero, denormals, infinities and NaN all end up as 0
+    if (!exponent || exponent == 0xFF)
+        return 0;
+    if (shift >= 0)
+        value = (shift > 23) ? ((int64_t)1 << 47) : (mantissa << shift);
+    else
+        value = (shift < -24) ? 0 : (mantissa >> -shift);
+    return (bits & 0x80000000) ? -value : value;
+}
+
+static uint32_t VMFixedToFloatBits(int64_t fixed)
+{
+    uint32_t sign = 0;
+    uint64_t magnitude = (uint64_t)fixed;
+    uint64_t mantissa;
+    int32_t msb;
+
+    if (!fixed)
+        return 0;
+    if (fixed < 0) {
+        sign = 0x80000000;
+        magnitude = (uint64_t)-fixed;
+    }
+    msb = 63 - __builtin_clzll(magnitude);
+    mantissa = (msb > 23) ? (magnitude >> (msb - 23)) : (magnitude << (23 - msb));
+    return sign | ((uint32_t)(msb + 111) << 23) | ((uint32_t)mantissa & 0x7FFFFF);
+}
+
+static inline uint32_t* VMVirGLEmitDraw(uint32_t* out, uint32_t mode,
+                                        uint32_t start, uint32_t count, bool indexed,
+                                        uint32_t instance_count, int32_t index_bias,
+                                        uint32_t start_instance)
+{
+    out[0] = VIRGL_CMD0(VIRGL_CCMD_DRAW_VBO, 0, VIRGL_DRAW_VBO_SIZE);
+    out[1] = start;
+    out[2] = count;
+    out[3] = mode;
+    out[4] = indexed;
+    out[5] = instance_count;
+    out[6] = (uint32_t)index_bias;
+    out[7] = start_instance;
+    out[8] = 0;                                         // primitive_restart
+    out[9] = 0;                                         // restart_index
+    out[10] = indexed ? 0 : start;                      // min_index
+    out[11] = indexed ? 0xFFFFFFFF : start + count - 1; // max_index
+    out[12] = 0;                                        // count_from_so
+    return out + 1 + VIRGL_DRAW_VBO_SIZE;
+}
+
+// VMPrimitiveTopology -> PIPE_PRIM_*
+static const uint32_t s_topology_prims[VM_PRIMITIVE_TOPOLOGY_COUNT] = {
+    PIPE_PRIM_POINTS,
+    PIPE_PRIM_LINES,
+    PIPE_PRIM_LINE_STRIP,
+    PIPE_PRIM_TRIANGLES,
+    PIPE_PRIM_TRIANGLE_STRIP,
+    PIPE_PRIM_TRIANGLE_FAN,
+};
+
+// Per-type encoders
+
+// Records with no host side effect, accepted and dropped
+struct VMVirGLEncodeNop {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        return 0;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        return out;
+    }
+};
+
+// Pipeline ids have no host objects behind them, the client creates and
+// binds its shaders and state objects in its own context. Only the
+// topology is used, by the draws that follow.
+template <> struct VMVirGLEncode<VM_CMD_BIND_PIPELINE> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        if (!VMVirGLRecordHolds(header, sizeof(VMBindPipelineCommand) - sizeof(VMCommandHeader)))
+            return VM_VIRGL_INVALID;
+        return 0;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMBindPipelineCommand* cmd = (const VMBindPipelineCommand*)header;
+
+        if (cmd->topology >= VM_PRIMITIVE_TOPOLOGY_COUNT) {
+            encoder->m_error = kIOReturnBadArgument;
+            return nullptr;
+        }
+        encoder->m_topology = s_topology_prims[cmd->topology];
+        return out;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_BIND_COMPUTE_PIPELINE> : VMVirGLEncodeNop {};
+
+template <> struct VMVirGLEncode<VM_CMD_BIND_VERTEX_BUFFERS> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        const VMBindVertexBuffersCommand* cmd = (const VMBindVertexBuffersCommand*)header;
+
+        if (!VMVirGLRecordHolds(header, sizeof(VMBindVertexBuffersCommand) - sizeof(VMCommandHeader)) ||
+            !VMVirGLRecordHolds(header, sizeof(VMBindVertexBuffersCommand) - sizeof(VMCommandHeader) +
+                                        cmd->binding_count * sizeof(VMVertexBufferBinding)))
+            return VM_VIRGL_INVALID;
+        // Deferred to the next draw
+        return 0;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMBindVertexBuffersCommand* cmd = (const VMBindVertexBuffersCommand*)header;
+
+        if (cmd->first_binding >= VIRGL_MAX_VERTEX_BUFFERS ||
+            cmd->binding_count > VIRGL_MAX_VERTEX_BUFFERS - cmd->first_binding) {
+            encoder->m_error = kIOReturnBadArgument;
+            return nullptr;
+        }
+
+        for (uint32_t i = 0; i < cmd->binding_count; i++) {
+            uint32_t slot = cmd->first_binding + i;
+            uint32_t handle = encoder->resourceHandle(cmd->bindings[i].buffer_id);
+            if (!handle) {
+                encoder->m_error = kIOReturnNotFound;
+                return nullptr;
+            }
+            encoder->m_vertex_handles[slot] = handle;
+            encoder->m_vertex_offsets[slot] = (uint32_t)cmd->bindings[i].offset;
+            encoder->m_vertex_strides[slot] = cmd->bindings[i].stride;
+        }
+        if (encoder->m_vertex_count < cmd->first_binding + cmd->binding_count)
+            encoder->m_vertex_count = cmd->first_binding + cmd->binding_count;
+        encoder->m_vertex_dirty = true;
+        return out;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_BIND_INDEX_BUFFER> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        if (!VMVirGLRecordHolds(header, sizeof(VMBindIndexBufferCommand) - sizeof(VMCommandHeader)))
+            return VM_VIRGL_INVALID;
+        return 1 + VIRGL_SET_INDEX_BUFFER_SIZE;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMBindIndexBufferCommand* cmd = (const VMBindIndexBufferCommand*)header;
+
+        if ((cmd->index_size != 2 && cmd->index_size != 4) || cmd->offset > 0xFFFFFFFF) {
+            encoder->m_error = kIOReturnBadArgument;
+            return nullptr;
+        }
+        uint32_t handle = encoder->resourceHandle(cmd->buffer_id);
+        if (!handle) {
+            encoder->m_error = kIOReturnNotFound;
+            return nullptr;
+        }
+        if (handle == encoder->m_index_handle && cmd->index_size == encoder->m_index_size &&
+            (uint32_t)cmd->offset == encoder->m_index_offset)
+            return out;
+
+        encoder->m_index_handle = handle;
+        encoder->m_index_size = cmd->index_size;
+        encoder->m_index_offset = (uint32_t)cmd->offset;
+        out[0] = VIRGL_CMD0(VIRGL_CCMD_SET_INDEX_BUFFER, 0, VIRGL_SET_INDEX_BUFFER_SIZE);
+        out[1] = handle;
+        out[2] = cmd->index_size;
+        out[3] = (uint32_t)cmd->offset;
+        return out + 1 + VIRGL_SET_INDEX_BUFFER_SIZE;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_DRAW> {
+    static const uint32_t kFlags = VM_VIRGL_FLUSH_VERTEX;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        if (!VMVirGLRecordHolds(header, sizeof(VMDrawCommand) - sizeof(VMCommandHeader)))
+            return VM_VIRGL_INVALID;
+        return 1 + VIRGL_DRAW_VBO_SIZE;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMDrawCommand* cmd = (const VMDrawCommand*)header;
+
+        return VMVirGLEmitDraw(out, encoder->m_topology,
+                               cmd->first_vertex, cmd->vertex_count, false,
+                               cmd->instance_count, 0, cmd->first_instance);
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_DRAW_INDEXED> {
+    static const uint32_t kFlags = VM_VIRGL_FLUSH_VERTEX;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        if (!VMVirGLRecordHolds(header, sizeof(VMDrawIndexedCommand) - sizeof(VMCommandHeader)))
+            return VM_VIRGL_INVALID;
+        return 1 + VIRGL_DRAW_VBO_SIZE;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMDrawIndexedCommand* cmd = (const VMDrawIndexedCommand*)header;
+
+        // Whatever the host had bound before this submission is not ours
+        if (!encoder->m_index_handle) {
+            encoder->m_error = kIOReturnNotReady;
+            return nullptr;
+        }
+        return VMVirGLEmitDraw(out, encoder->m_topology,
+                               cmd->first_index, cmd->index_count, true,
+                               cmd->instance_count, cmd->vertex_offset, cmd->first_instance);
+    }
+};
+
+// One DRAW_VBO with the indirect packet when the host has
+// VIRGL_CAP_MULTI_DRAW_INDIRECT. Otherwise the argument records are read from
+// the guest copy of the buffer in one go and expanded into plain draws, which
+// is refused once this stream or an earlier submission wrote that buffer on
+// the host.
+// Indexed draws use the index buffer bound earlier in the submission.
+template <bool Indexed> struct VMVirGLEncodeIndirect {
+    static const uint32_t kFlags = VM_VIRGL_FLUSH_VERTEX;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        const VMDrawIndirectCommand* cmd = (const VMDrawIndirectCommand*)header;
+
+        if (!VMVirGLRecordHolds(header, sizeof(VMDrawIndirectCommand) - sizeof(VMCommandHeader)) ||
+            cmd->draw_count > VM_COMMAND_MAX_INDIRECT_DRAWS)
+            return VM_VIRGL_INVALID;
+        uint32_t expanded = cmd->draw_count * (1 + VIRGL_DRAW_VBO_SIZE);
+        return expanded > 1 + VIRGL_DRAW_VBO_SIZE_INDIRECT ? expanded : 1 + VIRGL_DRAW_VBO_SIZE_INDIRECT;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMDrawIndirectCommand* cmd = (const VMDrawIndirectCommand*)header;
+        uint32_t mode = encoder->m_topology;
+
+        if (!cmd->draw_count)
+            return out;
+        if (Indexed && !encoder->m_index_handle) {
+            encoder->m_error = kIOReturnNotReady;
+            return nullptr;
+        }
+
+        if (encoder->m_multi_draw_indirect) {
+            uint32_t handle = encoder->resourceHandle(cmd->buffer_id);
+            if (!handle) {
+                encoder->m_error = kIOReturnNotFound;
+                return nullptr;
+            }
+            if (cmd->offset > 0xFFFFFFFF) {
+                encoder->m_error = kIOReturnBadArgument;
+                return nullptr;
+            }
+
+            uint32_t* draw = out;
+            out = VMVirGLEmitDraw(out, mode, 0, 0, Indexed, 0, 0, 0);
+            draw[0] = VIRGL_CMD0(VIRGL_CCMD_DRAW_VBO, 0, VIRGL_DRAW_VBO_SIZE_INDIRECT);
+            out[0] = 0;                                 // vertices_per_patch
+            out[1] = 0;                                 // drawid
+            out[2] = handle;
+            out[3] = (uint32_t)cmd->offset;
+            out[4] = cmd->stride;
+            out[5] = cmd->draw_count;
+            out[6] = 0;                                 // indirect_draw_count_offset
+            out[7] = 0;                                 // indirect_draw_count handle
+            return out + 8;
+        }
+
+        uint32_t args_size = Indexed ? sizeof(VMDrawIndexedIndirectArgs) : sizeof(VMDrawIndirectArgs);
+        const uint8_t* args = encoder->readIndirect(cmd->buffer_id, cmd->offset,
+                                                    (uint64_t)(cmd->draw_count - 1) * cmd->stride + args_size);
+        if (!args)
+            return nullptr;
+
+        // Empty draws cost the host a DRAW_VBO for nothing, leave them out
+        for (uint32_t i = 0; i < cmd->draw_count; i++, args += cmd->stride) {
+            if (Indexed) {
+                VMDrawIndexedIndirectArgs draw;
+                memcpy(&draw, args, sizeof(draw));
+                if (draw.index_count && draw.instance_count)
+                    out = VMVirGLEmitDraw(out, mode, draw.first_index, draw.index_count, true,
+                                          draw.instance_count, draw.vertex_offset, draw.first_instance);
+            } else {
+                VMDrawIndirectArgs draw;
+                memcpy(&draw, args, sizeof(draw));
+                if (draw.vertex_count && draw.instance_count)
+                    out = VMVirGLEmitDraw(out, mode, draw.first_vertex, draw.vertex_count, false,
+                                          draw.instance_count, 0, draw.first_instance);
+            }
+        }
+        return out;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_DRAW_INDIRECT> : VMVirGLEncodeIndirect<false> {};
+template <> struct VMVirGLEncode<VM_CMD_DRAW_INDEXED_INDIRECT> : VMVirGLEncodeIndirect<true> {};
+
+template <> struct VMVirGLEncode<VM_CMD_MULTI_DRAW> {
+    static const uint32_t kFlags = VM_VIRGL_FLUSH_VERTEX;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        const VMMultiDrawCommand* cmd = (const VMMultiDrawCommand*)header;
+
+        if (!VMVirGLRecordHolds(header, sizeof(VMMultiDrawCommand) - sizeof(VMCommandHeader)) ||
+            !VMVirGLRecordHolds(header, sizeof(VMMultiDrawCommand) - sizeof(VMCommandHeader) +
+                                        (size_t)cmd->draw_count * sizeof(VMDrawCommandDescriptor)))
+            return VM_VIRGL_INVALID;
+        return cmd->draw_count * (1 + VIRGL_DRAW_VBO_SIZE);
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMMultiDrawCommand* cmd = (const VMMultiDrawCommand*)header;
+
+        // VirGL has no multi-draw, unpack into consecutive DRAW_VBOs
+        for (uint32_t i = 0; i < cmd->draw_count; i++) {
+            const VMDrawCommandDescriptor* draw = &cmd->draws[i];
+            out = VMVirGLEmitDraw(out, encoder->m_topology,
+                                  draw->first_vertex, draw->vertex_count, false,
+                                  draw->instance_count, 0, draw->first_instance);
+        }
+        return out;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_DISPATCH> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        if (!VMVirGLRecordHolds(header, sizeof(VMDispatchCommand) - sizeof(VMCommandHeader)))
+            return VM_VIRGL_INVALID;
+        return 1 + VIRGL_LAUNCH_GRID_SIZE;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMDispatchCommand* cmd = (const VMDispatchCommand*)header;
+
+        // The block size is left to the compute shader the client bound
+        // What the shader writes is not in the stream
+        encoder->noteHostWrite(0);
+        out[0] = VIRGL_CMD0(VIRGL_CCMD_LAUNCH_GRID, 0, VIRGL_LAUNCH_GRID_SIZE);
+        out[1] = 0;
+        out[2] = 0;
+        out[3] = 0;
+        out[4] = cmd->group_count_x;
+        out[5] = cmd->group_count_y;
+        out[6] = cmd->group_count_z;
+        out[7] = 0;                                     // indirect_handle
+        out[8] = 0;                                     // indirect_offset
+        return out + 1 + VIRGL_LAUNCH_GRID_SIZE;
+    }
+};
+
+// Buffers are PIPE_BUFFER resources, x and width are byte ranges
+template <> struct VMVirGLEncode<VM_CMD_COPY_BUFFER> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        if (!VMVirGLRecordHolds(header, sizeof(VMCopyBufferCommand) - sizeof(VMCommandHeader)))
+            return VM_VIRGL_INVALID;
+        return 1 + VIRGL_COPY_REGION_SIZE;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMCopyBufferCommand* cmd = (const VMCopyBufferCommand*)header;
+
+        if (cmd->src_offset > 0xFFFFFFFF || cmd->dst_offset > 0xFFFFFFFF || cmd->size > 0xFFFFFFFF) {
+            encoder->m_error = kIOReturnBadArgument;
+            return nullptr;
+        }
+        uint32_t src = encoder->resourceHandle(cmd->src_buffer_id);
+        uint32_t dst = encoder->resourceHandle(cmd->dst_buffer_id);
+        if (!src || !dst) {
+            encoder->m_error = kIOReturnNotFound;
+            return nullptr;
+        }
+
+        encoder->noteHostWrite(cmd->dst_buffer_id);
+        out[0] = VIRGL_CMD0(VIRGL_CCMD_RESOURCE_COPY_REGION, 0, VIRGL_COPY_REGION_SIZE);
+        out[1] = dst;
+        out[2] = 0;                                     // dst_level
+        out[3] = (uint32_t)cmd->dst_offset;
+        out[4] = 0;
+        out[5] = 0;
+        out[6] = src;
+        out[7] = 0;                                     // src_level
+        out[8] = (uint32_t)cmd->src_offset;
+        out[9] = 0;
+        out[10] = 0;
+        out[11] = (uint32_t)cmd->size;
+        out[12] = 1;
+        out[13] = 1;
+        return out + 1 + VIRGL_COPY_REGION_SIZE;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_UPDATE_BUFFER> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        const VMUpdateBufferCommand* cmd = (const VMUpdateBufferCommand*)header;
+
+        if (!VMVirGLRecordHolds(header, sizeof(VMUpdateBufferCommand) - sizeof(VMCommandHeader)) ||
+            cmd->data_size > VM_UPDATE_BUFFER_MAX || (cmd->data_size & 3) ||
+            !VMVirGLRecordHolds(header, sizeof(VMUpdateBufferCommand) - sizeof(VMCommandHeader) +
+                                        cmd->data_size))
+            return VM_VIRGL_INVALID;
+        return 1 + VIRGL_INLINE_WRITE_HDR_SIZE + (cmd->data_size >> 2);
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMUpdateBufferCommand* cmd = (const VMUpdateBufferCommand*)header;
+
+        if (cmd->offset > 0xFFFFFFFF) {
+            encoder->m_error = kIOReturnBadArgument;
+            return nullptr;
+        }
+        uint32_t handle = encoder->resourceHandle(cmd->buffer_id);
+        if (!handle) {
+            encoder->m_error = kIOReturnNotFound;
+            return nullptr;
+        }
+
+        encoder->noteHostWrite(cmd->buffer_id);
+        out[0] = VIRGL_CMD0(VIRGL_CCMD_RESOURCE_INLINE_WRITE, 0,
+                            VIRGL_INLINE_WRITE_HDR_SIZE + (cmd->data_size >> 2));
+        out[1] = handle;
+        out[2] = 0;                                     // level
+        out[3] = 0;                                     // usage
+        out[4] = 0;                                     // stride
+        out[5] = 0;                                     // layer_stride
+        out[6] = (uint32_t)cmd->offset;
+        out[7] = 0;
+        out[8] = 0;
+        out[9] = cmd->data_size;
+        out[10] = 1;
+        out[11] = 1;
+        memcpy(out + 1 + VIRGL_INLINE_WRITE_HDR_SIZE, cmd->data, cmd->data_size);
+        return out + 1 + VIRGL_INLINE_WRITE_HDR_SIZE + (cmd->data_size >> 2);
+    }
+};
+
+// VirGL has one barrier, every VMCommandBuffer barrier maps to all of it
+struct VMVirGLEncodeBarrier {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        return 2;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        out[0] = VIRGL_CMD0(VIRGL_CCMD_MEMORY_BARRIER, 0, 1);
+        out[1] = PIPE_BARRIER_ALL;
+        return out + 2;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_PIPELINE_BARRIER> : VMVirGLEncodeBarrier {};
+template <> struct VMVirGLEncode<VM_CMD_MEMORY_BARRIER> : VMVirGLEncodeBarrier {};
+template <> struct VMVirGLEncode<VM_CMD_EXECUTION_BARRIER> : VMVirGLEncodeBarrier {};
+
+template <> struct VMVirGLEncode<VM_CMD_BEGIN_DEBUG_LABEL> : VMVirGLEncodeNop {};
+template <> struct VMVirGLEncode<VM_CMD_END_DEBUG_LABEL> : VMVirGLEncodeNop {};
+template <> struct VMVirGLEncode<VM_CMD_INSERT_DEBUG_LABEL> : VMVirGLEncodeNop {};
+
+template <> struct VMVirGLEncode<VM_CMD_SET_VIEWPORT> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        const VMSetViewportCommand* cmd = (const VMSetViewportCommand*)header;
+
+        if (!VMVirGLRecordHolds(header, sizeof(VMSetViewportCommand) - sizeof(VMCommandHeader)) ||
+            !VMVirGLRecordHolds(header, sizeof(VMSetViewportCommand) - sizeof(VMCommandHeader) +
+                                        (size_t)cmd->viewport_count * sizeof(VMViewport)))
+            return VM_VIRGL_INVALID;
+        return 2 + 6 * cmd->viewport_count;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMSetViewportCommand* cmd = (const VMSetViewportCommand*)header;
+        uint32_t bits[6];
+
+        if (cmd->first_viewport >= VIRGL_MAX_VIEWPORTS ||
+            cmd->viewport_count > VIRGL_MAX_VIEWPORTS - cmd->first_viewport) {
+            encoder->m_error = kIOReturnBadArgument;
+            return nullptr;
+        }
+
+        out[0] = VIRGL_CMD0(VIRGL_CCMD_SET_VIEWPORT_STATE, 0, 1 + 6 * cmd->viewport_count);
+        out[1] = cmd->first_viewport;
+        out += 2;
+        for (uint32_t i = 0; i < cmd->viewport_count; i++) {
+            // x, y, width, height, min_depth, max_depth
+            memcpy(bits, &cmd->viewports[i], sizeof(bits));
+            int64_t x = VMFloatBitsToFixed(bits[0]);
+            int64_t y = VMFloatBitsToFixed(bits[1]);
+            int64_t half_width = VMFloatBitsToFixed(bits[2]) / 2;
+            int64_t half_height = VMFloatBitsToFixed(bits[3]) / 2;
+            int64_t min_depth = VMFloatBitsToFixed(bits[4]);
+            int64_t max_depth = VMFloatBitsToFixed(bits[5]);
+
+            // Gallium wants scale[3] then translate[3]
+            out[0] = VMFixedToFloatBits(half_width);
+            out[1] = VMFixedToFloatBits(half_height);
+            out[2] = VMFixedToFloatBits((max_depth - min_depth) / 2);
+            out[3] = VMFixedToFloatBits(x + half_width);
+            out[4] = VMFixedToFloatBits(y + half_height);
+            out[5] = VMFixedToFloatBits((max_depth + min_depth) / 2);
+            out += 6;
+        }
+        return out;
+    }
+};
+
+template <> struct VMVirGLEncode<VM_CMD_SET_SCISSOR> {
+    static const uint32_t kFlags = 0;
+
+    static uint32_t dwords(const VMCommandHeader* header)
+    {
+        const VMSetScissorCommand* cmd = (const VMSetScissorCommand*)header;
+
+        if (!VMVirGLRecordHolds(header, sizeof(VMSetScissorCommand) - sizeof(VMCommandHeader)) ||
+            !VMVirGLRecordHolds(header, sizeof(VMSetScissorCommand) - sizeof(VMCommandHeader) +
+                                        (size_t)cmd->scissor_count * sizeof(VMRect2D)))
+            return VM_VIRGL_INVALID;
+        return 2 + 2 * cmd->scissor_count;
+    }
+
+    static uint32_t* emit(VMVirGLEncoder* encoder, const VMCommandHeader* header, uint32_t* out)
+    {
+        const VMSetScissorCommand* cmd = (const VMSetScissorCommand*)header;
+
+        if (cmd->first_scissor >= VIRGL_MAX_VIEWPORTS ||
+            cmd->scissor_count > VIRGL_MAX_VIEWPORTS - cmd->first_scissor) {
+            encoder->m_error = kIOReturnBadArgument;
+            return nullptr;
+        }
+
+        out[0] = VIRGL_CMD0(VIRGL_CCMD_SET_SCISSOR_STATE, 0, 1 + 2 * cmd->scissor_count);
+        out[1] = cmd->first_scissor;
+        out += 2;
+        for (uint32_t i = 0; i < cmd->scissor_count; i++) {
+            const VMRect2D* rect = &cmd->scissors[i];
+            int64_t min_x = rect->x < 0 ? 0 : rect->x;
+            int64_t min_y = rect->y < 0 ? 0 : rect->y;
+            int64_t max_x = (int64_t)rect->x + rect->width;
+            int64_t max_y = (int64_t)rect->y + rect->height;
+
+            // 16-bit corners, min inclusive and max exclusive
+            min_x = min_x > 0xFFFF ? 0xFFFF : min_x;
+            min_y = min_y > 0xFFFF ? 0xFFFF : min_y;
+            max_x = max_x < 0 ? 0 : (max_x > 0xFFFF ? 0xFFFF : max_x);
+            max_y = max_y < 0 ? 0 : (max_y > 0xFFFF ? 0xFFFF : max_y);
+            out[0] = (uint32_t)min_x | ((uint32_t)min_y << 16);
+            out[1] = (uint32_t)max_x | ((uint32_t)max_y << 16);
+            out += 2;
+        }
+        return out;
+    }
+};
+
+// Dispatch tables, one per VMGPUCommandType group (type >> 12) indexed by
+// the low bits. Empty entries are commands with no VirGL equivalent yet,
+// a stream holding one is refused rather than drawn without it.
+
+#define VM_VIRGL_ENTRY(type)    { VMVirGLEncode<type>::kFlags, &VMVirGLEncode<type>::dwords, &VMVirGLEncode<type>::emit }
+#define VM_VIRGL_NONE           { 0, nullptr, nullptr }
+
+static const VMVirGLEncoderEntry s_render_encoders[] = {
+    VM_VIRGL_NONE,                                      // VM_CMD_BEGIN_RENDER_PASS
+    VM_VIRGL_NONE,                                      // VM_CMD_END_RENDER_PASS
+    VM_VIRGL_ENTRY(VM_CMD_BIND_PIPELINE),
+    VM_VIRGL_NONE,                                      // VM_CMD_BIND_DESCRIPTOR_SETS
+    VM_VIRGL_ENTRY(VM_CMD_BIND_VERTEX_BUFFERS),
+    VM_VIRGL_ENTRY(VM_CMD_BIND_INDEX_BUFFER),
+    VM_VIRGL_ENTRY(VM_CMD_DRAW),
+    VM_VIRGL_ENTRY(VM_CMD_DRAW_INDEXED),
+    VM_VIRGL_ENTRY(VM_CMD_DRAW_INDIRECT),
+    VM_VIRGL_ENTRY(VM_CMD_DRAW_INDEXED_INDIRECT),
+    VM_VIRGL_ENTRY(VM_CMD_MULTI_DRAW),
+};
+
+static const VMVirGLEncoderEntry s_compute_encoders[] = {
+    VM_VIRGL_ENTRY(VM_CMD_BIND_COMPUTE_PIPELINE),
+    VM_VIRGL_ENTRY(VM_CMD_DISPATCH),
+};
+
+static const VMVirGLEncoderEntry s_transfer_encoders[] = {
+    VM_VIRGL_ENTRY(VM_CMD_COPY_BUFFER),
+    VM_VIRGL_NONE,                                      // VM_CMD_COPY_IMAGE
+    VM_VIRGL_NONE,                                      // VM_CMD_COPY_BUFFER_TO_IMAGE
+    VM_VIRGL_NONE,                                      // VM_CMD_COPY_IMAGE_TO_BUFFER
+    VM_VIRGL_ENTRY(VM_CMD_UPDATE_BUFFER),
+};
+
+static const VMVirGLEncoderEntry s_sync_encoders[] = {
+    VM_VIRGL_ENTRY(VM_CMD_PIPELINE_BARRIER),
+    VM_VIRGL_ENTRY(VM_CMD_MEMORY_BARRIER),
+    VM_VIRGL_ENTRY(VM_CMD_EXECUTION_BARRIER),
+};
+
+static const VMVirGLEncoderEntry s_debug_encoders[] = {
+    VM_VIRGL_ENTRY(VM_CMD_BEGIN_DEBUG_LABEL),
+    VM_VIRGL_ENTRY(VM_CMD_END_DEBUG_LABEL),
+    VM_VIRGL_ENTRY(VM_CMD_INSERT_DEBUG_LABEL),
+};
+
+static const VMVirGLEncoderEntry s_state_encoders[] = {
+    VM_VIRGL_ENTRY(VM_CMD_SET_VIEWPORT),
+    VM_VIRGL_ENTRY(VM_CMD_SET_SCISSOR),
+};
+
+struct VMVirGLEncoderGroup {
+    const VMVirGLEncoderEntry* entries;
+    uint32_t count;
+};
+
+#define VM_VIRGL_GROUP(table)   { table, sizeof(table) / sizeof(table[0]) }
+
+static const VMVirGLEncoderGroup s_encoder_groups[] = {
+    { nullptr, 0 },
+    VM_VIRGL_GROUP(s_render_encoders),                  // 0x1000
+    VM_VIRGL_GROUP(s_compute_encoders),                 // 0x2000
+    VM_VIRGL_GROUP(s_transfer_encoders),                // 0x3000
+    VM_VIRGL_GROUP(s_sync_encoders),                    // 0x4000
+    VM_VIRGL_GROUP(s_debug_encoders),                   // 0x5000
+    VM_VIRGL_GROUP(s_state_encoders),                   // 0x6000
+    { nullptr, 0 },                                     // 0x7000 queries
+};
+
+static inline const VMVirGLEncoderEntry* VMVirGLLookup(uint32_t type)
+{
+    uint32_t group = type >> 12;
+    uint32_t index = type & 0xFFF;
+
+    if (group >= sizeof(s_encoder_groups) / sizeof(s_encoder_groups[0]) ||
+        index >= s_encoder_groups[group].count)
+        return nullptr;
+    const VMVirGLEncoderEntry* entry = &s_encoder_groups[group].entries[index];
+    return entry->emit ? entry : nullptr;
+}
+
+OSDefineMetaClassAndStructors(VMVirGLEncoder, OSObject);
+
+VMVirGLEncoder* CLASS::withAccelerator(VMQemuVGAAccelerator* accelerator)
+{
+    VMVirGLEncoder* encoder = new VMVirGLEncoder;
+    if (encoder && !encoder->init(accelerator)) {
+        encoder->release();
+        return nullptr;
+    }
+    return encoder;
+}
+
+bool CLASS::init(VMQemuVGAAccelerator* accelerator)
+{
+    if (!super::init())
+        return false;
+
+    m_accelerator = accelerator;
+    m_indirect_scratch = nullptr;
+    m_indirect_scratch_size = 0;
+    m_submission = IOBufferMemoryDescriptor::withCapacity(VM_VIRGL_INITIAL_CAPACITY, kIODirectionOut);
+    if (!m_submission)
+        return false;
+    m_base = (uint32_t*)m_submission->getBytesNoCopy();
+    m_capacity = (uint32_t)(m_submission->getCapacity() >> 2);
+
+    begin();
+    return true;
+}
+
+void CLASS::free()
+{
+    if (m_submission) {
+        m_submission->release();
+        m_submission = nullptr;
+    }
+    if (m_indirect_scratch) {
+        IOFree(m_indirect_scratch, m_indirect_scratch_size);
+        m_indirect_scratch = nullptr;
+    }
+
+    super::free();
+}
+
+void CLASS::begin()
+{
+    m_length = VM_VIRGL_SUBMIT_HEADER_SIZE >> 2;
+    bzero(m_base, VM_VIRGL_SUBMIT_HEADER_SIZE);
+    m_submission->setLength(VM_VIRGL_SUBMIT_HEADER_SIZE);
+    m_error = kIOReturnSuccess;
+
+    // The host keeps state across submissions but nothing says it is ours
+    m_vertex_count = 0;
+    m_vertex_dirty = false;
+    m_index_handle = 0;
+    m_index_size = 0;
+    m_index_offset = 0;
+    m_topology = PIPE_PRIM_TRIANGLES;
+    m_cached_surface = 0;
+    m_cached_handle = 0;
+    m_multi_draw_indirect = m_accelerator &&
+        (m_accelerator->getVirGLCapabilities() & VIRGL_CAP_MULTI_DRAW_INDIRECT);
+    m_guest_reads = false;
+    m_written_count = 0;
+    m_written_unknown = false;
+}
+
+IOReturn CLASS::reserve(uint32_t dwords)
+{
+    if (m_length + dwords <= m_capacity)
+        return kIOReturnSuccess;
+
+    // The submission must stay contiguous, grow by doubling
+    uint32_t capacity = m_capacity * 2;
+    while (capacity < m_length + dwords)
+        capacity *= 2;
+    if (capacity > (VM_COMMAND_MAX_SIZE >> 2))
+        return kIOReturnNoSpace;
+
+    IOBufferMemoryDescriptor* submission = IOBufferMemoryDescriptor::withCapacity(capacity << 2, kIODirectionOut);
+    if (!submission)
+        return kIOReturnNoMemory;
+    memcpy(submission->getBytesNoCopy(), m_base, m_length << 2);
+    m_submission->release();
+    m_submission = submission;
+    m_base = (uint32_t*)submission->getBytesNoCopy();
+    m_capacity = capacity;
+    return kIOReturnSuccess;
+}
+
+uint32_t CLASS::resourceHandle(uint32_t surface_id)
+{
+    uint32_t handle = 0;
+
+    // Consecutive bindings of one buffer are the common case
+    if (surface_id && surface_id == m_cached_surface)
+        return m_cached_handle;
+    if (!m_accelerator ||
+        m_accelerator->getVirGLResourceHandle(surface_id, &handle) != kIOReturnSuccess)
+        return 0;
+    m_cached_surface = surface_id;
+    m_cached_handle = handle;
+    return handle;
+}
+
+void CLASS::noteHostWrite(uint32_t surface_id)
+{
+    if (m_written_unknown)
+        return;
+    for (uint32_t i = 0; i < m_written_count; i++) {
+        if (m_written_buffers[i] == surface_id)
+            return;
+    }
+    if (!surface_id || m_written_count == VM_VIRGL_WRITTEN_BUFFERS)
+        m_written_unknown = true;
+    else
+        m_written_buffers[m_written_count++] = surface_id;
+}
+
+const uint8_t* CLASS::readIndirect(uint32_t surface_id, uint64_t offset, uint64_t length)
+{
+    if (length > VM_COMMAND_MAX_SIZE) {
+        m_error = kIOReturnBadArgument;
+        return nullptr;
+    }
+    // Records the host writes before this draw never reach the guest copy,
+    // expanding them from it would draw with stale arguments. Writes by this
+    // stream are checked here, earlier submissions by readSurfaceData().
+    bool written = m_written_unknown;
+    for (uint32_t i = 0; i < m_written_count && !written; i++)
+        written = (m_written_buffers[i] == surface_id);
+    if (written) {
+        m_error = kIOReturnUnsupported;
+        return nullptr;
+    }
+    if (length > m_indirect_scratch_size) {
+        uint32_t size = (uint32_t)round_page(length);
+        uint8_t* scratch = (uint8_t*)IOMalloc(size);
+        if (!scratch) {
+            m_error = kIOReturnNoMemory;
+            return nullptr;
+        }
+        if (m_indirect_scratch)
+            IOFree(m_indirect_scratch, m_indirect_scratch_size);
+        m_indirect_scratch = scratch;
+        m_indirect_scratch_size = size;
+    }
+    if (!m_accelerator) {
+        m_error = kIOReturnNotReady;
+        return nullptr;
+    }
+    m_guest_reads = true;
+    m_error = m_accelerator->readSurfaceData(surface_id, offset, m_indirect_scratch, (size_t)length);
+    return m_error == kIOReturnSuccess ? m_indirect_scratch : nullptr;
+}
+
+IOReturn CLASS::flushVertexBuffers()
+{
+    IOReturn ret = reserve(1 + 3 * m_vertex_count);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    // SET_VERTEX_BUFFERS always starts at slot 0
+    uint32_t* out = m_base + m_length;
+    out[0] = VIRGL_CMD0(VIRGL_CCMD_SET_VERTEX_BUFFERS, 0, 3 * m_vertex_count);
+    out++;
+    for (uint32_t i = 0; i < m_vertex_count; i++) {
+        out[0] = m_vertex_strides[i];
+        out[1] = m_vertex_offsets[i];
+        out[2] = m_vertex_handles[i];
+        out += 3;
+    }
+    m_length = (uint32_t)(out - m_base);
+    m_vertex_dirty = false;
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::encode(const void* records, size_t length)
+{
+    const uint8_t* cursor = (const uint8_t*)records;
+    const uint8_t* end = cursor + length;
+    IOReturn ret = kIOReturnSuccess;
+
+    while (cursor < end) {
+        const VMCommandHeader* header = (const VMCommandHeader*)cursor;
+        if ((size_t)(end - cursor) < sizeof(VMCommandHeader) ||
+            (size_t)(end - cursor) < VMCommandRecordSize(header->size)) {
+            ret = kIOReturnBadArgument;
+            break;
+        }
+        cursor += VMCommandRecordSize(header->size);
+
+        const VMVirGLEncoderEntry* entry = VMVirGLLookup(header->type);
+        if (!entry) {
+            ret = kIOReturnUnsupported;
+            break;
+        }
+
+        if ((entry->flags & VM_VIRGL_FLUSH_VERTEX) && m_vertex_dirty) {
+            ret = flushVertexBuffers();
+            if (ret != kIOReturnSuccess)
+                break;
+        }
+
+        uint32_t dwords = entry->dwords(header);
+        if (dwords == VM_VIRGL_INVALID) {
+            ret = kIOReturnBadArgument;
+            break;
+        }
+        if (dwords) {
+            ret = reserve(dwords);
+            if (ret != kIOReturnSuccess)
+                break;
+        }
+
+        uint32_t* out = entry->emit(this, header, m_base + m_length);
+        if (!out) {
+            ret = m_error;
+            break;
+        }
+        m_length = (uint32_t)(out - m_base);
+    }
+
+    m_submission->setLength(m_length << 2);
+    return ret;
+}
+
+uint64_t CLASS::benchmarkEncoding(VMQemuVGAAccelerator* accelerator,
+                                  uint32_t draws_per_frame, uint32_t frames)
+{
+    VMCommandBuffer* buffer;
+    VMVirGLEncoder* encoder;
+    uint64_t start, elapsed, nsec;
+    uint64_t draws = 0;
+
+    buffer = VMCommandBuffer::withAccelerator(accelerator, 0);
+    encoder = VMVirGLEncoder::withAccelerator(accelerator);
+    if (!buffer || !encoder) {
+        if (buffer)
+            buffer->release();
+        if (encoder)
+            encoder->release();
+        return 0;
+    }
+
+    buffer->begin();
+    for (uint32_t i = 0; i < draws_per_frame; i++)
+        buffer->draw(3, 1, i * 7, 0);
+    buffer->end();
+
+    start = mach_absolute_time();
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        encoder->begin();
+        for (uint32_t i = 0; i < buffer->getChunkCount(); i++) {
+            IOBufferMemoryDescriptor* chunk = buffer->getChunk(i);
+            if (chunk && encoder->encode(chunk->getBytesNoCopy(), chunk->getLength()) != kIOReturnSuccess)
+                break;
+        }
+        draws += draws_per_frame;
+    }
+    elapsed = mach_absolute_time() - start;
+    absolutetime_to_nanoseconds(elapsed, &nsec);
+
+    IOLog("VMVirGLEncoder: encoded %llu draws in %llu us, %u bytes per frame\n",
+          draws, nsec / 1000, encoder->getCommandLength());
+    encoder->release();
+    buffer->release();
+
+    return nsec ? (draws * 1000000000ULL) / nsec : 0;
+}
@@ -0,0 +1,145 @@
+#ifndef __VMVirGLEncoder_H__
+#define __VMVirGLEncoder_H__
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include "VMCommandBuffer.h"
+
+// Forward declarations
+class VMQemuVGAAccelerator;
+
+// VirGL command stream (virgl_protocol.h), every command is a header dword
+// followed by 'len' payload dwords
+#define VIRGL_CMD0(cmd, obj, len)         ((cmd) | ((obj) << 8) | ((len) << 16))
+
+enum VMVirGLCommand {
+    VIRGL_CCMD_NOP = 0,
+    VIRGL_CCMD_CREATE_OBJECT = 1,
+    VIRGL_CCMD_BIND_OBJECT = 2,
+    VIRGL_CCMD_DESTROY_OBJECT = 3,
+    VIRGL_CCMD_SET_VIEWPORT_STATE = 4,
+    VIRGL_CCMD_SET_FRAMEBUFFER_STATE = 5,
+    VIRGL_CCMD_SET_VERTEX_BUFFERS = 6,
+    VIRGL_CCMD_CLEAR = 7,
+    VIRGL_CCMD_DRAW_VBO = 8,
+    VIRGL_CCMD_RESOURCE_INLINE_WRITE = 9,
+    VIRGL_CCMD_SET_INDEX_BUFFER = 11,
+    VIRGL_CCMD_SET_SCISSOR_STATE = 15,
+    VIRGL_CCMD_RESOURCE_COPY_REGION = 17,
+    VIRGL_CCMD_MEMORY_BARRIER = 36,
+    VIRGL_CCMD_LAUNCH_GRID = 37
+};
+
+#define PIPE_PRIM_POINTS                  0
+#define PIPE_PRIM_LINES                   1
+#define PIPE_PRIM_LINE_STRIP              3
+#define PIPE_PRIM_TRIANGLES               4
+#define PIPE_PRIM_TRIANGLE_STRIP          5
+#define PIPE_PRIM_TRIANGLE_FAN            6
+#define PIPE_BARRIER_ALL                  ((1 << 14) - 1)
+
+#define VIRGL_DRAW_VBO_SIZE               12
+#define VIRGL_DRAW_VBO_SIZE_INDIRECT      20
+#define VIRGL_LAUNCH_GRID_SIZE            8
+#define VIRGL_COPY_REGION_SIZE            13
+#define VIRGL_INLINE_WRITE_HDR_SIZE       11
+#define VIRGL_SET_INDEX_BUFFER_SIZE       3
+#define VIRGL_MAX_VIEWPORTS               16
+#define VIRGL_MAX_VERTEX_BUFFERS          32
+
+// Buffers written on the host tracked per submission, more count as unknown
+#define VM_VIRGL_WRITTEN_BUFFERS          16
+
+// Encoder output starts with room for virtio_gpu_cmd_submit
+#define VM_VIRGL_SUBMIT_HEADER_SIZE       32
+#define VM_VIRGL_INITIAL_CAPACITY         (64 * 1024)
+
+// Per-type encoders, specialized in VMVirGLEncoder.cpp
+template <int Type> struct VMVirGLEncode;
+template <bool Indexed> struct VMVirGLEncodeIndirect;
+
+// Turns VMCommandBuffer records into a VIRGL_CCMD stream laid out as a
+// ready VIRTIO_GPU_CMD_SUBMIT_3D request. Dispatch is a table indexed by
+// command type; each entry reports the dwords it needs so the emitters
+// write without bounds checks. Host state already bound in this
+// submission is tracked so redundant binds are not sent.
+class VMVirGLEncoder : public OSObject
+{
+    OSDeclareDefaultStructors(VMVirGLEncoder);
+
+    template <int Type> friend struct VMVirGLEncode;
+    template <bool Indexed> friend struct VMVirGLEncodeIndirect;
+
+private:
+    VMQemuVGAAccelerator* m_accelerator;
+    IOBufferMemoryDescriptor* m_submission;
+    uint32_t* m_base;
+    uint32_t m_capacity;                                // dwords
+    uint32_t m_length;                                  // dwords, header included
+
+    // Vertex buffers are sent as one array right before the next draw
+    uint32_t m_vertex_handles[VIRGL_MAX_VERTEX_BUFFERS];
+    uint32_t m_vertex_offsets[VIRGL_MAX_VERTEX_BUFFERS];
+    uint32_t m_vertex_strides[VIRGL_MAX_VERTEX_BUFFERS];
+    uint32_t m_vertex_count;
+    bool m_vertex_dirty;
+
+    // Index buffer bound by this submission, handle 0 until there is one
+    uint32_t m_index_handle;
+    uint32_t m_index_size;
+    uint32_t m_index_offset;
+
+    // PIPE_PRIM_* of the graphics pipeline bound last, triangles until a bind
+    uint32_t m_topology;
+
+    // Surface id -> host resource handle, last lookup
+    uint32_t m_cached_surface;
+    uint32_t m_cached_handle;
+
+    // Host draws indirect itself, otherwise argument records are read into
+    // the scratch buffer and expanded
+    bool m_multi_draw_indirect;
+    bool m_guest_reads;                                 // Output depends on buffer contents
+    uint8_t* m_indirect_scratch;
+    uint32_t m_indirect_scratch_size;
+
+    // Buffers the stream so far writes on the host, their guest copies are stale
+    uint32_t m_written_buffers[VM_VIRGL_WRITTEN_BUFFERS];
+    uint32_t m_written_count;
+    bool m_written_unknown;                             // Compute, or past the table
+
+    IOReturn m_error;
+
+    IOReturn reserve(uint32_t dwords);
+    IOReturn flushVertexBuffers();
+    uint32_t resourceHandle(uint32_t surface_id);
+    const uint8_t* readIndirect(uint32_t surface_id, uint64_t offset, uint64_t length);
+    void noteHostWrite(uint32_t surface_id);            // 0 for writes to unknown buffers
+
+public:
+    static VMVirGLEncoder* withAccelerator(VMQemuVGAAccelerator* accelerator);
+
+    virtual bool init(VMQemuVGAAccelerator* accelerator);
+    virtual void free() override;
+
+    // begin() empties the stream and forgets bound state, encode() appends
+    // records and may be called once per chunk. Records with no VirGL
+    // encoding fail with kIOReturnUnsupported.
+    void begin();
+    IOReturn encode(const void* records, size_t length);
+
+    IOBufferMemoryDescriptor* getSubmission() const { return m_submission; }
+    uint32_t getCommandLength() const { return (m_length << 2) - VM_VIRGL_SUBMIT_HEADER_SIZE; }
+    // False once guest buffer contents were baked into the stream
+    bool isReusable() const { return !m_guest_reads; }
+    // Buffers the stream writes on the host, for VMQemuVGAAccelerator::markHostWritten()
+    const uint32_t* getWrittenBuffers() const { return m_written_buffers; }
+    uint32_t getWrittenCount() const { return m_written_count; }
+    bool writesUnknownBuffers() const { return m_written_unknown; }
+
+    // Draws encoded per second for 'draws_per_frame' recorded draws
+    static uint64_t benchmarkEncoding(VMQemuVGAAccelerator* accelerator,
+                                      uint32_t draws_per_frame, uint32_t frames);
+};
+
+#endif /* __VMVirGLEncoder_H__ */
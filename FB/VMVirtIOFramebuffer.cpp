@@ -23,6 +23,16 @@ bool VMVirtIOFramebuffer::init(OSDictionary* properties)
     m_mode_count = 0;
     m_current_mode = 0;
     
+    bzero(m_cursor_cache, sizeof(m_cursor_cache));
+    m_cursor_use_clock = 0;
+    m_cursor_scratch = nullptr;
+    m_cursor_resource = 0;
+    m_cursor_hot_x = 0;
+    m_cursor_hot_y = 0;
+    m_cursor_x = 0;
+    m_cursor_y = 0;
+    m_cursor_visible = false;
+    
     initDisplayModes();
     
     IOLog("VMVirtIOFramebuffer::init() completed\n");
@@ -36,6 +46,11 @@ void VMVirtIOFramebuffer::free()
         m_vram_range = nullptr;
     }
     
+    if (m_cursor_scratch) {
+        IOFree(m_cursor_scratch, VIRTIO_GPU_CURSOR_DIM * VIRTIO_GPU_CURSOR_DIM * sizeof(uint32_t));
+        m_cursor_scratch = nullptr;
+    }
+    
     super::free();
 }
 
@@ -116,6 +131,9 @@ bool VMVirtIOFramebuffer::start(IOService* provider)
         // Don't fail - we can work without direct PCI access
     }
     
+    // Conversion buffer for hardware cursor shapes; without it IOFramebuffer keeps the software cursor
+    m_cursor_scratch = (uint32_t*)IOMalloc(VIRTIO_GPU_CURSOR_DIM * VIRTIO_GPU_CURSOR_DIM * sizeof(uint32_t));
+    
     // PRIMARY MODE: We are the sole display driver
     IOLog("VMVirtIOFramebuffer::start() - PRIMARY MODE: Sole display driver for VirtIO GPU\n");
     
@@ -151,6 +169,8 @@ void VMVirtIOFramebuffer::stop(IOService* provider)
 {
     IOLog("VMVirtIOFramebuffer::stop() - Stopping framebuffer\n");
     
+    releaseCursorResources();
+    
     if (m_vram_range) {
         m_vram_range->release();
         m_vram_range = nullptr;
@@ -851,3 +871,180 @@ IOReturn VMVirtIOFramebuffer::newUserClient(task_t owningTask, void* security_id
     
     return result;
 }
+
+// Hardware cursor support
+//
+// IOFramebuffer falls back to StdFBDisplayCursor/StdFBRemoveCursor blits, which
+// save/restore pixels and damage the framebuffer on every mouse move. Here each
+// shape is converted once to a 64x64 ARGB host cursor resource and cached by
+// content hash; motion is a MOVE_CURSOR on the cursor queue with no damage.
+
+IOReturn VMVirtIOFramebuffer::getAttribute(IOSelect attribute, uintptr_t* value)
+{
+    if (attribute == kIOHardwareCursorAttribute) {
+        if (value) {
+            *value = (m_gpu_driver && m_cursor_scratch) ? kIOFBHWCursorSupported : 0;
+        }
+        return kIOReturnSuccess;
+    }
+    
+    return super::getAttribute(attribute, value);
+}
+
+uint32_t VMVirtIOFramebuffer::cacheCursorShape(uint64_t hash, uint16_t hot_x, uint16_t hot_y)
+{
+    cursor_cache_entry* victim = nullptr;
+    uint32_t resource_id = 0;
+    
+    ++m_cursor_use_clock;
+    for (int i = 0; i < kCursorCacheEntries; i++) {
+        cursor_cache_entry* entry = &m_cursor_cache[i];
+        if (entry->resource_id && entry->hash == hash &&
+            entry->hot_x == hot_x && entry->hot_y == hot_y) {
+            entry->last_use = m_cursor_use_clock;
+            return entry->resource_id;
+        }
+    }
+    
+    // Prefer an empty slot, otherwise the least recently used shape not bound on the host
+    for (int i = 0; i < kCursorCacheEntries; i++) {
+        cursor_cache_entry* entry = &m_cursor_cache[i];
+        if (!entry->resource_id) {
+            victim = entry;
+            break;
+        }
+        if (entry->resource_id == m_cursor_resource) {
+            continue;
+        }
+        if (!victim || entry->last_use < victim->last_use) {
+            victim = entry;
+        }
+    }
+    
+    // New shape: upload once
+    if (m_gpu_driver->createCursorResource(&resource_id, m_cursor_scratch) != kIOReturnSuccess) {
+        return 0;
+    }
+    if (victim->resource_id) {
+        m_gpu_driver->deallocateResource(victim->resource_id);
+    }
+    victim->hash = hash;
+    victim->resource_id = resource_id;
+    victim->last_use = m_cursor_use_clock;
+    victim->hot_x = hot_x;
+    victim->hot_y = hot_y;
+    return resource_id;
+}
+
+void VMVirtIOFramebuffer::releaseCursorResources()
+{
+    if (!m_gpu_driver) {
+        return;
+    }
+    
+    if (m_cursor_visible) {
+        m_gpu_driver->updateCursor(0, 0, 0, 0, 0, 0);
+        m_cursor_visible = false;
+    }
+    for (int i = 0; i < kCursorCacheEntries; i++) {
+        if (m_cursor_cache[i].resource_id) {
+            m_gpu_driver->deallocateResource(m_cursor_cache[i].resource_id);
+        }
+    }
+    bzero(m_cursor_cache, sizeof(m_cursor_cache));
+    m_cursor_resource = 0;
+}
+
+IOReturn VMVirtIOFramebuffer::setCursorImage(void* cursorImage)
+{
+    const uint32_t dim = VIRTIO_GPU_CURSOR_DIM;
+    IOHardwareCursorDescriptor desc;
+    IOHardwareCursorInfo info;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint32_t resource_id;
+    
+    if (!m_gpu_driver || !m_cursor_scratch) {
+        return kIOReturnUnsupported;
+    }
+    
+    bzero(&desc, sizeof(desc));
+    desc.majorVersion = kHardwareCursorDescriptorMajorVersion;
+    desc.minorVersion = kHardwareCursorDescriptorMinorVersion;
+    desc.width = dim;
+    desc.height = dim;
+    desc.bitDepth = 32;
+    
+    bzero(&info, sizeof(info));
+    info.majorVersion = kHardwareCursorInfoMajorVersion;
+    info.minorVersion = kHardwareCursorInfoMinorVersion;
+    info.hardwareCursorData = (UInt8*)m_cursor_scratch;
+    
+    // Also fails while IOFramebuffer is only probing our descriptor
+    if (!convertCursorImage(cursorImage, &desc, &info)) {
+        return kIOReturnUnsupported;
+    }
+    
+    // convertCursorImage may shrink the image; re-pitch rows to 64 from the bottom up
+    uint32_t width = info.cursorWidth;
+    uint32_t height = info.cursorHeight;
+    if (width < dim) {
+        for (uint32_t row = height; row-- > 0;) {
+            memmove(&m_cursor_scratch[row * dim], &m_cursor_scratch[row * width], width * sizeof(uint32_t));
+            bzero(&m_cursor_scratch[row * dim + width], (dim - width) * sizeof(uint32_t));
+        }
+    }
+    if (height < dim) {
+        bzero(&m_cursor_scratch[height * dim], (dim - height) * dim * sizeof(uint32_t));
+    }
+    
+    const uint8_t* bytes = (const uint8_t*)m_cursor_scratch;
+    for (uint32_t i = 0; i < dim * dim * sizeof(uint32_t); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    
+    resource_id = cacheCursorShape(hash, info.cursorHotSpotX, info.cursorHotSpotY);
+    if (!resource_id) {
+        return kIOReturnNoResources;
+    }
+    
+    m_cursor_resource = resource_id;
+    m_cursor_hot_x = info.cursorHotSpotX;
+    m_cursor_hot_y = info.cursorHotSpotY;
+    
+    if (m_cursor_visible) {
+        m_gpu_driver->updateCursor(m_cursor_resource, m_cursor_hot_x, m_cursor_hot_y, 0,
+                                   (uint32_t)(m_cursor_x + m_cursor_hot_x),
+                                   (uint32_t)(m_cursor_y + m_cursor_hot_y));
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn VMVirtIOFramebuffer::setCursorState(SInt32 x, SInt32 y, bool visible)
+{
+    IOReturn ret = kIOReturnSuccess;
+    
+    if (!m_gpu_driver) {
+        return kIOReturnUnsupported;
+    }
+    
+    m_cursor_x = x;
+    m_cursor_y = y;
+    
+    // Host cursor position is the hot spot, IOFramebuffer hands us the image origin
+    uint32_t pos_x = (uint32_t)(x + m_cursor_hot_x);
+    uint32_t pos_y = (uint32_t)(y + m_cursor_hot_y);
+    
+    if (!visible || !m_cursor_resource) {
+        if (m_cursor_visible) {
+            ret = m_gpu_driver->updateCursor(0, 0, 0, 0, pos_x, pos_y);
+        }
+        m_cursor_visible = false;
+    } else if (!m_cursor_visible) {
+        ret = m_gpu_driver->updateCursor(m_cursor_resource, m_cursor_hot_x, m_cursor_hot_y, 0, pos_x, pos_y);
+        m_cursor_visible = (ret == kIOReturnSuccess);
+    } else {
+        ret = m_gpu_driver->moveCursor(0, pos_x, pos_y);
+    }
+    
+    return ret;
+}
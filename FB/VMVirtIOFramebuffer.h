@@ -34,7 +34,29 @@ private:
     IOItemCount            m_mode_count;
     IODisplayModeID        m_current_mode;
     
+    // Hardware cursor: shapes become host cursor resources, cached by content hash
+    struct cursor_cache_entry {
+        uint64_t           hash;               // FNV-1a of image + hot spot
+        uint32_t           resource_id;        // 0 = empty slot
+        uint32_t           last_use;
+        uint16_t           hot_x;
+        uint16_t           hot_y;
+    };
+    enum { kCursorCacheEntries = 8 };
+    
+    cursor_cache_entry     m_cursor_cache[kCursorCacheEntries];
+    uint32_t               m_cursor_use_clock;
+    uint32_t*              m_cursor_scratch;    // 64x64 ARGB conversion buffer
+    uint32_t               m_cursor_resource;   // shape bound on the host, 0 = none
+    uint16_t               m_cursor_hot_x;
+    uint16_t               m_cursor_hot_y;
+    SInt32                 m_cursor_x;          // image top-left as given by IOFramebuffer
+    SInt32                 m_cursor_y;
+    bool                   m_cursor_visible;
+    
     void initDisplayModes();
+    uint32_t cacheCursorShape(uint64_t hash, uint16_t hot_x, uint16_t hot_y);
+    void releaseCursorResources();
     
 public:
     // IOService overrides
@@ -72,6 +94,11 @@ public:
     virtual IOReturn setAttributeForConnection(IOIndex connectIndex, IOSelect attribute, uintptr_t value) override;
     virtual IOReturn connectFlags(IOIndex connectIndex, IODisplayModeID displayMode, IOOptionBits* flags) override;
     
+    // Hardware cursor via VIRTIO_GPU_CMD_UPDATE_CURSOR / MOVE_CURSOR
+    virtual IOReturn getAttribute(IOSelect attribute, uintptr_t* value) override;
+    virtual IOReturn setCursorImage(void* cursorImage) override;
+    virtual IOReturn setCursorState(SInt32 x, SInt32 y, bool visible) override;
+    
     // Power management
     virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice) override;
     
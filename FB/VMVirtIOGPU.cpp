@@ -28,6 +28,7 @@ bool CLASS::init(OSDictionary* properties)
     m_contexts = OSArray::withCapacity(16);
     m_next_resource_id = 1;
     m_next_context_id = 1;
+    m_virgl_caps = 0;
     m_display_resource_id = 0;  // No display resource initially
     
     m_resource_lock = IOLockAlloc();
@@ -1021,7 +1022,8 @@ IOReturn CLASS::submitCommand(virtio_gpu_ctrl_hdr* cmd, size_t cmd_size,
         if (notify_addr) {
             *notify_addr = 0; // Control queue notification
             
-            // Wait for response
+            // Wait for response, read back from the request buffer since there
+            // is no used ring yet; this bounds the wait, it does not see the host
             if (resp && resp_size > 0) {
                 for (int i = 0; i < 100; i++) { // 100ms timeout
                     IOSleep(1);
@@ -2126,28 +2128,31 @@ IOReturn CLASS::executeCommands(uint32_t context_id, IOMemoryDescriptor* command
     if (!supports3D() || !commands)
         return kIOReturnBadArgument;
     
-    IOLockLock(m_context_lock);
-    
-    gpu_3d_context* context = findContext(context_id);
-    if (!context) {
-        IOLockUnlock(m_context_lock);
-        return kIOReturnNotFound;
-    }
-    
     // Get the actual command data using proper IOMemoryDescriptor mapping
     IOMemoryMap* command_map = commands->map();
-    if (!command_map) {
-        IOLockUnlock(m_context_lock);
+    if (!command_map)
         return kIOReturnVMError;
-    }
     
-    void* command_data = (void*)command_map->getVirtualAddress();
-    size_t command_size = commands->getLength();
+    IOReturn ret = executeCommandBytes(context_id, (const void*)command_map->getVirtualAddress(),
+                                       commands->getLength());
+    command_map->release();
     
-    if (!command_data || command_size == 0) {
-        command_map->release();
-        IOLockUnlock(m_context_lock);
+    return ret;
+}
+
+// 'command_data' is copied into the request before it is queued, so it may
+// live in memory the client can still write to.
+IOReturn CLASS::executeCommandBytes(uint32_t context_id, const void* command_data, size_t command_size)
+{
+    if (!supports3D() || !command_data || command_size == 0 || command_size > 0xFFFFFFFFU)
         return kIOReturnBadArgument;
+    
+    IOLockLock(m_context_lock);
+    
+    gpu_3d_context* context = findContext(context_id);
+    if (!context) {
+        IOLockUnlock(m_context_lock);
+        return kIOReturnNotFound;
     }
     
     // Create proper VirtIO GPU 3D submit command with actual command data
@@ -2155,12 +2160,12 @@ IOReturn CLASS::executeCommands(uint32_t context_id, IOMemoryDescriptor* command
     virtio_gpu_cmd_submit* cmd = (virtio_gpu_cmd_submit*)IOMalloc(total_size);
     
     if (!cmd) {
-        command_map->release();
         IOLockUnlock(m_context_lock);
         return kIOReturnNoMemory;
     }
     
     // Setup command header
+    bzero(cmd, sizeof(*cmd));
     cmd->hdr.type = VIRTIO_GPU_CMD_SUBMIT_3D;
     cmd->hdr.ctx_id = context_id;
     cmd->size = static_cast<uint32_t>(command_size);
@@ -2174,12 +2179,39 @@ IOReturn CLASS::executeCommands(uint32_t context_id, IOMemoryDescriptor* command
     
     // Cleanup
     IOFree(cmd, total_size);
-    command_map->release();
     IOLockUnlock(m_context_lock);
     
     return ret;
 }
 
+// 'submission' starts with room for virtio_gpu_cmd_submit and the command
+// stream right behind it, the header is filled in place so nothing is copied.
+IOReturn CLASS::executeEncodedCommands(uint32_t context_id, IOBufferMemoryDescriptor* submission)
+{
+    if (!supports3D() || !submission || submission->getLength() <= sizeof(virtio_gpu_cmd_submit))
+        return kIOReturnBadArgument;
+    
+    IOLockLock(m_context_lock);
+    
+    if (!findContext(context_id)) {
+        IOLockUnlock(m_context_lock);
+        return kIOReturnNotFound;
+    }
+    
+    size_t total_size = submission->getLength();
+    virtio_gpu_cmd_submit* cmd = (virtio_gpu_cmd_submit*)submission->getBytesNoCopy();
+    bzero(cmd, sizeof(*cmd));
+    cmd->hdr.type = VIRTIO_GPU_CMD_SUBMIT_3D;
+    cmd->hdr.ctx_id = context_id;
+    cmd->size = static_cast<uint32_t>(total_size - sizeof(virtio_gpu_cmd_submit));
+    
+    struct virtio_gpu_ctrl_hdr resp = {};
+    IOReturn ret = submitCommand(&cmd->hdr, total_size, &resp, sizeof(resp));
+    
+    IOLockUnlock(m_context_lock);
+    return ret;
+}
+
 IOReturn CLASS::setupScanout(uint32_t scanout_id, uint32_t width, uint32_t height)
 {
     if (scanout_id >= m_max_scanouts)
@@ -2454,6 +2486,65 @@ IOReturn CLASS::moveCursor(uint32_t scanout_id, uint32_t x, uint32_t y)
     return ret;
 }
 
+IOReturn CLASS::createCursorResource(uint32_t* resource_id, const void* argb_image)
+{
+    const uint32_t image_size = VIRTIO_GPU_CURSOR_DIM * VIRTIO_GPU_CURSOR_DIM * 4;
+    
+    if (!resource_id || !argb_image)
+        return kIOReturnBadArgument;
+    if (!m_cursor_queue)
+        return kIOReturnNotReady;
+    
+    uint32_t new_id = ++m_next_resource_id;
+    IOReturn ret = createResource2D(new_id, VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM,
+                                    VIRTIO_GPU_CURSOR_DIM, VIRTIO_GPU_CURSOR_DIM);
+    if (ret != kIOReturnSuccess)
+        return ret;
+    
+    // Fill the guest backing, then pull it into the host resource once
+    IOLockLock(m_resource_lock);
+    gpu_resource* resource = findResource(new_id);
+    if (!resource || !resource->backing_memory ||
+        resource->backing_memory->writeBytes(0, argb_image, image_size) != image_size) {
+        IOLockUnlock(m_resource_lock);
+        deallocateResource(new_id);
+        return kIOReturnNoMemory;
+    }
+    IOLockUnlock(m_resource_lock);
+    
+    ret = transferToHost2D(new_id, 0, 0, 0, VIRTIO_GPU_CURSOR_DIM, VIRTIO_GPU_CURSOR_DIM);
+    if (ret != kIOReturnSuccess) {
+        deallocateResource(new_id);
+        return ret;
+    }
+    
+    *resource_id = new_id;
+    return kIOReturnSuccess;
+}
+
+IOReturn CLASS::transferToHost2D(uint32_t resource_id, uint64_t offset,
+                                 uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    struct virtio_gpu_transfer_to_host_2d cmd = {};
+    cmd.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
+    cmd.hdr.flags = 0;
+    cmd.hdr.fence_id = 0;
+    cmd.hdr.ctx_id = 0;
+    cmd.resource_id = resource_id;
+    cmd.r.x = x;
+    cmd.r.y = y;
+    cmd.r.width = width;
+    cmd.r.height = height;
+    cmd.offset = offset;
+    
+    struct virtio_gpu_ctrl_hdr resp = {};
+    IOReturn ret = submitCommand(&cmd.hdr, sizeof(cmd), &resp, sizeof(resp));
+    if (ret != kIOReturnSuccess) {
+        IOLog("VMVirtIOGPU::transferToHost2D: resource %u transfer failed: 0x%x\n", resource_id, ret);
+    }
+    return ret;
+}
+
 void CLASS::setPreferredRefreshRate(uint32_t hz) {
     IOLog("VMVirtIOGPU::setPreferredRefreshRate: hz=%u (stub)\n", hz);
 }
@@ -2599,9 +2690,15 @@ void CLASS::enableVirgl() {
                               capset_id, capset_info_resp.capset_max_size);
                         
                         // For Virgil capability sets (typically capset_id == 1), parse OpenGL capabilities
-                        if (capset_info_resp.capset_id == 1) { // Virgil capset is usually ID 1
+                        if (capset_info_resp.capset_id == VIRTIO_GPU_CAPSET_VIRGL) {
                             // Store Virgil capabilities for 3D context creation
                             IOLog("VMVirtIOGPU::enableVirgl: Virgl capability data acquired for 3D acceleration\n");
+                        } else if (capset_info_resp.capset_id == VIRTIO_GPU_CAPSET_VIRGL2 &&
+                                   capset_info_resp.capset_max_size >= VIRGL_CAPS_V2_CAPABILITY_BITS + sizeof(uint32_t)) {
+                            // Feature bits the command encoder picks its encodings by
+                            memcpy(&m_virgl_caps, capset_resp_buffer + sizeof(virtio_gpu_ctrl_hdr) +
+                                   VIRGL_CAPS_V2_CAPABILITY_BITS, sizeof(m_virgl_caps));
+                            IOLog("VMVirtIOGPU::enableVirgl: VirGL capability bits 0x%08x\n", m_virgl_caps);
                         }
                     } else {
                         IOLog("VMVirtIOGPU::enableVirgl: Failed to get capset %u data: 0x%x\n", capset_id, capset_ret);
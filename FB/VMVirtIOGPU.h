@@ -13,6 +13,9 @@
 #define VIRTIO_GPU_QUEUE_CONTROL    0
 #define VIRTIO_GPU_QUEUE_CURSOR     1
 
+// Cursor resources are fixed at 64x64 B8G8R8A8 by the VirtIO GPU spec
+#define VIRTIO_GPU_CURSOR_DIM       64
+
 // VirtIO GPU feature flags are defined in virtio_gpu.h
 // No need to redefine them here
 
@@ -32,6 +35,7 @@ private:
     // VirtIO GPU configuration
     uint32_t m_max_scanouts;
     uint32_t m_num_capsets;
+    uint32_t m_virgl_caps;          // VIRGL_CAP_* from the VIRGL2 capset, 0 until queried
     
     // Command queue management
     IOBufferMemoryDescriptor* m_control_queue;
@@ -125,6 +129,8 @@ public:
     IOReturn createRenderContext(uint32_t* context_id);
     IOReturn destroyRenderContext(uint32_t context_id);
     IOReturn executeCommands(uint32_t context_id, IOMemoryDescriptor* commands);
+    IOReturn executeCommandBytes(uint32_t context_id, const void* command_data, size_t command_size);
+    IOReturn executeEncodedCommands(uint32_t context_id, IOBufferMemoryDescriptor* submission);
     
     // Display interface for framebuffer
     IOReturn setupScanout(uint32_t scanout_id, uint32_t width, uint32_t height);
@@ -135,6 +141,7 @@ public:
     IOReturn updateCursor(uint32_t resource_id, uint32_t hot_x, uint32_t hot_y,
                          uint32_t scanout_id, uint32_t x, uint32_t y);
     IOReturn moveCursor(uint32_t scanout_id, uint32_t x, uint32_t y);
+    IOReturn createCursorResource(uint32_t* resource_id, const void* argb_image);
     
     // Capability queries
     uint32_t getMaxScanouts() const { return m_max_scanouts; }
@@ -153,6 +160,7 @@ public:
     uint32_t getMaxResolutionX() const { return 4096; } // Default max resolution
     uint32_t getMaxResolutionY() const { return 4096; }
     bool supportsVirgl() const { return supports3D(); } // Virgl support requires 3D acceleration
+    uint32_t getVirGLCapabilities() const { return m_virgl_caps; }
     bool supportsResourceBlob() const { return supports3D(); } // Resource blob requires 3D support
     
     // Mock device configuration for compatibility mode
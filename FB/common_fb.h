@@ -57,6 +57,43 @@ extern "C" {
 		unsigned height;
 	};
 	
+	/*
+	 * Incremental screen capture through VMQemuVGAClient (shadow framebuffer only).
+	 * Each client owns two snapshot buffers, mapped with clientMemoryForType 0 and 1.
+	 * A capture brings the idle buffer up to date by copying only the tiles changed
+	 * since that buffer was last filled, then hands it out; it stays stable until
+	 * the client's next capture. After a mode change of a different size a capture
+	 * fails with kIOReturnNoSpace, both buffers were replaced and must be mapped again.
+	 */
+#define CAPTURE_METHOD_INDEX	1U		//VMQemuVGAClient selector
+#define CAPTURE_MAX_RECTS		255U
+#define CAPTURE_FLAG_FULL_FRAME	1U		//damage did not fit in rects[], assume everything changed
+	
+	struct CaptureRect
+	{
+		unsigned short x;
+		unsigned short y;
+		unsigned short width;
+		unsigned short height;
+	};
+	
+	struct CaptureRequestData
+	{
+		unsigned sequence;				//from the previous CaptureResultData, 0 for the first capture
+	};
+	
+	struct CaptureResultData
+	{
+		unsigned sequence;				//pass back in the next request
+		unsigned buffer;				//memory type of the snapshot holding this frame
+		unsigned width;
+		unsigned height;
+		unsigned rowBytes;				//32bpp scanline pitch in the snapshot
+		unsigned flags;
+		unsigned rectCount;
+		CaptureRect rects[CAPTURE_MAX_RECTS];	//pixels changed since the request sequence
+	};
+	
 	extern DisplayModeEntry const modeList[NUM_DISPLAY_MODES] __attribute__((visibility("hidden")));
 		
 	extern int logLevelFB;
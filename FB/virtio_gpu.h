@@ -276,6 +276,14 @@ struct virtio_gpu_resp_capset {
     uint8_t capset_data[];
 };
 
+/* Capability set ids */
+#define VIRTIO_GPU_CAPSET_VIRGL            1
+#define VIRTIO_GPU_CAPSET_VIRGL2           2
+
+/* virgl_caps_v2 (virgl_hw.h), only the fields the driver reads */
+#define VIRGL_CAPS_V2_CAPABILITY_BITS      392     /* Byte offset of capability_bits */
+#define VIRGL_CAP_MULTI_DRAW_INDIRECT      (1 << 21)
+
 /* Cursor structures */
 struct virtio_gpu_cursor_pos {
     uint32_t scanout_id;
@@ -378,3 +378,417 @@ void IOFramebuffer::StdFBRemoveCursor32(
         vramPtr += vramRow;
     }
 }
+
+/*
+ * Wide variants of the 16 and 32 bpp cursor blits.
+ *
+ * Kernel code may not touch the vector unit without saving user state, so
+ * these work on 64 bit words: four 555 pixels or two Axxx pixels at a time.
+ * Runs that are fully transparent or fully opaque (the bulk of any cursor)
+ * are handled a whole word at a time; words with partial alpha fall back to
+ * the per pixel blends below, which are the scalar formulas verbatim, so the
+ * output is bit-identical to the narrow routines.
+ */
+
+#if 1
+#define quad34to35WithGamma(x)                          \
+        (  (((x) & 0xf000f000f000f000ULL) >> 1)         \
+         | (((x) & 0x0f000f000f000f00ULL) >> 2)         \
+         | (((x) & 0x00f000f000f000f0ULL) >> 3)         \
+         | (((x) & 0x8000800080008000ULL) >> 5)         \
+         | (((x) & 0x0800080008000800ULL) >> 6)         \
+         | (((x) & 0x0080008000800080ULL) >> 7) )
+#else
+#define quad34to35WithGamma(x)                                                  \
+        (  ((unsigned long long) short34to35WithGamma((x) & 0xFFFF))            \
+         | ((unsigned long long) short34to35WithGamma(((x) >> 16) & 0xFFFF) << 16) \
+         | ((unsigned long long) short34to35WithGamma(((x) >> 32) & 0xFFFF) << 32) \
+         | ((unsigned long long) short34to35WithGamma((x) >> 48) << 48) )
+#endif
+
+#define QUAD_AMASK      0x000F000F000F000FULL
+#define PAIR_AMASK      0xFF000000FF000000ULL
+
+static inline unsigned long long StdFBLoad64( const volatile void * p )
+{
+    unsigned long long v;
+    __builtin_memcpy(&v, (const void *) p, sizeof(v));
+    return (v);
+}
+
+static inline void StdFBStore64( volatile void * p, unsigned long long v )
+{
+    __builtin_memcpy((void *) p, &v, sizeof(v));
+}
+
+static inline unsigned short StdFBBlend555(
+                unsigned short s,
+                unsigned short d,
+                unsigned char *_bm34To35SampleTable,
+                unsigned char *_bm35To34SampleTable )
+{
+    unsigned short f;
+
+    (void) _bm34To35SampleTable;
+    (void) _bm35To34SampleTable;
+
+    if (s == 0)
+        return (d);
+    if ((f = (~s) & (unsigned int)AMASK) == 0)
+        return (short34to35WithGamma(s));
+    if (f == AMASK)
+        return (d ^ short34to35WithGamma(s));
+    d = short35to34WithGamma(d);
+    d = s + (((((d & RBMASK)>>4)*f + GAMASK) & RBMASK)
+        | ((((d & GAMASK)*f+GAMASK)>>4) & GAMASK));
+    return (short34to35WithGamma(d));
+}
+
+static inline unsigned int StdFBBlend32Axxx( unsigned int s, unsigned int d )
+{
+    unsigned int f;
+
+    f = s >> 24;
+    if (f) {
+        if (f == 0xFF)
+            return (s);
+        s <<= 8;  d <<= 8;
+        f ^= 0xFF;
+        d = s+(((((d&0xFF00FF00)>>8)*f+0x00FF00FF)&0xFF00FF00)
+            | ((((d & 0x00FF00FF)*f+0x00FF00FF)>>8) & 0x00FF00FF));
+        return ((d>>8) | 0xFF000000);
+    }
+    return (d ^ s);
+}
+
+void IOFramebuffer::StdFBDisplayCursor555Wide(
+                IOFramebuffer * inst,
+                StdFBShmem_t *shmem,
+                volatile unsigned short *vramPtr,
+                unsigned int cursStart,
+                unsigned int vramRow,
+                unsigned int cursRow,
+                int width,
+                int height )
+{
+    int i, j;
+    volatile unsigned short *cursPtr;
+    volatile unsigned short *savePtr;
+    unsigned long long s4, d4;
+    unsigned char *_bm34To35SampleTable;
+    unsigned char *_bm35To34SampleTable;
+
+    savePtr = (volatile unsigned short *) inst->cursorSave;
+    cursPtr = (volatile unsigned short *) inst->__private->cursorImages[ shmem->frame ];
+    cursPtr += cursStart;
+
+    _bm34To35SampleTable = inst->colorConvert.t._bm34To35SampleTable;
+    _bm35To34SampleTable = inst->colorConvert.t._bm35To34SampleTable;
+
+    for (i = height; --i >= 0; ) {
+        j = width;
+        /* Align vram to 8 bytes */
+        for (; j && (7 & (uintptr_t) vramPtr); j--, vramPtr++) {
+            unsigned short d = *savePtr++ = *vramPtr;
+            *vramPtr = StdFBBlend555(*cursPtr++, d,
+                                     _bm34To35SampleTable, _bm35To34SampleTable);
+        }
+        for (; j >= 4; j -= 4, vramPtr += 4, savePtr += 4, cursPtr += 4) {
+            d4 = *(volatile unsigned long long *) vramPtr;
+            StdFBStore64(savePtr, d4);
+            s4 = StdFBLoad64(cursPtr);
+            if (!s4)
+            {   /* Transparent black area.  Leave dst as is. */
+                continue;
+            }
+            if ((s4 & QUAD_AMASK) == QUAD_AMASK)
+            {   /* Opaque cursor pixels.  Mark them. */
+                *(volatile unsigned long long *) vramPtr = quad34to35WithGamma(s4);
+                continue;
+            }
+            d4 =  (unsigned long long) StdFBBlend555(s4, d4,
+                                     _bm34To35SampleTable, _bm35To34SampleTable)
+               | ((unsigned long long) StdFBBlend555(s4 >> 16, d4 >> 16,
+                                     _bm34To35SampleTable, _bm35To34SampleTable) << 16)
+               | ((unsigned long long) StdFBBlend555(s4 >> 32, d4 >> 32,
+                                     _bm34To35SampleTable, _bm35To34SampleTable) << 32)
+               | ((unsigned long long) StdFBBlend555(s4 >> 48, d4 >> 48,
+                                     _bm34To35SampleTable, _bm35To34SampleTable) << 48);
+            *(volatile unsigned long long *) vramPtr = d4;
+        }
+        for (; j; j--, vramPtr++) {
+            unsigned short d = *savePtr++ = *vramPtr;
+            *vramPtr = StdFBBlend555(*cursPtr++, d,
+                                     _bm34To35SampleTable, _bm35To34SampleTable);
+        }
+        cursPtr += cursRow; /* starting point of next cursor line */
+        vramPtr += vramRow; /* starting point of next screen line */
+    }
+}
+
+void IOFramebuffer::StdFBDisplayCursor32AxxxWide(
+                                 IOFramebuffer * inst,
+                                 StdFBShmem_t *shmem,
+                                 volatile unsigned int *vramPtr,
+                                 unsigned int cursStart,
+                                 unsigned int vramRow,
+                                 unsigned int cursRow,
+                                 int width,
+                                 int height )
+{
+    int i, j;
+    volatile unsigned int *savePtr;     /* saved screen data pointer */
+    volatile unsigned int *cursPtr;
+    unsigned long long s2, d2;
+
+    savePtr = (volatile unsigned int *) inst->cursorSave;
+    cursPtr = (volatile unsigned int *) inst->__private->cursorImages[ shmem->frame ];
+    cursPtr += cursStart;
+
+    /* Pixel format is Axxx */
+    for (i = height; --i >= 0; ) {
+        j = width;
+        if (j && (7 & (uintptr_t) vramPtr)) {
+            unsigned int d = *savePtr++ = *vramPtr;
+            *vramPtr++ = StdFBBlend32Axxx(*cursPtr++, d);
+            j--;
+        }
+        for (; j >= 2; j -= 2, vramPtr += 2, savePtr += 2, cursPtr += 2) {
+            d2 = *(volatile unsigned long long *) vramPtr;
+            StdFBStore64(savePtr, d2);
+            s2 = StdFBLoad64(cursPtr);
+            if (!s2)                    // Transparent cursor pixels
+                continue;
+            if ((s2 & PAIR_AMASK) == PAIR_AMASK)
+            {                           // Opaque pixels
+                *(volatile unsigned long long *) vramPtr = s2;
+                continue;
+            }
+            d2 =  (unsigned long long) StdFBBlend32Axxx(s2, d2)
+               | ((unsigned long long) StdFBBlend32Axxx(s2 >> 32, d2 >> 32) << 32);
+            *(volatile unsigned long long *) vramPtr = d2;
+        }
+        if (j) {
+            unsigned int d = *savePtr++ = *vramPtr;
+            *vramPtr++ = StdFBBlend32Axxx(*cursPtr++, d);
+        }
+        cursPtr += cursRow; /* starting point of next cursor line */
+        vramPtr += vramRow; /* starting point of next screen line */
+    }
+}
+
+void IOFramebuffer::StdFBRemoveCursor16Wide(
+                                IOFramebuffer * inst,
+                                StdFBShmem_t *shmem,
+                                volatile unsigned short *vramPtr,
+                                unsigned int vramRow,
+                                int width,
+                                int height )
+{
+    int i, j;
+    volatile unsigned short *savePtr;
+
+    savePtr = (volatile unsigned short *) inst->cursorSave;
+
+    for (i = height; --i >= 0; ) {
+        j = width;
+        for (; j && (7 & (uintptr_t) vramPtr); j--)
+            *vramPtr++ = *savePtr++;
+        for (; j >= 4; j -= 4, vramPtr += 4, savePtr += 4)
+            *(volatile unsigned long long *) vramPtr = StdFBLoad64(savePtr);
+        for (; j; j--)
+            *vramPtr++ = *savePtr++;
+        vramPtr += vramRow;
+    }
+}
+
+void IOFramebuffer::StdFBRemoveCursor32Wide(
+                                IOFramebuffer * inst,
+                                StdFBShmem_t *shmem,
+                                volatile unsigned int *vramPtr,
+                                unsigned int vramRow,
+                                int width,
+                                int height )
+{
+    int i, j;
+    volatile unsigned int *savePtr;
+
+    savePtr = (volatile unsigned int *) inst->cursorSave;
+
+    for (i = height; --i >= 0; ) {
+        j = width;
+        if (j && (7 & (uintptr_t) vramPtr)) {
+            *vramPtr++ = *savePtr++;
+            j--;
+        }
+        for (; j >= 2; j -= 2, vramPtr += 2, savePtr += 2)
+            *(volatile unsigned long long *) vramPtr = StdFBLoad64(savePtr);
+        if (j)
+            *vramPtr++ = *savePtr++;
+        vramPtr += vramRow;
+    }
+}
+
+/*
+ * Boot-arg iogcursorbench=<iterations> runs this once, from the first
+ * setupCursor() that has a shared cursor. The scalar and wide routines draw
+ * and remove the same synthetic cursor over the same screen contents, at an
+ * aligned and a misaligned VRAM address, and must leave identical pixels
+ * and identical saved backgrounds. The time each takes for 'iterations'
+ * draw/remove pairs is logged.
+ */
+
+#define kCursorBenchWidth       61      /* odd, so every edge path runs */
+#define kCursorBenchHeight      37
+#define kCursorBenchPitch       64      /* pixels per VRAM and cursor row */
+
+static unsigned int StdFBBenchRandom( unsigned int * seed )
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8);
+}
+
+void IOFramebuffer::checkCursorBlits( uint32_t iterations )
+{
+    StdFBShmem_t *          shmem = GetShmem(this);
+    volatile unsigned char * oldSave;
+    volatile unsigned char * oldImage;
+    const IOByteCount       bytes = kCursorBenchPitch * kCursorBenchHeight * 4 + 8;
+    unsigned char *         buf[6] = { 0 };
+    unsigned int            seed = 0x1F2E3D4C;
+    unsigned int            vramRow = kCursorBenchPitch - kCursorBenchWidth;
+    bool                    ok = true;
+
+    if (!shmem || !OSSpinLockTry(&shmem->cursorSema))
+    {
+        IOLog("IOFramebuffer: cursor busy, cursor blit check skipped\n");
+        return;
+    }
+
+    // cursor, initial screen, scalar screen/save, wide screen/save
+    for (int i = 0; i < 6; i++)
+    {
+        buf[i] = (unsigned char *) IOMalloc(bytes);
+        if (!buf[i])
+            ok = false;
+    }
+    oldSave  = cursorSave;
+    oldImage = __private->cursorImages[shmem->frame];
+
+    for (int depth = 16; ok && (depth <= 32); depth += 16)
+    {
+        AbsoluteTime start, end;
+        uint64_t     nsec[2];
+
+        // Cursor pixels in runs of transparent, opaque, xor and blended
+        for (unsigned int i = 0; i < (bytes - 8) / 4; )
+        {
+            unsigned int kind = StdFBBenchRandom(&seed) & 3;
+            unsigned int run  = 1 + (StdFBBenchRandom(&seed) & 7);
+            for (; run-- && (i < (bytes - 8) / 4); i++)
+            {
+                unsigned int r = StdFBBenchRandom(&seed);
+                if (16 == depth)
+                {
+                    unsigned short * p = (unsigned short *) buf[0];
+                    unsigned short   a = (0 == kind) ? 0 : (1 == kind) ? 0xF : (2 == kind) ? 0 : (1 + (r % 14));
+                    p[2 * i]     = (0 == kind) ? 0 : ((r & 0xFFF0) | a | ((2 == kind) ? 0x10 : 0));
+                    p[2 * i + 1] = (0 == kind) ? 0 : (((r >> 4) & 0xFFF0) | a | ((2 == kind) ? 0x10 : 0));
+                }
+                else
+                {
+                    unsigned int a = (0 == kind) ? 0 : (1 == kind) ? 0xFF : (2 == kind) ? 0 : (1 + (r % 254));
+                    ((unsigned int *) buf[0])[i] = (0 == kind) ? 0 : ((a << 24) | (r & 0xFFFFFF) | ((2 == kind) ? 1 : 0));
+                }
+            }
+        }
+        for (unsigned int i = 0; i < bytes / 4; i++)
+            ((unsigned int *) buf[1])[i] = StdFBBenchRandom(&seed) ^ (StdFBBenchRandom(&seed) << 16);
+
+        __private->cursorImages[shmem->frame] = buf[0];
+        for (unsigned int misalign = 0; ok && (misalign < 2); misalign++)
+        {
+            unsigned int offset = misalign * (depth / 8);
+
+            for (int wide = 0; wide < 2; wide++)
+            {
+                unsigned char * screen = buf[2 + 2 * wide];
+                bcopy(buf[1], screen, bytes);
+                cursorSave = buf[3 + 2 * wide];
+                if (16 == depth)
+                    (wide ? StdFBDisplayCursor555Wide : StdFBDisplayCursor555)(this, shmem,
+                        (volatile unsigned short *) (screen + offset), 0, vramRow, vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+                else
+                    (wide ? StdFBDisplayCursor32AxxxWide : StdFBDisplayCursor32Axxx)(this, shmem,
+                        (volatile unsigned int *) (screen + offset), 0, vramRow, vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+            }
+            ok = !bcmp(buf[2], buf[4], bytes)
+              && !bcmp(buf[3], buf[5], kCursorBenchWidth * kCursorBenchHeight * (depth / 8));
+
+            for (int wide = 0; ok && (wide < 2); wide++)
+            {
+                unsigned char * screen = buf[2 + 2 * wide];
+                cursorSave = buf[3 + 2 * wide];
+                if (16 == depth)
+                    (wide ? StdFBRemoveCursor16Wide : StdFBRemoveCursor16)(this, shmem,
+                        (volatile unsigned short *) (screen + offset), vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+                else
+                    (wide ? StdFBRemoveCursor32Wide : StdFBRemoveCursor32)(this, shmem,
+                        (volatile unsigned int *) (screen + offset), vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+            }
+            ok = ok && !bcmp(buf[2], buf[1], bytes) && !bcmp(buf[4], buf[1], bytes);
+        }
+        if (!ok)
+        {
+            IOLog("IOFramebuffer: %d bpp wide cursor blits differ from scalar\n", depth);
+            break;
+        }
+
+        for (int wide = 0; wide < 2; wide++)
+        {
+            unsigned char * screen = buf[2 + 2 * wide];
+            cursorSave = buf[3 + 2 * wide];
+            AbsoluteTime_to_scalar(&start) = mach_absolute_time();
+            for (uint32_t n = 0; n < iterations; n++)
+            {
+                if (16 == depth)
+                {
+                    (wide ? StdFBDisplayCursor555Wide : StdFBDisplayCursor555)(this, shmem,
+                        (volatile unsigned short *) screen, 0, vramRow, vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+                    (wide ? StdFBRemoveCursor16Wide : StdFBRemoveCursor16)(this, shmem,
+                        (volatile unsigned short *) screen, vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+                }
+                else
+                {
+                    (wide ? StdFBDisplayCursor32AxxxWide : StdFBDisplayCursor32Axxx)(this, shmem,
+                        (volatile unsigned int *) screen, 0, vramRow, vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+                    (wide ? StdFBRemoveCursor32Wide : StdFBRemoveCursor32)(this, shmem,
+                        (volatile unsigned int *) screen, vramRow,
+                        kCursorBenchWidth, kCursorBenchHeight);
+                }
+            }
+            AbsoluteTime_to_scalar(&end) = mach_absolute_time();
+            SUB_ABSOLUTETIME(&end, &start);
+            absolutetime_to_nanoseconds(end, &nsec[wide]);
+        }
+        IOLog("IOFramebuffer: %d bpp cursor blits match, %u draw/remove pairs scalar %qd us wide %qd us\n",
+              depth, iterations, nsec[0] / 1000, nsec[1] / 1000);
+    }
+
+    cursorSave = oldSave;
+    __private->cursorImages[shmem->frame] = oldImage;
+    CLEARSEMA(shmem, this);
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (buf[i])
+            IOFree(buf[i], bytes);
+    }
+}
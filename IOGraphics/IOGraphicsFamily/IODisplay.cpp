@@ -528,8 +528,10 @@ bool IODisplay::start( IOService * provider )
 
     framebuffer->displayOnline(this, +1, options);
 
-    fNotifier = framebuffer->addFramebufferNotification(
-                    &IODisplay::_framebufferEvent, this, NULL );
+    // displays don't use the WillNotify/DidNotify hooks around each event
+    fNotifier = framebuffer->addFramebufferNotificationWithOptions(
+                    &IODisplay::_framebufferEvent, this, NULL,
+                    kIOFBNotifyEvent_All & ~kIOFBNotifyEvent_Notify );
 
     registerService();
 
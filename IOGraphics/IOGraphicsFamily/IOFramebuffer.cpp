@@ -97,6 +97,86 @@ enum { kIOFBMapCacheMode = kIOMapInhibitCache };
 #define kIOPMUserTriggeredFullWakeKey       "IOPMUserTriggeredFullWake"
 #endif
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Run func on each of count items, the first on the calling thread and the
+// rest on thread calls, returning once all are done. Items that can't get a
+// thread call run inline, so every item runs whatever happens.
+
+typedef void (*IOFBParallelFunc)(void * item);
+
+struct IOFBParallelCall
+{
+    thread_call_t               call;
+    IOFBParallelFunc            func;
+    void *                      item;
+    IOLock *                    lock;
+    uint32_t *                  pending;
+};
+
+static void IOFBParallelCallout(thread_call_param_t p0, thread_call_param_t p1)
+{
+    IOFBParallelCall * pc = (IOFBParallelCall *) p0;
+
+    (*pc->func)(pc->item);
+
+    IOLockLock(pc->lock);
+    if (!--(*pc->pending))
+        IOLockWakeup(pc->lock, pc->pending, false);
+    IOLockUnlock(pc->lock);
+}
+
+static void IOFBRunParallel(IOFBParallelFunc func, void * items, size_t itemSize, uint32_t count)
+{
+    IOFBParallelCall * calls = NULL;
+    IOLock *           lock  = NULL;
+    uint8_t *          item;
+    uint32_t           idx, pending;
+
+    if (count > 1)
+    {
+        calls = IONew(IOFBParallelCall, count);
+        lock  = IOLockAlloc();
+    }
+    if (!calls || !lock)
+    {
+        for (idx = 0, item = (uint8_t *) items; idx < count; idx++, item += itemSize)
+            (*func)(item);
+    }
+    else
+    {
+        pending = count - 1;
+        for (idx = 1, item = ((uint8_t *) items) + itemSize; idx < count; idx++, item += itemSize)
+        {
+            calls[idx].func    = func;
+            calls[idx].item    = item;
+            calls[idx].lock    = lock;
+            calls[idx].pending = &pending;
+            calls[idx].call    = thread_call_allocate(&IOFBParallelCallout, &calls[idx]);
+            if (calls[idx].call)
+                thread_call_enter(calls[idx].call);
+            else
+                IOFBParallelCallout(&calls[idx], NULL);
+        }
+        (*func)(items);
+
+        IOLockLock(lock);
+        while (pending)
+            IOLockSleep(lock, &pending, THREAD_UNINT);
+        IOLockUnlock(lock);
+
+        for (idx = 1; idx < count; idx++)
+        {
+            if (calls[idx].call)
+                thread_call_free(calls[idx].call);
+        }
+    }
+    if (calls)
+        IODelete(calls, IOFBParallelCall, count);
+    if (lock)
+        IOLockFree(lock);
+}
+
 #if VRAM_COMPRESS
 #include "bmcompress.h"
 #endif
@@ -222,6 +302,10 @@ static OSNumber *           gIOGraphicsPrefsVersionValue;
 static uint8_t				gIOFBLidOpenMode;
 static uint8_t				gIOFBVBLThrottle;
 static uint8_t				gIOFBVBLDrift;
+static uint8_t				gIOFBWideCursor;
+static uint32_t				gIOFBCursorBench;
+static uint8_t				gIOFBDeltaSave;
+static uint8_t				gIOFBParallelProbe;
 uint32_t					gIOGDebugFlags;
 uint32_t					gIOGNotifyTO;
 bool                        gIOGFades;
@@ -276,6 +360,16 @@ struct IOFBController
 #endif
 };
 
+// One controller's probe for probeAll(), or one framebuffer's connect
+// change probe for probeConnections().
+struct IOFBProbeWork
+{
+    IOFBController *            controller;
+    IOFramebuffer *             fb;
+    IOOptionBits                options;
+    IOReturn                    result;
+};
+
 struct IOFBInterruptRegister
 {
     IOFBInterruptProc           handler;
@@ -289,6 +383,25 @@ enum
 	kIOFBNumInterruptRegister  = 1
 };
 
+enum { kIOFBGammaCacheCount = 4 };
+
+// compiled output tables, keyed by a hash of everything updateGammaTable reads
+struct IOFBGammaCacheEntry
+{
+    uint64_t                    key;
+    UInt8 *                     table;
+    IOByteCount                 len;
+    uint32_t                    lastUse;
+};
+
+// per output entry source sample, shared by all channels
+struct IOFBGammaPlanEntry
+{
+    uint32_t                    in;
+    uint32_t                    phase;          // interpolation step, or kIOFBGammaNoInterp
+};
+enum { kIOFBGammaNoInterp = 0xFFFFFFFF };
+
 struct IOFramebufferPrivate
 {
     IOFBController *            controller;
@@ -369,6 +482,7 @@ struct IOFramebufferPrivate
 	uint32_t					hibernateGfxStatus;
     uint32_t                    saveLength;
     void *                      saveFramebuffer;
+    struct bm_delta_cache *     saveDeltaCache;
 
 	UInt8						needGammaRestore;
 	UInt8						vblThrottle;
@@ -419,6 +533,12 @@ struct IOFramebufferPrivate
 
     uintptr_t                   gammaScale[4];
 
+    IOFBGammaPlanEntry *        gammaPlan;
+    uint32_t                    gammaPlanSrcCount;
+    uint32_t                    gammaPlanDstCount;
+    IOFBGammaCacheEntry         gammaCache[kIOFBGammaCacheCount];
+    uint32_t                    gammaCacheClock;
+
     IOPixelInformation          pixelInfo;
 	IOTimingInformation 		timingInfo;
     IODisplayModeID             offlineMode;
@@ -428,12 +548,73 @@ struct IOFramebufferPrivate
     IOIndex                     currentDepth;
 
     int32_t                     lastProcessedChange;
+
+    UInt8                       probed;
+    UInt8                       probedOnline;
+
+    IOBufferMemoryDescriptor *  statsMem;
+    IOFBStatistics *            stats;
+
 };
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #define GetShmem(instance)      ((StdFBShmem_t *)(instance->priv))
 
+// Writers of an IOFBStatistics group take its sequence count odd for the
+// duration of the update; the compare and swap also orders racing writers.
+static inline uint32_t IOFBStatsBegin( volatile uint32_t * seq )
+{
+    uint32_t s;
+
+    do
+        s = *seq;
+    while ((s & 1) || !OSCompareAndSwap(s, s + 1, seq));
+    OSMemoryBarrier();
+
+    return (s);
+}
+
+static inline void IOFBStatsEnd( volatile uint32_t * seq, uint32_t s )
+{
+    OSMemoryBarrier();
+    *seq = s + 2;
+}
+
+static void IOFBStatsModeSwitch( IOFBStatistics * stats, uint64_t start )
+{
+    uint64_t time;
+    uint32_t seq;
+
+    if (!stats)
+        return;
+
+    time = mach_absolute_time() - start;
+    seq  = IOFBStatsBegin(&stats->modeSeq);
+    stats->modeSwitchCount++;
+    stats->modeSwitchLastTime   = time;
+    stats->modeSwitchTotalTime += time;
+    if (time > stats->modeSwitchMaxTime)
+        stats->modeSwitchMaxTime = time;
+    IOFBStatsEnd(&stats->modeSeq, seq);
+}
+
+static void IOFBStatsFlush( IOFBStatistics * stats, uint64_t pixels )
+{
+    uint32_t seq;
+
+    if (!stats)
+        return;
+
+    seq = IOFBStatsBegin(&stats->flushSeq);
+    stats->flushCount++;
+    stats->flushPixels += pixels;
+    IOFBStatsEnd(&stats->flushSeq, seq);
+}
+
+#define IOFBStatsCursor(fb)     \
+    if (fb->__private->stats) OSIncrementAtomic64((volatile SInt64 *) &fb->__private->stats->cursorUpdates)
+
 #define KICK_CURSOR(thread)     \
             thread->interruptOccurred(0, 0, 0);
 
@@ -1244,17 +1425,30 @@ void IOFramebuffer::setupCursor(void)
             if (colorConvert.t._bm34To35SampleTable
                     && colorConvert.t._bm35To34SampleTable)
             {
-                cursorBlitProc = (CursorBlitProc) StdFBDisplayCursor555;
-                cursorRemoveProc = (CursorRemoveProc) StdFBRemoveCursor16;
+                if (gIOFBWideCursor)
+                {
+                    cursorBlitProc = (CursorBlitProc) StdFBDisplayCursor555Wide;
+                    cursorRemoveProc = (CursorRemoveProc) StdFBRemoveCursor16Wide;
+                }
+                else
+                {
+                    cursorBlitProc = (CursorBlitProc) StdFBDisplayCursor555;
+                    cursorRemoveProc = (CursorRemoveProc) StdFBRemoveCursor16;
+                }
             }
             break;
         case 32:
         case 64:
 			if (10 == info->bitsPerComponent)
 				cursorBlitProc = (CursorBlitProc) StdFBDisplayCursor30Axxx;
+			else if (gIOFBWideCursor)
+				cursorBlitProc = (CursorBlitProc) StdFBDisplayCursor32AxxxWide;
 			else
 				cursorBlitProc = (CursorBlitProc) StdFBDisplayCursor32Axxx;
-			cursorRemoveProc = (CursorRemoveProc) StdFBRemoveCursor32;
+			if (gIOFBWideCursor)
+				cursorRemoveProc = (CursorRemoveProc) StdFBRemoveCursor32Wide;
+			else
+				cursorRemoveProc = (CursorRemoveProc) StdFBRemoveCursor32;
             break;
         default:
             break;
@@ -1262,6 +1456,13 @@ void IOFramebuffer::setupCursor(void)
 
 	if (!cursorBlitProc) DEBG1(thisName, " can't do sw cursor at depth %d\n",
                   				(uint32_t) info->bitsPerPixel);
+
+    if (gIOFBCursorBench && shmem)
+    {
+        uint32_t iterations = gIOFBCursorBench;
+        gIOFBCursorBench = 0;
+        checkCursorBlits(iterations);
+    }
 }
 
 void IOFramebuffer::stopCursor( void )
@@ -1783,6 +1984,57 @@ DEBG1(inst->thisName, " extSetGammaTable(%x) online %d %ld %ld data %x\n",
     return (err);
 }
 
+static uint64_t IOFBGammaHash( uint64_t hash, const void * bytes, IOByteCount len )
+{
+    const UInt8 * p = (const UInt8 *) bytes;
+
+    while (len--)
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+
+    return (hash);
+}
+
+// Sample positions depend only on the source and destination entry counts,
+// so they are worked out once rather than with two divides per entry.
+static const IOFBGammaPlanEntry * IOFBGammaGetPlan( IOFramebufferPrivate * priv,
+                                                    uint32_t srcCount, uint32_t dstCount )
+{
+    uint32_t idx, maxSrc, maxDst, interpCount;
+
+    if (priv->gammaPlan
+     && (srcCount == priv->gammaPlanSrcCount)
+     && (dstCount == priv->gammaPlanDstCount))
+        return (priv->gammaPlan);
+
+    if (priv->gammaPlan && (dstCount != priv->gammaPlanDstCount))
+    {
+        IODelete(priv->gammaPlan, IOFBGammaPlanEntry, priv->gammaPlanDstCount);
+        priv->gammaPlan = NULL;
+    }
+    if (!priv->gammaPlan)
+        priv->gammaPlan = IONew(IOFBGammaPlanEntry, dstCount);
+    if (!priv->gammaPlan)
+        return (NULL);
+
+    maxSrc = srcCount - 1;
+    maxDst = dstCount - 1;
+    if ((srcCount < dstCount) && (0 == (dstCount % srcCount)))
+        interpCount = dstCount / srcCount;
+    else
+        interpCount = 0;
+
+    for (idx = 0; idx <= maxDst; idx++)
+    {
+        priv->gammaPlan[idx].in    = ((idx * maxSrc) + (idx ? (idx - 1) : 0)) / maxDst;
+        priv->gammaPlan[idx].phase = (interpCount && (priv->gammaPlan[idx].in < maxSrc))
+                                        ? (idx % interpCount) : kIOFBGammaNoInterp;
+    }
+    priv->gammaPlanSrcCount = srcCount;
+    priv->gammaPlanDstCount = dstCount;
+
+    return (priv->gammaPlan);
+}
+
 IOReturn IOFramebuffer::updateGammaTable(
     UInt32 channelCount, UInt32 srcDataCount,
     UInt32 dataWidth, const void * data,
@@ -1803,6 +2055,9 @@ IOReturn IOFramebuffer::updateGammaTable(
 	const uint32_t * adjustNext   = NULL;
 	uint32_t         gammaThresh;
 	uint32_t         gammaAdjust;
+	IOFBGammaCacheEntry * cached = NULL;
+	uint64_t         key = 0;
+	bool             needCompute = false;
 
 	if (GAMMA_ADJ && gIOGraphicsControl && (__private->desiredGammaDataWidth <= 8))
 	{
@@ -1895,8 +2150,41 @@ IOReturn IOFramebuffer::updateGammaTable(
             bcopy(data, table, dataLen - __private->gammaHeaderSize);
         else
         {
-            uint32_t pin, pt5, in, out, channel, idx, maxSrc, maxDst, interpCount;
+            // a repeated request (same table, scales and geometry) is a table copy
+            key = IOFBGammaHash(0xcbf29ce484222325ULL, &channelCount, sizeof(channelCount));
+            key = IOFBGammaHash(key, &srcDataCount, sizeof(srcDataCount));
+            key = IOFBGammaHash(key, &__private->desiredGammaDataWidth, sizeof(__private->desiredGammaDataWidth));
+            key = IOFBGammaHash(key, &__private->desiredGammaDataCount, sizeof(__private->desiredGammaDataCount));
+            key = IOFBGammaHash(key, &__private->gammaScale[0], sizeof(__private->gammaScale));
+            key = IOFBGammaHash(key, &adjustParams, sizeof(adjustParams));
+            if (data)
+                key = IOFBGammaHash(key, data, srcDataCount * channelCount * sizeof(UInt16));
+
+            for (uint32_t idx = 0; idx < kIOFBGammaCacheCount; idx++)
+            {
+                IOFBGammaCacheEntry * entry = &__private->gammaCache[idx];
+                if (entry->table && (entry->key == key)
+                 && (entry->len == (dataLen - __private->gammaHeaderSize)))
+                {
+                    cached = entry;
+                    break;
+                }
+            }
+            needCompute = !cached;
+        }
+
+        if (cached)
+        {
+            bcopy(cached->table, table, cached->len);
+            cached->lastUse = ++__private->gammaCacheClock;
+        }
+        else if (needCompute)
+        {
+            uint32_t pin, pt5, out, channel, idx, maxDst, interpCount;
             int64_t value, value2;
+            uint64_t scale = 0;
+            uint32_t shift;
+            const IOFBGammaPlanEntry * plan = NULL;
 
             pin = (1 << tryWidth) - 1;
             pt5 = 0; //(1 << (tryWidth - 1));               // truncate not round
@@ -1904,13 +2192,22 @@ IOReturn IOFramebuffer::updateGammaTable(
                 dataWidth += 32;
 
             channelData = (UInt16 *) data;
-            maxSrc = (srcDataCount - 1);
             maxDst = (__private->desiredGammaDataCount - 1);
             if ((srcDataCount < __private->desiredGammaDataCount)
              && (0 == (__private->desiredGammaDataCount % srcDataCount)))
                 interpCount = __private->desiredGammaDataCount / srcDataCount;
             else
                 interpCount = 0;
+            if (channelData
+             && !(plan = IOFBGammaGetPlan(__private, srcDataCount, maxDst + 1)))
+            {
+                // gammaDataLen is zero, so the table would be reallocated over
+                IODelete(__private->gammaData, UInt8, dataLen);
+                __private->gammaData = NULL;
+                err = kIOReturnNoMemory;
+                continue;
+            }
+            shift = dataWidth - tryWidth;
 
             for (out = 0, channel = 0; channel < channelCount; channel++)
             {
@@ -1919,6 +2216,9 @@ IOReturn IOFramebuffer::updateGammaTable(
 					gammaThresh = 0;
 					adjustNext = adjustParams;
 				}
+                // fold both scale factors into one multiplier per channel
+                if (gammaHaveScale)
+                    scale = __private->gammaScale[channel] * __private->gammaScale[3];
                 for (idx = 0; idx <= maxDst; idx++)
                 {
 					if (idx >= gammaThresh)
@@ -1928,21 +2228,20 @@ IOReturn IOFramebuffer::updateGammaTable(
 					}
 					if (channelData)
 					{
-						in = ((idx * maxSrc) + (idx ? (idx - 1) : 0)) / maxDst;
-						value = (channelData[in] /*+ pt5*/);
-						if (interpCount && (in < maxSrc))
+						value = (channelData[plan[idx].in] /*+ pt5*/);
+						if (kIOFBGammaNoInterp != plan[idx].phase)
 						{
-							value2 = (channelData[in+1] /*+ pt5*/);
-							value += ((value2 - value) * (idx % interpCount) + (interpCount - 1)) / interpCount;
+							value2 = (channelData[plan[idx].in+1] /*+ pt5*/);
+							value += ((value2 - value) * plan[idx].phase + (interpCount - 1)) / interpCount;
 						}
 					}
 					else
 					    value = (idx * ((1 << dataWidth) - 1)) / maxDst; 
                     if (gammaHaveScale)
                     {
-                        value = ((value * __private->gammaScale[channel] * __private->gammaScale[3]) + (1U << 31));
+                        value = ((value * scale) + (1U << 31));
                     }
-                    value = (value >> (dataWidth - tryWidth));
+                    value = (value >> shift);
 					if (value)
 						value += gammaAdjust;
                     if (value > pin)
@@ -1956,6 +2255,28 @@ IOReturn IOFramebuffer::updateGammaTable(
                 }
                 if (channelData) channelData += srcDataCount;
             }
+
+            // remember the result, replacing the least recently used table
+            IOFBGammaCacheEntry * victim = &__private->gammaCache[0];
+            for (idx = 1; idx < kIOFBGammaCacheCount; idx++)
+            {
+                if (__private->gammaCache[idx].lastUse < victim->lastUse)
+                    victim = &__private->gammaCache[idx];
+            }
+            if (victim->table && (victim->len != (dataLen - __private->gammaHeaderSize)))
+            {
+                IODelete(victim->table, UInt8, victim->len);
+                victim->table = NULL;
+            }
+            victim->len = dataLen - __private->gammaHeaderSize;
+            if (!victim->table)
+                victim->table = IONew(UInt8, victim->len);
+            if (victim->table)
+            {
+                bcopy(table, victim->table, victim->len);
+                victim->key     = key;
+                victim->lastUse = ++__private->gammaCacheClock;
+            }
         }
         __private->gammaDataWidth = tryWidth;
         __private->gammaDataLen   = dataLen;
@@ -2646,6 +2967,18 @@ void IOFramebuffer::free()
         semaphore_destroy(kernel_task, vblSemaphore);
     if (__private)
     {
+#if VRAM_COMPRESS
+        DeltaCacheFree( __private->saveDeltaCache );
+#endif
+        if (__private->gammaPlan)
+            IODelete( __private->gammaPlan, IOFBGammaPlanEntry, __private->gammaPlanDstCount );
+        for (uint32_t idx = 0; idx < kIOFBGammaCacheCount; idx++)
+        {
+            if (__private->gammaCache[idx].table)
+                IODelete( __private->gammaCache[idx].table, UInt8, __private->gammaCache[idx].len );
+        }
+        if (__private->statsMem)
+            __private->statsMem->release();
         IODelete( __private, IOFramebufferPrivate, 1 );
         __private = 0;
     }
@@ -2692,6 +3025,11 @@ __private_extern__ "C" kern_return_t IOGraphicsFamilyModuleStart(kmod_info_t *ki
 	gIOFBVBLThrottle = (0 != (kIOGDbgVBLThrottle & gIOGDebugFlags));
 	gIOFBVBLDrift    = (0 != (kIOGDbgVBLDrift    & gIOGDebugFlags));
 	gIOGFades        = (0 != (kIOGDbgFades       & gIOGDebugFlags));
+	gIOFBWideCursor  = (0 == (kIOGDbgScalarCursor & gIOGDebugFlags));
+	gIOFBDeltaSave   = (0 != (kIOGDbgDeltaSave    & gIOGDebugFlags));
+	gIOFBParallelProbe = (0 != (kIOGDbgParallelProbe & gIOGDebugFlags));
+
+	PE_parse_boot_argn("iogcursorbench", &gIOFBCursorBench, sizeof(gIOFBCursorBench));
 
 	if (!PE_parse_boot_argn("iognotifyto", &gIOGNotifyTO, sizeof(gIOGNotifyTO)) 
 		|| !gIOGNotifyTO)
@@ -2823,6 +3161,16 @@ bool IOFramebuffer::start( IOService * provider )
         if (!serverMsg)
             return (false);
         bzero( serverMsg, sizeof (mach_msg_header_t));
+
+        __private->statsMem = IOBufferMemoryDescriptor::withOptions(
+                                kIODirectionNone | kIOMemoryKernelUserShared, page_size );
+        if (__private->statsMem)
+        {
+            __private->stats = (IOFBStatistics *) __private->statsMem->getBytesNoCopy();
+            bzero( __private->stats, page_size );
+            __private->stats->version = kIOFBStatisticsVersion;
+            __private->stats->size    = sizeof(IOFBStatistics);
+        }
     }
     if (!thisName)
     	thisName = "IOFB?";
@@ -3087,6 +3435,7 @@ void IOFramebuffer::moveCursor( IOGPoint * cursorLoc, int frame )
     nextCursorFrame = frame;
 
 	CURSORLOCK(this);
+    IOFBStatsCursor(this);
 
     if (frame != shmem->frame)
     {
@@ -3123,6 +3472,7 @@ void IOFramebuffer::moveCursor( IOGPoint * cursorLoc, int frame )
 void IOFramebuffer::hideCursor( void )
 {
 	CURSORLOCK(this);
+    IOFBStatsCursor(this);
 
     SysHideCursor(this);
 
@@ -3134,6 +3484,7 @@ void IOFramebuffer::showCursor( IOGPoint * cursorLoc, int frame )
     UInt32 hwCursorActive;
 
 	CURSORLOCK(this);
+    IOFBStatsCursor(this);
 
     if (frame != shmem->frame)
     {
@@ -3251,6 +3602,15 @@ void IOFramebuffer::handleVBL(IOFramebuffer * inst, void * ref)
     shmem->vblTime  = now;
 	inst->__private->actualVBLCount = 0;
 
+	if (inst->__private->stats)
+	{
+		IOFBStatistics * stats = inst->__private->stats;
+		uint32_t         seq   = IOFBStatsBegin(&stats->vblSeq);
+		stats->vblCount = shmem->vblCount;
+		stats->vblTime  = _now;
+		IOFBStatsEnd(&stats->vblSeq, seq);
+	}
+
     KERNEL_DEBUG(0xc000030 | DBG_FUNC_NONE,
                  (uint32_t)(AbsoluteTime_to_scalar(&shmem->vblDelta) >> 32),
                  (uint32_t)(AbsoluteTime_to_scalar(&shmem->vblDelta)), 0, 0, 0);
@@ -4077,7 +4437,15 @@ void IOFramebuffer::saveFramebuffer(void)
 			{
 				uint8_t * gammaData = __private->gammaData;
 				if (gammaData) gammaData += __private->gammaHeaderSize;
-				dLen = CompressData( bits, kIOPreviewImageCount, bytesPerPixel,
+				if (gIOFBDeltaSave)
+					dLen = CompressDataDelta( &__private->saveDeltaCache,
+									 bits, kIOPreviewImageCount, bytesPerPixel,
+									 __private->framebufferWidth, __private->framebufferHeight, rowBytes,
+									 (UInt8 *) __private->saveFramebuffer, __private->saveLength,
+									 __private->gammaChannelCount, __private->gammaDataCount, 
+									__private->gammaDataWidth, gammaData);
+				else
+					dLen = CompressData( bits, kIOPreviewImageCount, bytesPerPixel,
 									 __private->framebufferWidth, __private->framebufferHeight, rowBytes,
 									 (UInt8 *) __private->saveFramebuffer, __private->saveLength,
 									 __private->gammaChannelCount, __private->gammaDataCount, 
@@ -5323,11 +5691,66 @@ IOReturn IOFramebuffer::extEndConnectionChange(void)
 	return (kIOReturnSuccess);
 }
 
+void IOFramebuffer::probeConnectionWork( void * arg )
+{
+    IOFBProbeWork * work = (IOFBProbeWork *) arg;
+    IOFramebuffer * fb   = work->fb;
+
+    fb->connectionChanged();
+    fb->__private->probedOnline = fb->updateOnline();
+    fb->__private->probed       = true;
+}
+
+// Run the driver side of a connect change (kConnectionChanged, then the
+// kConnectionCheckEnable and offline mode scan of updateOnline) for the
+// controller's framebuffers at once. The caller keeps the controller gate
+// for the whole fan-out, so no other work reaches the driver until the join;
+// the probes themselves run on thread calls and must not take the gate, which
+// only drivers publishing kIOFBParallelConnectProbeKey promise. Mirrored
+// framebuffers must be unmirrored first, so they are probed in the serial pass.
+void IOFramebuffer::probeConnections(IOFBController * controller)
+{
+    IOFBProbeWork * work;
+    IOFramebuffer * fb;
+    uint32_t        idx, count;
+
+    if (!controller->wl->inGate())
+        return;
+
+    work = IONew(IOFBProbeWork, kIOFBControllerMaxFBs);
+    if (!work)
+        return;
+
+    for (idx = count = 0; (fb = controller->fbs[idx]); idx++)
+    {
+        if (fb->__private->lastProcessedChange == controller->connectChange)
+            continue;
+        if (fb->__private->nextMirror)
+            continue;
+        if (kOSBooleanTrue != fb->getProperty(kIOFBParallelConnectProbeKey))
+            continue;
+        work[count].controller = controller;
+        work[count].fb         = fb;
+        count++;
+    }
+
+    if (count > 1)
+    {
+        DEBG1(controller->name, " probing %d framebuffers\n", count);
+        IOFBRunParallel(&probeConnectionWork, work, sizeof(work[0]), count);
+    }
+
+    IODelete(work, IOFBProbeWork, kIOFBControllerMaxFBs);
+}
+
 IOReturn IOFramebuffer::processConnectChange(IOFBController * controller, IOOptionBits mode)
 {
     IOFramebuffer * fb;
     uint32_t idx;
 
+    if (gIOFBParallelProbe && (bg == mode) && controller->fbs[0] && controller->fbs[1])
+        probeConnections(controller);
+
     for (idx = 0; (fb = controller->fbs[idx]); idx++)
     {
         fb->processConnectChange(mode);
@@ -5410,11 +5833,30 @@ IOReturn IOFramebuffer::extProcessConnectionChange(void)
 }
 
 
-IOReturn IOFramebuffer::processConnectChange(IOOptionBits mode)
+IOReturn IOFramebuffer::connectionChanged(void)
 {
     IOReturn  err;
     uintptr_t unused;
+
+	{
+		// connect change vars here
+		__private->enableScalerUnderscan = false;
+		__private->audioStreaming        = false;
+		__private->colorModesSupported   = 0;
+	}
+    
+    TIMESTART();
+    err = getAttributeForConnection(0, kConnectionChanged, &unused);
+    TIMEEND(thisName, "kConnectionChanged time: %qd ms\n");
+
+    return (err);
+}
+
+IOReturn IOFramebuffer::processConnectChange(IOOptionBits mode)
+{
+    IOReturn  err;
     bool      nowOnline;
+    bool      probed;
     
     DEBG1(thisName, " (%d==%s) curr %d\n", 
     		(uint32_t) mode, processConnectChangeModeNames[mode], __private->lastProcessedChange);
@@ -5425,27 +5867,21 @@ IOReturn IOFramebuffer::processConnectChange(IOOptionBits mode)
         __private->online = false;
         return (kIOReturnSuccess);
     }
+    probed = __private->probed;
+    __private->probed = false;
     if (__private->lastProcessedChange == __private->controller->connectChange)
         return (kIOReturnSuccess);
     
     if (fg == mode) suspend(true);
     
-	{
-		// connect change vars here
-		__private->enableScalerUnderscan = false;
-		__private->audioStreaming        = false;
-		__private->colorModesSupported   = 0;
-	}
-    
-    TIMESTART();
-    err = getAttributeForConnection(0, kConnectionChanged, &unused);
-    TIMEEND(thisName, "kConnectionChanged time: %qd ms\n");
+    if (!probed)
+        connectionChanged();
     
     __private->lastProcessedChange = __private->controller->connectChange;
     extSetMirrorOne(0, 0);
     if (fg == mode) suspend(true);
 
-    nowOnline = updateOnline();
+    nowOnline = probed ? __private->probedOnline : updateOnline();
     if (false && nowOnline)
     {
         DEBG1(thisName, " bgOff forced\n");
@@ -5650,10 +6086,12 @@ IOReturn IOFramebuffer::matchFramebuffer(void)
 		setDisplayAttributes(__private->displayAttributes);
 
 		depth = closestDepth(mode, &__private->pixelInfo);
+		uint64_t start = mach_absolute_time();
 		TIMESTART();
 		err = setDisplayMode(mode, depth);
 		TIMEEND(thisName, "matching setDisplayMode(0x%x, %d) err %x time: %qd ms\n", 
 				(int32_t) mode, (int32_t) depth, err);
+		IOFBStatsModeSwitch(__private->stats, start);
 
 		if (__private->rawGammaData)
 		{
@@ -6786,7 +7224,10 @@ IOReturn IOFramebuffer::selectTransform( UInt64 transform, bool generateChange )
 
 IOReturn IOFramebuffer::probeAll( IOOptionBits options )
 {
-    IOReturn err = kIOReturnSuccess;
+    IOReturn         err = kIOReturnSuccess;
+    IOFBController * controller;
+    IOFBProbeWork *  work = NULL;
+    uint32_t         count = 0;
 
     do
     {
@@ -6798,6 +7239,37 @@ IOReturn IOFramebuffer::probeAll( IOOptionBits options )
             err = gIOGraphicsControl->requestProbe(options);
 			break;
         }
+        // the caller holds the system gate, which single threaded
+        // controllers share, so only separate controller gates can fan out
+        if (gIOFBParallelProbe && !SINGLE_THREAD
+         && (controller = gIOFBAllControllers)
+         && (controller->nextController != controller))
+        {
+            do
+                count++;
+            while ((controller = controller->nextController) != gIOFBAllControllers);
+            work = IONew(IOFBProbeWork, count);
+        }
+        if (work)
+        {
+            // controllers probe concurrently, each under its own gate
+            controller = gIOFBAllControllers;
+            for (index = 0; index < count; index++)
+            {
+                work[index].controller = controller;
+                work[index].options    = options;
+                work[index].result     = kIOReturnSuccess;
+                controller = controller->nextController;
+            }
+            IOFBRunParallel(&probeControllerWork, work, sizeof(work[0]), count);
+            for (index = 0; index < count; index++)
+            {
+                if (kIOReturnSuccess == err)
+                    err = work[index].result;
+            }
+            break;
+        }
+
         for (index = 0;
                 (fb = (IOFramebuffer *) gAllFramebuffers->getObject(index));
                 index++)
@@ -6815,9 +7287,40 @@ IOReturn IOFramebuffer::probeAll( IOOptionBits options )
     }
     while (false);
 
+    if (work)
+        IODelete(work, IOFBProbeWork, count);
+
+    return (err);
+}
+
+IOReturn IOFramebuffer::probeController( IOFBController * controller, IOOptionBits options )
+{
+    IOReturn        err = kIOReturnSuccess;
+    IOReturn        thisErr;
+    IOFramebuffer * fb;
+    uint32_t        idx;
+
+    FCLOCK(controller);
+    for (idx = 0; (fb = controller->fbs[idx]); idx++)
+    {
+        if (fb->captured)
+            continue;
+        thisErr = fb->setAttributeForConnection(0, kConnectionProbe, options);
+        if (kIOReturnSuccess == err)
+            err = thisErr;
+    }
+    FCUNLOCK(controller);
+
     return (err);
 }
 
+void IOFramebuffer::probeControllerWork( void * arg )
+{
+    IOFBProbeWork * work = (IOFBProbeWork *) arg;
+
+    work->result = probeController(work->controller, work->options);
+}
+
 IOReturn IOFramebuffer::requestProbe( IOOptionBits options )
 {
     IOReturn err;
@@ -7579,9 +8082,11 @@ IOReturn IOFramebuffer::doSetDisplayMode(
 
    	if (kIODisplayModeIDCurrent != displayMode)
 	{
+		uint64_t start = mach_absolute_time();
 		TIMESTART();
 		err = setDisplayMode( displayMode, depth );
 		TIMEEND(thisName, "setDisplayMode time: %qd ms\n");
+		IOFBStatsModeSwitch(__private->stats, start);
 		__private->aliasMode    = kIODisplayModeIDInvalid;
 		__private->currentDepth = depth;
 	}
@@ -8043,6 +8548,12 @@ IOReturn IOFramebuffer::setAttribute( IOSelect attribute, uintptr_t value )
         case kIOPowerAttribute:
             ret = setAttributeExt(attribute, value);
             break;
+
+        case kIOFBFlushStatisticsAttribute:
+            // value is the number of pixels the subclass flushed
+            IOFBStatsFlush(__private->stats, value);
+            ret = kIOReturnSuccess;
+            break;
             
         default:
             ret = kIOReturnUnsupported;
@@ -8356,9 +8867,43 @@ void _IOFramebufferNotifier::enable( bool was )
     UNLOCKNOTIFY();
 }
 
+static IOOptionBits IOFBNotifyEventMask( IOIndex event )
+{
+    switch (event)
+    {
+        case kIOFBNotifyDisplayModeWillChange:  return (kIOFBNotifyEvent_DisplayModeWillChange);
+        case kIOFBNotifyDisplayModeDidChange:   return (kIOFBNotifyEvent_DisplayModeDidChange);
+        case kIOFBNotifyWillSleep:              return (kIOFBNotifyEvent_WillSleep);
+        case kIOFBNotifyDidWake:                return (kIOFBNotifyEvent_DidWake);
+        case kIOFBNotifyDidPowerOff:            return (kIOFBNotifyEvent_DidPowerOff);
+        case kIOFBNotifyWillPowerOn:            return (kIOFBNotifyEvent_WillPowerOn);
+        case kIOFBNotifyWillPowerOff:           return (kIOFBNotifyEvent_WillPowerOff);
+        case kIOFBNotifyDidPowerOn:             return (kIOFBNotifyEvent_DidPowerOn);
+        case kIOFBNotifyWillChangeSpeed:        return (kIOFBNotifyEvent_WillChangeSpeed);
+        case kIOFBNotifyDidChangeSpeed:         return (kIOFBNotifyEvent_DidChangeSpeed);
+        case kIOFBNotifyClamshellChange:        return (kIOFBNotifyEvent_ClamshellChange);
+        case kIOFBNotifyCaptureChange:          return (kIOFBNotifyEvent_CaptureChange);
+        case kIOFBNotifyOnlineChange:           return (kIOFBNotifyEvent_OnlineChange);
+        case kIOFBNotifyDisplayDimsChange:      return (kIOFBNotifyEvent_DisplayDimsChange);
+        case kIOFBNotifyProbed:                 return (kIOFBNotifyEvent_Probed);
+        case kIOFBNotifyVRAMReady:              return (kIOFBNotifyEvent_VRAMReady);
+        case kIOFBNotifyWillNotify:
+        case kIOFBNotifyDidNotify:              return (kIOFBNotifyEvent_Notify);
+        // unknown events from subclasses go to everyone
+        default:                                return (kIOFBNotifyEvent_All);
+    }
+}
+
 IONotifier * IOFramebuffer::addFramebufferNotification(
     IOFramebufferNotificationHandler handler,
     OSObject * self, void * ref)
+{
+    return (addFramebufferNotificationWithOptions(handler, self, ref, kIOFBNotifyEvent_All));
+}
+
+IONotifier * IOFramebuffer::addFramebufferNotificationWithOptions(
+    IOFramebufferNotificationHandler handler,
+    OSObject * self, void * ref, IOOptionBits events)
 {
     _IOFramebufferNotifier *    notify = 0;
 
@@ -8374,6 +8919,7 @@ IONotifier * IOFramebuffer::addFramebufferNotification(
         notify->handler = handler;
         notify->self = self;
         notify->ref = ref;
+        notify->fEvents = events;
         notify->fEnable = true;
 
 		if (__private && __private->controller)
@@ -8400,9 +8946,12 @@ IOReturn IOFramebuffer::deliverFramebufferNotification(
 {
     OSIterator *                iter;
     _IOFramebufferNotifier *    notify;
+    IOOptionBits                mask;
     IOReturn                    ret = kIOReturnSuccess;
     IOReturn                    r;
 
+    mask = IOFBNotifyEventMask(event);
+
 #if RLOG1
     const char * name = NULL;
     switch (event)
@@ -8473,6 +9022,7 @@ IOReturn IOFramebuffer::deliverFramebufferNotification(
 		while ((notify = (_IOFramebufferNotifier *) iter->getNextObject()))
 		{
 			if (!notify->fEnable) continue;
+			if (!(kIOFBNotifyEvent_Notify & notify->fEvents)) continue;
 			(*notify->handler)(notify->self, notify->ref, this,
 							   kIOFBNotifyWillNotify, &hook);
 		}
@@ -8481,6 +9031,7 @@ IOReturn IOFramebuffer::deliverFramebufferNotification(
 		while ((notify = (_IOFramebufferNotifier *) iter->getNextObject()))
 		{
 			if (!notify->fEnable) continue;
+			if (!(mask & notify->fEvents)) continue;
 			r = (*notify->handler)(notify->self, notify->ref, this,
 								   event, info );
 			if (kIOReturnSuccess != r) ret = r;
@@ -8491,6 +9042,7 @@ IOReturn IOFramebuffer::deliverFramebufferNotification(
 		while ((notify = (_IOFramebufferNotifier *) iter->getNextObject()))
 		{
 			if (!notify->fEnable) continue;
+			if (!(kIOFBNotifyEvent_Notify & notify->fEvents)) continue;
 			(*notify->handler)(notify->self, notify->ref, this,
 							   kIOFBNotifyDidNotify, &hook);
 		}
@@ -8926,6 +9478,16 @@ IOReturn IOFramebuffer::setCursorState( SInt32 x, SInt32 y, bool visible )
     return (kIOReturnUnsupported);
 }
 
+IOMemoryDescriptor * IOFramebuffer::copyStatisticsMemory( void )
+{
+    IOMemoryDescriptor * mem;
+
+    if ((mem = __private->statsMem))
+        mem->retain();
+
+    return (mem);
+}
+
 void IOFramebuffer::flushCursor( void )
 {}
 
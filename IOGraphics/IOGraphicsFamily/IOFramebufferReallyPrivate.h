@@ -33,6 +33,7 @@ public:
     OSObject *                          self;
     void *                              ref;
     bool                                fEnable;
+    IOOptionBits                        fEvents;
 
     virtual void remove();
     virtual bool disable();
@@ -124,6 +124,11 @@ IOReturn IOFramebufferUserClient::clientMemoryForType( UInt32 type,
             mem = owner->getVRAMRange();
             break;
 
+        case kIOFBStatisticsMemory:
+            mem = owner->copyStatisticsMemory();
+            *flags = kIOMapReadOnly;
+            break;
+
         default:
             mem = (IOMemoryDescriptor *) owner->userAccessRanges->getObject( type );
             mem->retain();
@@ -294,6 +299,11 @@ IOReturn IOFramebufferSharedUserClient::clientMemoryForType( UInt32 type,
             if (kIOReturnSuccess == clientHasPrivilege(current_task(), kIOClientPrivilegeLocalUser))
                 mem = owner->getVRAMRange();
             break;
+
+        case kIOFBStatisticsMemory:
+            mem = owner->copyStatisticsMemory();
+            *options = kIOMapReadOnly;
+            break;
     }
 
     *memory = mem;
@@ -137,6 +137,30 @@ enum {
     kIOFBNotifyDidNotify        = 81,
 };
 
+// addFramebufferNotificationWithOptions() event masks
+enum {
+    kIOFBNotifyEvent_DisplayModeWillChange  = 0x00000001,
+    kIOFBNotifyEvent_DisplayModeDidChange   = 0x00000002,
+    kIOFBNotifyEvent_WillSleep              = 0x00000004,
+    kIOFBNotifyEvent_DidWake                = 0x00000008,
+    kIOFBNotifyEvent_DidPowerOff            = 0x00000010,
+    kIOFBNotifyEvent_WillPowerOn            = 0x00000020,
+    kIOFBNotifyEvent_WillPowerOff           = 0x00000040,
+    kIOFBNotifyEvent_DidPowerOn             = 0x00000080,
+    kIOFBNotifyEvent_WillChangeSpeed        = 0x00000100,
+    kIOFBNotifyEvent_DidChangeSpeed         = 0x00000200,
+    kIOFBNotifyEvent_ClamshellChange        = 0x00000400,
+    kIOFBNotifyEvent_CaptureChange          = 0x00000800,
+    kIOFBNotifyEvent_OnlineChange           = 0x00001000,
+    kIOFBNotifyEvent_DisplayDimsChange      = 0x00002000,
+    kIOFBNotifyEvent_Probed                 = 0x00004000,
+    kIOFBNotifyEvent_VRAMReady              = 0x00008000,
+    // kIOFBNotifyWillNotify & kIOFBNotifyDidNotify
+    kIOFBNotifyEvent_Notify                 = 0x00010000,
+
+    kIOFBNotifyEvent_All                    = 0xFFFFFFFF
+};
+
 struct IOFramebufferNotificationNotify
 {
 	IOIndex event;
@@ -369,6 +393,12 @@ public:
             IOFramebufferNotificationHandler handler,
             OSObject * self, void * ref);
 
+    // As addFramebufferNotification(), but the handler is only called for
+    // the kIOFBNotifyEvent_* events set in the events mask.
+    IONotifier * addFramebufferNotificationWithOptions(
+            IOFramebufferNotificationHandler handler,
+            OSObject * self, void * ref, IOOptionBits events);
+
 /*! @function getApertureRange
     @abstract Return reference to IODeviceMemory object representing memory range of framebuffer.
     @discussion IOFramebuffer subclasses must implement this method to describe the memory used by the framebuffer in the current mode. The OS will map this memory range into user space for client access - the range should only include vram memory not hardware registers.
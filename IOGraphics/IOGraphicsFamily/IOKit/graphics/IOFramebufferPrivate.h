@@ -92,6 +92,26 @@
                                     int width,
                                     int height );
 
+    static void StdFBDisplayCursor555Wide(
+                                    IOFramebuffer * inst,
+                                    StdFBShmem_t *shmem,
+                                    volatile unsigned short *vramPtr,
+                                    unsigned int cursStart,
+                                    unsigned int vramRow,
+                                    unsigned int cursRow,
+                                    int width,
+                                    int height );
+
+    static void StdFBDisplayCursor32AxxxWide(
+                                    IOFramebuffer * inst,
+                                    StdFBShmem_t *shmem,
+                                    volatile unsigned int *vramPtr,
+                                    unsigned int cursStart,
+                                    unsigned int vramRow,
+                                    unsigned int cursRow,
+                                    int width,
+                                    int height );
+
     static void StdFBRemoveCursor8(
                                     IOFramebuffer * inst,
                                     StdFBShmem_t *shmem,
@@ -115,6 +135,24 @@
                                     int width,
                                     int height );
 
+    static void StdFBRemoveCursor16Wide(
+                                    IOFramebuffer * inst,
+                                    StdFBShmem_t *shmem,
+                                    volatile unsigned short *vramPtr,
+                                    unsigned int vramRow,
+                                    int width,
+                                    int height );
+
+    static void StdFBRemoveCursor32Wide(
+                                    IOFramebuffer * inst,
+                                    StdFBShmem_t *shmem,
+                                    volatile unsigned int *vramPtr,
+                                    unsigned int vramRow,
+                                    int width,
+                                    int height );
+
+    void checkCursorBlits( uint32_t iterations );
+
     static void deferredMoveCursor(IOFramebuffer * inst);
 
     static void deferredCLUTSetInterrupt( OSObject * owner,
@@ -179,12 +217,15 @@
     static void checkConnectionChange(IOFBController * controller );
     static void messageConnectionChange(IOFBController * controller );
     static IOReturn processConnectChange(IOFBController * controller, IOOptionBits mode);
+    static void probeConnections(IOFBController * controller);
+    static void probeConnectionWork( void * arg );
 	IOReturn matchFramebuffer(void);
     static IOReturn matchController(IOFBController * controller);
 
     IOReturn extProcessConnectionChange(void);
     IOReturn extEndConnectionChange(void);
     IOReturn processConnectChange(IOOptionBits mode);
+    IOReturn connectionChanged(void);
     bool suspend(bool now);
     bool updateOnline(void);
     void displaysOnline(bool nowOnline);
@@ -197,6 +238,7 @@
     static void sleepWork( void * arg );
     static void clamshellWork( thread_call_param_t p0, thread_call_param_t p1 );
     void saveFramebuffer(void);
+    IOMemoryDescriptor * copyStatisticsMemory(void);
     IOReturn restoreFramebuffer(IOIndex event);
 
     IOReturn deliverDisplayModeDidChangeNotification( void );
@@ -214,6 +256,8 @@
     static void readClamshellState(void);
 
     static IOReturn probeAll( IOOptionBits options );
+    static IOReturn probeController( IOFBController * controller, IOOptionBits options );
+    static void probeControllerWork( void * arg );
 
     IOReturn selectTransform( UInt64 newTransform, bool generateChange );
     void setTransform( UInt64 newTransform, bool generateChange );
@@ -176,6 +176,9 @@ enum
 	kIOGDbgVBLDrift        = 0x00000010,
 	kIOGDbgForceBrightness = 0x00000020,
 	kIOGDbgFades           = 0x00000040,
+	kIOGDbgScalarCursor    = 0x00000080,
+	kIOGDbgDeltaSave       = 0x00000100,
+	kIOGDbgParallelProbe   = 0x00000200,
 };
 
 #ifndef kIOScreenLockStateKey
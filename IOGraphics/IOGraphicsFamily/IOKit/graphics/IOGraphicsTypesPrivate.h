@@ -76,6 +76,9 @@ enum {
 
     kIOFBMatchedConnectChangeAttribute  = 'wsmc',
 
+    // Framebuffer attributes
+    kIOFBFlushStatisticsAttribute       = 'fbfs',
+
     // Connection attributes
     kConnectionInTVMode                 = 'tvmd',
     kConnectionWSSB                     = 'wssb',
@@ -106,6 +109,45 @@ enum {
     kIOFBVRAMMemory             = 110
 };
 
+/*! @enum FramebufferConstants
+    @constant kIOFBStatisticsMemory The memory type for IOConnectMapMemory() to get the read only IOFBStatistics page.
+*/
+enum {
+    kIOFBStatisticsMemory       = 111
+};
+
+enum { kIOFBStatisticsVersion = 1 };
+
+/*! @struct IOFBStatistics
+    @abstract Framebuffer counters shared read only with user clients.
+    @discussion The flush group is fed by subclasses that copy a shadow or damaged regions to the display; they call IOFramebuffer::setAttribute(kIOFBFlushStatisticsAttribute, pixels) once per flush. Each group of fields follows a sequence count that is odd while the kernel updates the group. Read the count, then the fields, then the count again, and retry if it was odd or has changed. cursorUpdates is updated atomically and needs no sequence count. Times are in mach_absolute_time() units.
+*/
+struct IOFBStatistics
+{
+    uint32_t            version;
+    uint32_t            size;
+
+    volatile uint32_t   vblSeq;
+    uint32_t            __reservedA;
+    uint64_t            vblCount;
+    uint64_t            vblTime;
+
+    volatile uint32_t   flushSeq;
+    uint32_t            __reservedB;
+    uint64_t            flushCount;
+    uint64_t            flushPixels;
+
+    volatile uint32_t   modeSeq;
+    uint32_t            __reservedC;
+    uint64_t            modeSwitchCount;
+    uint64_t            modeSwitchLastTime;
+    uint64_t            modeSwitchMaxTime;
+    uint64_t            modeSwitchTotalTime;
+
+    volatile uint64_t   cursorUpdates;
+};
+typedef struct IOFBStatistics IOFBStatistics;
+
 #define kIOFBGammaHeaderSizeKey         "IOFBGammaHeaderSize"
 
 #define kIONDRVFramebufferGenerationKey "IONDRVFramebufferGeneration"
@@ -125,6 +167,10 @@ enum {
 
 #define kIOFBConnectInterruptDelayKey   "connect-interrupt-delay"
 
+// kOSBooleanTrue when the driver's connection attributes for different
+// framebuffers may run at once without taking the work loop gate
+#define kIOFBParallelConnectProbeKey    "IOFBParallelConnectProbe"
+
 #define kIOFBUIScaleKey					"IOFBUIScale"
 
 #define kIOGraphicsPrefsKey             "IOGraphicsPrefs"
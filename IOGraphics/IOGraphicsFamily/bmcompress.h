@@ -91,13 +91,19 @@ static void FillVRAM8by1(int w, int h, uint32_t k0,uint32_t k1, uint8_t *dst, in
             for(i=0 ; i<v ; i++)
                 STOREINC(d, kd, double)
 #else
+            uint64_t kq = ((uint64_t)c1 << 32) | c0;
+
             v  = n >> 3;
             n  = n & 0x07;
-            for(i=0 ; i<v ; i++)
+            for(i=0 ; i+4<=v ; i+=4)
             {
-                STOREINC(d, c0, uint32_t);
-                STOREINC(d, c1, uint32_t);
+                STOREINC(d, kq, uint64_t);
+                STOREINC(d, kq, uint64_t);
+                STOREINC(d, kq, uint64_t);
+                STOREINC(d, kq, uint64_t);
             }
+            for(; i<v ; i++)
+                STOREINC(d, kq, uint64_t);
 #endif
         }
         else if(n >= 8)
@@ -278,6 +284,30 @@ static void DecompressRLE8(uint8_t *srcbase, uint8_t *dstbase, int minx, int max
 }
 
 
+/*
+** Count the pixels from src that repeat the pattern pixel, 16 bytes per step.
+** pattern holds the pixel replicated across all eight bytes.
+*/
+static inline uint32_t match_run(const uint8_t *src, const uint8_t *end,
+                                 uint64_t pattern, uint32_t bytesPerPixel)
+{
+    const uint8_t *p = src;
+    uint64_t       q0, q1;
+
+    while((end - p) >= 16)
+    {
+        __builtin_memcpy(&q0, p,     sizeof(q0));
+        __builtin_memcpy(&q1, p + 8, sizeof(q1));
+        if((q0 ^ pattern) | (q1 ^ pattern))
+            break;
+        p = p + 16;
+    }
+    while((p + bytesPerPixel <= end) && !bcmp(p, &pattern, bytesPerPixel))
+        p = p + bytesPerPixel;
+
+    return (uint32_t)((p - src) / bytesPerPixel);
+}
+
 static inline int compress_line_32(UInt8 *srcbase, int width, UInt8 *dstbase)
 {
     uint32_t  *src, *dst;
@@ -311,7 +341,12 @@ static inline int compress_line_32(UInt8 *srcbase, int width, UInt8 *dstbase)
             }
 
             else
-                rplCnt++;
+            {
+                uint32_t run = match_run((uint8_t *)src, (uint8_t *)end,
+                                         c0 | ((uint64_t)c0 << 32), 4);
+                rplCnt = rplCnt + run;
+                src    = src + run - 1;
+            }
         }
 
         if(rplCnt < 4)
@@ -378,7 +413,12 @@ static inline int compress_line_16(uint8_t *srcbase, int width, uint8_t *dstbase
                 c0     = c1;
             }
             else
-                rplCnt++;
+            {
+                uint32_t run = match_run((uint8_t *)src, (uint8_t *)end,
+                                         c0 * 0x0001000100010001ULL, sizeof(Pixel_Type));
+                rplCnt = rplCnt + run;
+                src    = src + run - 1;
+            }
         }
 
         if(rplCnt < kMinRunLength )
@@ -451,7 +491,12 @@ static inline int compress_line_8(uint8_t *srcbase, int width, uint8_t *dstbase)
                 c0     = c1;
             }
             else
-                rplCnt++;
+            {
+                uint32_t run = match_run((uint8_t *)src, (uint8_t *)end,
+                                         c0 * 0x0101010101010101ULL, sizeof(Pixel_Type));
+                rplCnt = rplCnt + run;
+                src    = src + run - 1;
+            }
         }
 
         if(rplCnt < kMinRunLength )
@@ -488,32 +533,211 @@ static inline int compress_line_8(uint8_t *srcbase, int width, uint8_t *dstbase)
     return sizeof( Pixel_Type )*wrtCnt;
 }
 
-static int CompressData(uint8_t *srcbase[], uint32_t imageCount,
+static inline int compress_line_depth(uint32_t depth, uint8_t *srcbase, int width, uint8_t *dstbase)
+{
+    return (depth <= 1 ? compress_line_8 :
+            (depth <= 2 ? compress_line_16 :
+             compress_line_32))(srcbase, width, dstbase);
+}
+
+#if KERNEL
+/*
+** Banded compression. Row bands of an image are encoded concurrently into
+** private scratch buffers, then stitched together in row order on the calling
+** thread. Repeated scanlines are found by comparing the source rows, which is
+** equivalent to comparing their encodings, so the stitched output is byte for
+** byte what the serial loop in CompressData produces. Rows that did not fit a
+** band's scratch buffer are encoded during the stitch. The bands are run by
+** IOFBRunParallel() from IOFramebuffer.cpp.
+*/
+
+enum
+{
+    kBMCompressMaxBands     = 4,
+    kBMCompressMinBandRows  = 128,
+    kBMCompressBandScratch  = 1024 * 1024,
+    kBMCompressRowRepeat    = 0xFFFFFFFF
+};
+
+struct bm_compress_band
+{
+    uint8_t *      src;         // first source row of the band
+    uint32_t       rowbytes;
+    uint32_t       depth;
+    uint32_t       width;
+    uint32_t       rows;
+    uint32_t       done;        // rows whose result is in rowLen[]
+    uint32_t *     rowLen;      // encoded length, or kBMCompressRowRepeat
+    uint8_t *      scratch;
+    uint32_t       scratchLen;
+};
+
+static void compress_band(void * arg)
+{
+    struct bm_compress_band * band = (typeof(band)) arg;
+    uint8_t * line = band->src;
+    uint8_t * out  = band->scratch;
+    uint32_t  lineLen = band->width * band->depth;
+    uint32_t  y;
+
+    for (y = 0; y < band->rows; y++, line += band->rowbytes)
+    {
+        if (y && !bcmp(line - band->rowbytes, line, lineLen))
+            band->rowLen[y] = kBMCompressRowRepeat;
+        else if (((out - band->scratch) + 8*(band->width+1)) > band->scratchLen)
+            break;
+        else
+        {
+            band->rowLen[y] = compress_line_depth(band->depth, line, band->width, out);
+            out += band->rowLen[y];
+        }
+    }
+    band->done = y;
+}
+
+/*
+** Returns the encoded length, 0 on overflow, or -1 if banding could not be
+** set up and the caller should fall back to the serial loop.
+*/
+static int CompressBands(uint8_t *srcbase[], uint32_t imageCount,
+                         uint32_t depth, uint32_t width, uint32_t height,
+                         uint32_t rowbytes, uint8_t *dstbase, uint32_t dlen,
+                         uint32_t *index, uint32_t *cScan)
+{
+    struct bm_compress_band * bands;
+    uint32_t   bandCount, bandRows;
+    uint32_t   image, b, y, r, off, len, lineLen;
+    uint32_t * pScan;
+    uint8_t *  prevLine;
+    bool       repeat;
+    int        result = -1;
+
+    for (image = 0; image < imageCount; image++)
+    {
+        if (!srcbase[image])
+            return -1;
+    }
+
+    bandCount = height / kBMCompressMinBandRows;
+    if (bandCount > kBMCompressMaxBands)
+        bandCount = kBMCompressMaxBands;
+    if (bandCount < 2)
+        return -1;
+    bandRows = (height + bandCount - 1) / bandCount;
+    lineLen  = width * depth;
+
+    bands = IONew(struct bm_compress_band, bandCount);
+    if (!bands)
+        return -1;
+    bzero(bands, bandCount * sizeof(*bands));
+
+    for (b = 0; b < bandCount; b++)
+    {
+        bands[b].rows       = (b == bandCount - 1) ? (height - b * bandRows) : bandRows;
+        bands[b].rowbytes   = rowbytes;
+        bands[b].depth      = depth;
+        bands[b].width      = width;
+        bands[b].scratchLen = bands[b].rows * (lineLen + 8);
+        if (bands[b].scratchLen > kBMCompressBandScratch)
+            bands[b].scratchLen = kBMCompressBandScratch;
+        bands[b].rowLen     = IONew(uint32_t, bands[b].rows);
+        bands[b].scratch    = (uint8_t *) IOMalloc(bands[b].scratchLen);
+        if (!bands[b].rowLen || !bands[b].scratch)
+            break;
+    }
+
+    if (b == bandCount)
+    {
+        pScan    = cScan;
+        prevLine = NULL;
+        result   = 0;
+
+        for (image = 0; image < imageCount; image++)
+        {
+            for (b = 0; b < bandCount; b++)
+            {
+                bands[b].src  = srcbase[image] + b * bandRows * rowbytes;
+                bands[b].done = 0;
+            }
+            IOFBRunParallel(&compress_band, bands, sizeof(bands[0]), bandCount);
+
+            for (b = 0; b < bandCount; b++)
+            {
+                uint8_t * line = bands[b].src;
+
+                for (r = 0, off = 0; r < bands[b].rows; r++, line += rowbytes)
+                {
+                    y = b * bandRows + r;
+                    if(((((uint8_t *)cScan)-dstbase) + 8*(width+1)) > dlen)
+                    {
+                        DEBG("", "compressData: overflow: %ld bytes in %d byte buffer at scanline %d (of %d).\n",
+                            (size_t)(((uint8_t *)cScan)-dstbase), dlen, y, height);
+                        result = 0;
+                        goto done;
+                    }
+
+                    len = (r < bands[b].done) ? bands[b].rowLen[r] : 0;
+                    if (kBMCompressRowRepeat == len)
+                        repeat = true;
+                    else
+                        repeat = (prevLine && (!r || (r >= bands[b].done))
+                                    && !bcmp(prevLine, line, lineLen));
+
+                    if (r < bands[b].done)
+                    {
+                        if (kBMCompressRowRepeat != len)
+                        {
+                            if (!repeat)
+                                bcopy(bands[b].scratch + off, cScan, len);
+                            off += len;
+                        }
+                    }
+                    else if (!repeat)
+                        len = compress_line_depth(depth, line, width, (uint8_t *)cScan);
+
+                    if (!repeat)
+                    {
+                        pScan = cScan;
+                        cScan = (uint32_t *)((uint8_t *)cScan + len);
+                    }
+                    index[image * height + y] = (uint8_t *)pScan - dstbase;
+                    prevLine = line;
+                }
+            }
+            DEBG1("", " image %d ends 0x%lx\n", image, (uintptr_t)(((uint8_t *)cScan) - dstbase));
+        }
+        result = (uint8_t *)cScan - dstbase;
+    }
+
+done:
+    for (b = 0; b < bandCount; b++)
+    {
+        if (bands[b].scratch)
+            IOFree(bands[b].scratch, bands[b].scratchLen);
+        if (bands[b].rowLen)
+            IODelete(bands[b].rowLen, uint32_t, bands[b].rows);
+    }
+    IODelete(bands, struct bm_compress_band, bandCount);
+
+    return result;
+}
+#endif /* KERNEL */
+
+/*
+** Fill in the preview header and gamma tables, returning the start of the
+** scanline data that follows the y index.
+*/
+static uint32_t * compress_header(uint8_t *dstbase, uint32_t imageCount,
                  uint32_t depth, uint32_t width, uint32_t height,
-                 uint32_t rowbytes, uint8_t *dstbase, uint32_t dlen,
                  uint32_t gammaChannelCount, uint32_t gammaDataCount, 
                  uint32_t gammaDataWidth, uint8_t * gammaData)
 {
 	hibernate_preview_t * hdr;
     uint32_t * dst;
-    uint32_t * cScan,*pScan;
-    UInt8 *    lineBuffer;
-    int32_t    cSize, pSize;
-    uint32_t   image, y, lineLen;
-
-    if (dlen <= sizeof(hibernate_preview_t) + imageCount*height*sizeof(uint32_t))
-    {
-        DEBG("", "compressData: destination buffer size %d too small for y index (%ld)\n",
-                dlen, (imageCount+height)*sizeof(uint32_t));
-        return 0;
-    }
 
     hdr = (typeof(hdr)) dstbase;
 	dst = (typeof(dst)) (hdr + 1);
 
-    lineLen = width * depth;
-    dlen -= lineLen;
-
 	bzero(hdr, sizeof(*hdr));
 #if !IOHIB_PREVIEW_V0
     hdr->imageCount = imageCount;
@@ -545,10 +769,45 @@ static int CompressData(uint8_t *srcbase[], uint32_t imageCount,
 		}
     }
 
-    cScan = (uint32_t *) gammaOut;
+    return (uint32_t *) gammaOut;
+}
+
+static int CompressData(uint8_t *srcbase[], uint32_t imageCount,
+                 uint32_t depth, uint32_t width, uint32_t height,
+                 uint32_t rowbytes, uint8_t *dstbase, uint32_t dlen,
+                 uint32_t gammaChannelCount, uint32_t gammaDataCount, 
+                 uint32_t gammaDataWidth, uint8_t * gammaData)
+{
+    uint32_t * dst;
+    uint32_t * cScan,*pScan;
+    UInt8 *    lineBuffer;
+    int32_t    cSize, pSize;
+    uint32_t   image, y, lineLen;
+
+    if (dlen <= sizeof(hibernate_preview_t) + imageCount*height*sizeof(uint32_t))
+    {
+        DEBG("", "compressData: destination buffer size %d too small for y index (%ld)\n",
+                dlen, (imageCount+height)*sizeof(uint32_t));
+        return 0;
+    }
+
+	dst = (typeof(dst)) (((hibernate_preview_t *) dstbase) + 1);
+
+    lineLen = width * depth;
+    dlen -= lineLen;
+
+    cScan = compress_header(dstbase, imageCount, depth, width, height,
+                            gammaChannelCount, gammaDataCount, gammaDataWidth, gammaData);
     pScan = cScan;
     pSize = -1;
 
+#if KERNEL
+    cSize = CompressBands(srcbase, imageCount, depth, width, height, rowbytes,
+                          dstbase, dlen, dst, cScan);
+    if (cSize >= 0)
+        return cSize;
+#endif
+
 	for (image = 0; image < imageCount; image++)
 	{
 		if (!srcbase[image])
@@ -568,9 +827,7 @@ static int CompressData(uint8_t *srcbase[], uint32_t imageCount,
 	
 			if (srcbase[image])	lineBuffer = srcbase[image] + y*rowbytes;
 	
-			cSize = (depth <= 1 ? compress_line_8 :
-					(depth <= 2 ? compress_line_16 :
-					 compress_line_32))(lineBuffer, width, (uint8_t *)cScan);
+			cSize = compress_line_depth(depth, lineBuffer, width, (uint8_t *)cScan);
 	
 			if(cSize != pSize  ||  bcmp(pScan, cScan, cSize))
 			{
@@ -587,6 +844,433 @@ static int CompressData(uint8_t *srcbase[], uint32_t imageCount,
     return (uint8_t *)cScan - dstbase;
 }
 
+#if KERNEL
+/*
+** Delta compression against the previous save.
+**
+** The cache holds, for each image and each band of kBMDeltaBandRows rows, a
+** hash of the band's source pixels, the band's encoded scanlines and each
+** row's offset into them. A save hashes every band: unchanged bands are
+** copied from the cache, changed bands are encoded and replace their entry.
+** The result is the ordinary preview format - header, y index, gamma, then
+** the band data back to back with each band's row offsets rebased onto its
+** position - so restore and the booter need no changes. Repeated scanlines
+** are only shared within a band.
+**
+** As in CompressBands, slices of bands are hashed and encoded concurrently
+** into private scratch buffers and stitched in order on the calling thread.
+** Changed bands that did not fit a slice's scratch are encoded during the
+** stitch. If the cache can't be set up the save falls back to CompressData.
+*/
+
+enum
+{
+    kBMDeltaBandRows = 32,
+    kBMDeltaMaxCache = 16 * 1024 * 1024
+};
+
+enum
+{
+    kBMDeltaReuse   = 1,        // unchanged, copy the cached data
+    kBMDeltaEncoded = 2,        // encoded into the slice's scratch
+    kBMDeltaEncode  = 3         // changed, encode during the stitch
+};
+
+struct bm_delta_band
+{
+    uint64_t       hash;
+    uint8_t *      data;        // encoded scanlines, NULL if not cached
+    uint32_t       len;
+    uint32_t *     rowOffset;   // per row offset into data
+    uint64_t       newHash;
+    uint32_t       state;
+    uint32_t       scratchOff;
+    uint32_t       scratchLen;
+};
+
+struct bm_delta_cache
+{
+    uint32_t       imageCount;
+    uint32_t       depth;
+    uint32_t       width;
+    uint32_t       height;
+    uint32_t       bandCount;   // bands per image
+    uint32_t       size;        // bytes of cached band data
+    uint32_t *     rowOffset;   // imageCount * height, shared by the bands
+    struct bm_delta_band bands[0];
+};
+
+struct bm_delta_slice
+{
+    struct bm_delta_band * bands;
+    uint8_t *      src;         // first source row of the slice
+    uint32_t       rowbytes;
+    uint32_t       depth;
+    uint32_t       width;
+    uint32_t       rows;
+    uint8_t *      scratch;
+    uint32_t       scratchLen;
+};
+
+static void DeltaCacheFree(struct bm_delta_cache * cache)
+{
+    uint32_t b;
+
+    if (!cache)
+        return;
+    for (b = 0; b < cache->imageCount * cache->bandCount; b++)
+    {
+        if (cache->bands[b].data)
+            IOFree(cache->bands[b].data, cache->bands[b].len);
+    }
+    if (cache->rowOffset)
+        IODelete(cache->rowOffset, uint32_t, cache->imageCount * cache->height);
+    IOFree(cache, sizeof(*cache)
+                    + cache->imageCount * cache->bandCount * sizeof(struct bm_delta_band));
+}
+
+static uint64_t hash_rows(const uint8_t *src, uint32_t rowbytes, uint32_t lineLen, uint32_t rows)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t q;
+    uint32_t r, x;
+
+    for (r = 0; r < rows; r++, src += rowbytes)
+    {
+        for (x = 0; x + 8 <= lineLen; x += 8)
+        {
+            __builtin_memcpy(&q, src + x, sizeof(q));
+            hash = (hash ^ q) * 0x100000001b3ULL;
+        }
+        for (; x < lineLen; x++)
+            hash = (hash ^ src[x]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint32_t compress_band_rows(uint8_t *src, uint32_t rowbytes, uint32_t depth,
+                                   uint32_t width, uint32_t rows,
+                                   uint8_t *out, uint32_t *rowOffset)
+{
+    uint8_t * cScan = out;
+    uint8_t * pScan = out;
+    int32_t   cSize, pSize = -1;
+    uint32_t  r;
+
+    for (r = 0; r < rows; r++, src += rowbytes)
+    {
+        cSize = compress_line_depth(depth, src, width, cScan);
+        if (cSize != pSize || bcmp(pScan, cScan, cSize))
+        {
+            pScan = cScan;
+            cScan = cScan + cSize;
+            pSize = cSize;
+        }
+        rowOffset[r] = pScan - out;
+    }
+    return cScan - out;
+}
+
+static void delta_slice(void * arg)
+{
+    struct bm_delta_slice * slice = (typeof(slice)) arg;
+    struct bm_delta_band *  band  = slice->bands;
+    uint8_t * src = slice->src;
+    uint32_t  off = 0;
+    uint32_t  y, rows;
+
+    for (y = 0; y < slice->rows; y += rows, band++, src += rows * slice->rowbytes)
+    {
+        rows = (slice->rows - y < kBMDeltaBandRows) ? (slice->rows - y) : kBMDeltaBandRows;
+        band->newHash = hash_rows(src, slice->rowbytes, slice->width * slice->depth, rows);
+        if (band->data && (band->newHash == band->hash))
+            band->state = kBMDeltaReuse;
+        else if ((off + rows * 8*(slice->width+1)) > slice->scratchLen)
+            band->state = kBMDeltaEncode;
+        else
+        {
+            band->scratchOff = off;
+            band->scratchLen = compress_band_rows(src, slice->rowbytes, slice->depth,
+                                                  slice->width, rows,
+                                                  slice->scratch + off, band->rowOffset);
+            band->state = kBMDeltaEncoded;
+            off += band->scratchLen;
+        }
+    }
+}
+
+static int CompressDataDelta(struct bm_delta_cache ** cachep,
+                 uint8_t *srcbase[], uint32_t imageCount,
+                 uint32_t depth, uint32_t width, uint32_t height,
+                 uint32_t rowbytes, uint8_t *dstbase, uint32_t dlen,
+                 uint32_t gammaChannelCount, uint32_t gammaDataCount, 
+                 uint32_t gammaDataWidth, uint8_t * gammaData)
+{
+    struct bm_delta_cache * cache = *cachep;
+    struct bm_delta_band *  band;
+    struct bm_delta_slice   slices[kBMCompressMaxBands];
+    uint32_t * dst;
+    uint8_t *  cScan;
+    uint8_t *  src;
+    uint32_t   image, b, r, y0, rows, len, lineLen, bandCount;
+    uint32_t   sliceCount, sliceBands, s;
+    uint32_t   encoded = 0, reused = 0;
+    int        result = 0;
+
+    for (image = 0; image < imageCount; image++)
+    {
+        if (!srcbase[image])
+            break;
+    }
+    if (image < imageCount
+        || (dlen <= sizeof(hibernate_preview_t) + imageCount*height*sizeof(uint32_t)))
+    {
+        DeltaCacheFree(cache);
+        *cachep = NULL;
+        return CompressData(srcbase, imageCount, depth, width, height, rowbytes,
+                            dstbase, dlen, gammaChannelCount, gammaDataCount,
+                            gammaDataWidth, gammaData);
+    }
+
+    bandCount = (height + kBMDeltaBandRows - 1) / kBMDeltaBandRows;
+    if (cache
+        && ((cache->imageCount != imageCount) || (cache->depth != depth)
+         || (cache->width != width) || (cache->height != height)))
+    {
+        DeltaCacheFree(cache);
+        cache = NULL;
+    }
+    if (!cache)
+    {
+        len = sizeof(*cache) + imageCount * bandCount * sizeof(struct bm_delta_band);
+        cache = (typeof(cache)) IOMalloc(len);
+        if (cache)
+        {
+            bzero(cache, len);
+            cache->imageCount = imageCount;
+            cache->depth      = depth;
+            cache->width      = width;
+            cache->height     = height;
+            cache->bandCount  = bandCount;
+            cache->rowOffset  = IONew(uint32_t, imageCount * height);
+            if (!cache->rowOffset)
+            {
+                DeltaCacheFree(cache);
+                cache = NULL;
+            }
+        }
+        for (b = 0; cache && (b < imageCount * bandCount); b++)
+        {
+            image = b / bandCount;
+            cache->bands[b].rowOffset = cache->rowOffset + image * height
+                                        + (b - image * bandCount) * kBMDeltaBandRows;
+        }
+    }
+    *cachep = cache;
+    if (!cache)
+        return CompressData(srcbase, imageCount, depth, width, height, rowbytes,
+                            dstbase, dlen, gammaChannelCount, gammaDataCount,
+                            gammaDataWidth, gammaData);
+
+    dst     = (uint32_t *) (((hibernate_preview_t *) dstbase) + 1);
+    lineLen = width * depth;
+    dlen   -= lineLen;
+    cScan   = (uint8_t *) compress_header(dstbase, imageCount, depth, width, height,
+                            gammaChannelCount, gammaDataCount, gammaDataWidth, gammaData);
+
+    sliceCount = height / kBMCompressMinBandRows;
+    if (sliceCount > kBMCompressMaxBands)
+        sliceCount = kBMCompressMaxBands;
+    if (sliceCount < 1)
+        sliceCount = 1;
+    sliceBands = (bandCount + sliceCount - 1) / sliceCount;
+    sliceCount = (bandCount + sliceBands - 1) / sliceBands;
+    bzero(slices, sizeof(slices));
+    for (s = 0; s < sliceCount; s++)
+    {
+        slices[s].rows     = ((s == sliceCount - 1) ? height : ((s + 1) * sliceBands * kBMDeltaBandRows))
+                           - s * sliceBands * kBMDeltaBandRows;
+        slices[s].rowbytes = rowbytes;
+        slices[s].depth    = depth;
+        slices[s].width    = width;
+        if (sliceCount > 1)
+        {
+            slices[s].scratchLen = slices[s].rows * (lineLen + 8);
+            if (slices[s].scratchLen > kBMCompressBandScratch)
+                slices[s].scratchLen = kBMCompressBandScratch;
+            slices[s].scratch = (uint8_t *) IOMalloc(slices[s].scratchLen);
+            if (!slices[s].scratch)
+                slices[s].scratchLen = 0;
+        }
+    }
+
+    for (image = 0; image < imageCount; image++)
+    {
+        for (s = 0; s < sliceCount; s++)
+        {
+            slices[s].bands = &cache->bands[image * bandCount + s * sliceBands];
+            slices[s].src   = srcbase[image] + s * sliceBands * kBMDeltaBandRows * rowbytes;
+        }
+        IOFBRunParallel(&delta_slice, slices, sizeof(slices[0]), sliceCount);
+
+        for (b = 0; b < bandCount; b++)
+        {
+            band = &cache->bands[image * bandCount + b];
+            y0   = b * kBMDeltaBandRows;
+            rows = (height - y0 < kBMDeltaBandRows) ? (height - y0) : kBMDeltaBandRows;
+            len  = (kBMDeltaReuse == band->state)   ? band->len
+                 : (kBMDeltaEncoded == band->state) ? band->scratchLen
+                 : rows * 8*(width+1);
+            if (((cScan - dstbase) + len) > dlen)
+            {
+                DEBG("", "compressData: overflow at band %d (of %d).\n", b, bandCount);
+                // bands encoded into scratch have had their row offsets replaced
+                DeltaCacheFree(cache);
+                *cachep = NULL;
+                goto done;
+            }
+
+            if (kBMDeltaReuse == band->state)
+            {
+                bcopy(band->data, cScan, len);
+                reused++;
+            }
+            else
+            {
+                if (kBMDeltaEncoded == band->state)
+                    bcopy(slices[b / sliceBands].scratch + band->scratchOff, cScan, len);
+                else
+                {
+                    src = srcbase[image] + y0 * rowbytes;
+                    len = compress_band_rows(src, rowbytes, depth, width, rows,
+                                             cScan, band->rowOffset);
+                }
+                if (band->data)
+                {
+                    IOFree(band->data, band->len);
+                    cache->size -= band->len;
+                    band->data = NULL;
+                }
+                if ((cache->size + len) <= kBMDeltaMaxCache)
+                    band->data = (uint8_t *) IOMalloc(len);
+                if (band->data)
+                {
+                    bcopy(cScan, band->data, len);
+                    cache->size += len;
+                }
+                band->len  = len;
+                band->hash = band->newHash;
+                encoded++;
+            }
+
+            for (r = 0; r < rows; r++)
+                dst[image * height + y0 + r] = (cScan - dstbase) + band->rowOffset[r];
+            cScan += len;
+        }
+        DEBG1("", " image %d ends 0x%lx\n", image, (uintptr_t)(cScan - dstbase));
+    }
+    DEBG1("", " delta save: %d bands encoded, %d reused\n", encoded, reused);
+    result = cScan - dstbase;
+
+done:
+    for (s = 0; s < sliceCount; s++)
+    {
+        if (slices[s].scratch)
+            IOFree(slices[s].scratch, slices[s].scratchLen);
+    }
+
+    return result;
+}
+#endif /* KERNEL */
+
+static void decompress_rows(uint8_t *srcbase, uint32_t *index, UInt8 *dst, uint32_t rows,
+                            uint32_t rowbytes, uint32_t depth, uint32_t xMin, uint32_t xMax)
+{
+    uint32_t y;
+
+    for(y=0 ; y<rows ; y++)
+    {
+        UInt8 *scan;
+
+        scan = srcbase + *index;
+
+        if (0 == (y & 7))
+        {
+            AbsoluteTime deadline;
+            clock_interval_to_deadline(8, kMicrosecondScale, &deadline);
+            assert_wait_deadline((event_t)&clock_delay_until, THREAD_UNINT, __OSAbsoluteTime(deadline));
+            thread_block(NULL);
+        }
+
+        (depth <= 1  ? DecompressRLE8 :
+            (depth <= 2 ? DecompressRLE16 : DecompressRLE32))
+                (scan, dst, xMin,xMax);
+
+        dst   = dst + rowbytes;
+        index = index + 1;
+    }
+}
+
+#if KERNEL
+/*
+** Scanlines are addressed through the y index, so row bands can be expanded
+** independently. Each band keeps the serial loop's periodic yield.
+*/
+
+struct bm_decompress_band
+{
+    uint8_t *      srcbase;
+    uint32_t *     index;       // first y index entry of the band
+    UInt8 *        dst;         // first destination row of the band
+    uint32_t       rows;
+    uint32_t       rowbytes;
+    uint32_t       depth;
+    uint32_t       xMin, xMax;
+};
+
+static void decompress_band(void * arg)
+{
+    struct bm_decompress_band * band = (typeof(band)) arg;
+
+    decompress_rows(band->srcbase, band->index, band->dst, band->rows,
+                    band->rowbytes, band->depth, band->xMin, band->xMax);
+}
+
+static bool DecompressBands(uint8_t *srcbase, uint32_t *index, UInt8 *dst, uint32_t rows,
+                            uint32_t rowbytes, uint32_t depth, uint32_t xMin, uint32_t xMax)
+{
+    struct bm_decompress_band * bands;
+    uint32_t   bandCount, bandRows, b;
+
+    bandCount = rows / kBMCompressMinBandRows;
+    if (bandCount > kBMCompressMaxBands)
+        bandCount = kBMCompressMaxBands;
+    if (bandCount < 2)
+        return false;
+    bandRows = (rows + bandCount - 1) / bandCount;
+
+    bands = IONew(struct bm_decompress_band, bandCount);
+    if (!bands)
+        return false;
+
+    for (b = 0; b < bandCount; b++)
+    {
+        bands[b].srcbase  = srcbase;
+        bands[b].index    = index + b * bandRows;
+        bands[b].dst      = dst + b * bandRows * rowbytes;
+        bands[b].rows     = (b == bandCount - 1) ? (rows - b * bandRows) : bandRows;
+        bands[b].rowbytes = rowbytes;
+        bands[b].depth    = depth;
+        bands[b].xMin     = xMin;
+        bands[b].xMax     = xMax;
+    }
+    IOFBRunParallel(&decompress_band, bands, sizeof(bands[0]), bandCount);
+    IODelete(bands, struct bm_decompress_band, bandCount);
+
+    return true;
+}
+#endif /* KERNEL */
+
 static void DecompressData(uint8_t *srcbase, uint32_t image, UInt8 *dstbase, uint32_t dx, uint32_t dy,
                     uint32_t dw, uint32_t dh, uint32_t rowbytes)
 {
@@ -594,7 +1278,7 @@ static void DecompressData(uint8_t *srcbase, uint32_t image, UInt8 *dstbase, uin
     uint32_t  *src;
     uint8_t   *dst;
     uint32_t   xMin,xMax;
-    uint32_t   y, depth;
+    uint32_t   depth;
 
     hdr = (typeof(hdr)) srcbase;
     dst = (typeof(dst)) dstbase;
@@ -616,27 +1300,11 @@ static void DecompressData(uint8_t *srcbase, uint32_t image, UInt8 *dstbase, uin
     xMin    = dx;
     xMax    = dx + dw;
 
-    for(y=0 ; y<dh ; y++)
-    {
-        UInt8 *scan;
-
-        scan = srcbase + *src;
-
-        if (0 == (y & 7))
-        {
-            AbsoluteTime deadline;
-            clock_interval_to_deadline(8, kMicrosecondScale, &deadline);
-            assert_wait_deadline((event_t)&clock_delay_until, THREAD_UNINT, __OSAbsoluteTime(deadline));
-            thread_block(NULL);
-        }
-
-        (depth <= 1  ? DecompressRLE8 :
-            (depth <= 2 ? DecompressRLE16 : DecompressRLE32))
-                (scan, dst, xMin,xMax);
-
-        dst = dst + rowbytes;
-        src = src + 1;
-    }
+#if KERNEL
+    if (DecompressBands(srcbase, src, dst, dh, rowbytes, depth, xMin, xMax))
+        return;
+#endif
+    decompress_rows(srcbase, src, dst, dh, rowbytes, depth, xMin, xMax);
 }
 
 static void 
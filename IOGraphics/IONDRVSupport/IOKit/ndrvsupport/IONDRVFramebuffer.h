@@ -156,6 +156,10 @@ private:
                                     VDDetailedTimingRec * detailed,
                                     IODisplayModeInformation * info );
     IOIndex mapDepthIndex( IODisplayModeID modeID, IOIndex depth, bool fromDepthMode );
+    IOReturn buildModeTable( void );
+    void freeModeTable( void );
+    struct IONDRVModeEntry * lookupMode( IODisplayModeID modeID, bool slot );
+    IOReturn loadModeEntry( IODisplayModeID modeID, struct IONDRVModeEntry * entry );
     virtual IOReturn validateDisplayMode(
             IODisplayModeID mode, IOOptionBits flags,
             VDDetailedTimingRec ** detailed );
@@ -96,6 +96,36 @@ enum
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+enum { kIONDRVDepthCount = kDepthMode6 - kDepthMode1 + 1 };
+
+// What the mode queries need for one display mode, read from the driver once.
+struct IONDRVModeEntry
+{
+    IODisplayModeID             modeID;
+    IODisplayModeInformation    info;
+    UInt8                       valid;
+    UInt8                       depthValid;         // bit per depth mode
+    UInt8                       indexToDepthMode[kIONDRVDepthCount];
+    UInt8                       depthModeToIndex[kIONDRVDepthCount];
+    VPBlock                     vpBlock[kIONDRVDepthCount];
+};
+
+// Built on first use after a connect change or setDetailedTimings(). The
+// driver's modes are fully read at build time and looked up by hashing the
+// mode ID; detailed timing modes are indexed by arbMode2Index() and filled
+// the first time each one is validated.
+struct IONDRVModeTable
+{
+    UInt32                      modeCount;
+    UInt32                      modeAlloc;
+    UInt32                      hashShift;
+    UInt32                      hashCount;
+    UInt16 *                    hash;               // entry index + 1
+    IONDRVModeEntry *           modes;              // driver order
+    UInt32                      arbCount;
+    IONDRVModeEntry *           arbModes;
+};
+
 struct IONDRVFramebufferPrivate
 {
     IOOptionBits                displayConnectFlags;
@@ -114,6 +144,7 @@ struct IONDRVFramebufferPrivate
     UInt8                       indexToDepthMode[kDepthMode6 - kDepthMode1 + 1];
     UInt8                       depthModeToIndex[kDepthMode6 - kDepthMode1 + 1];
     IOPhysicalAddress64         physicalFramebuffer;
+    IONDRVModeTable *           modeTable;
 
 };
 
@@ -763,6 +794,7 @@ void IONDRVFramebuffer::free( void )
 {
     if (__private)
     {
+        freeModeTable();
         IODelete( __private, IONDRVFramebufferPrivate, 1 );
         __private = 0;
     }
@@ -1381,11 +1413,188 @@ void IONDRVFramebuffer::setInfoProperties( void )
         &__private->displayConnectFlags, sizeof32(__private->displayConnectFlags));
 }
 
+static inline UInt32 ModeTableHash( IODisplayModeID modeID, UInt32 shift )
+{
+    return ((((UInt32) modeID) * 0x9e3779b1) >> shift);
+}
+
+void IONDRVFramebuffer::freeModeTable( void )
+{
+    IONDRVModeTable * table = __private->modeTable;
+
+    if (!table)
+        return;
+
+    if (table->hash)
+        IODelete( table->hash, UInt16, table->hashCount );
+    if (table->modes)
+        IODelete( table->modes, IONDRVModeEntry, table->modeAlloc );
+    if (table->arbModes)
+        IODelete( table->arbModes, IONDRVModeEntry, table->arbCount );
+    IODelete( table, IONDRVModeTable, 1 );
+    __private->modeTable = 0;
+}
+
+IOReturn IONDRVFramebuffer::loadModeEntry( IODisplayModeID modeID, IONDRVModeEntry * entry )
+{
+    VDVideoParametersInfoRec    pixelParams;
+    IOIndex                     mapped, index, lastDepth, lastIndex;
+
+    entry->modeID     = modeID;
+    entry->depthValid = 0;
+    lastDepth = kDepthMode1;
+    lastIndex = 0;
+    for (mapped = kDepthMode1, index = 0; mapped <= kDepthMode6; mapped++)
+    {
+        pixelParams.csDisplayModeID = modeID;
+        pixelParams.csDepthMode     = mapped;
+        pixelParams.csVPBlockPtr    = &entry->vpBlock[mapped - kDepthMode1];
+        if (kIOReturnSuccess == _doStatus( this, cscGetVideoParameters, &pixelParams ))
+        {
+            entry->depthValid |= (1 << (mapped - kDepthMode1));
+            entry->indexToDepthMode[index] = mapped;
+            lastDepth = mapped;
+            lastIndex = index;
+            index++;
+        }
+        entry->depthModeToIndex[mapped - kDepthMode1] = lastIndex;
+    }
+    for (; index < kIONDRVDepthCount; index++)
+        entry->indexToDepthMode[index] = lastDepth;
+
+    entry->info.maxDepthIndex = entry->depthModeToIndex[kDepthMode6 - kDepthMode1];
+
+    return (entry->depthValid ? kIOReturnSuccess : kIOReturnUnsupportedMode);
+}
+
+IOReturn IONDRVFramebuffer::buildModeTable( void )
+{
+    IONDRVModeTable *   table;
+    IONDRVModeEntry *   entry;
+    VDResolutionInfoRec info;
+    UInt32              count, num, slot;
+
+    count = 0;
+    info.csPreviousDisplayModeID = kDisplayModeIDFindFirstResolution;
+    while (
+        (noErr == _doStatus(this, cscGetNextResolution, &info))
+        && ((SInt32) info.csDisplayModeID > 0))
+    {
+        info.csPreviousDisplayModeID = info.csDisplayModeID;
+        count++;
+    }
+    // driver not answering yet, don't remember that
+    if (!count)
+        return (kIOReturnNotReady);
+
+    table = IONew( IONDRVModeTable, 1 );
+    if (!table)
+        return (kIOReturnNoMemory);
+    bzero( table, sizeof(IONDRVModeTable) );
+    __private->modeTable = table;
+
+    for (table->hashShift = 31; (1U << (32 - table->hashShift)) < (2 * count); table->hashShift--)
+        {}
+    table->hashCount = 1 << (32 - table->hashShift);
+    table->hash      = IONew( UInt16, table->hashCount );
+    table->modes     = IONew( IONDRVModeEntry, count );
+    table->modeAlloc = count;
+    if (detailedTimings && (table->arbCount = detailedTimings->getCount()))
+        table->arbModes = IONew( IONDRVModeEntry, table->arbCount );
+    if (!table->hash || !table->modes || (table->arbCount && !table->arbModes))
+    {
+        freeModeTable();
+        return (kIOReturnNoMemory);
+    }
+    bzero( table->hash, table->hashCount * sizeof(UInt16) );
+    bzero( table->modes, count * sizeof(IONDRVModeEntry) );
+    if (table->arbModes)
+        bzero( table->arbModes, table->arbCount * sizeof(IONDRVModeEntry) );
+
+    num = 0;
+    info.csPreviousDisplayModeID = kDisplayModeIDFindFirstResolution;
+    while (
+        (num < count)
+        && (noErr == _doStatus(this, cscGetNextResolution, &info))
+        && ((SInt32) info.csDisplayModeID > 0))
+    {
+        info.csPreviousDisplayModeID = info.csDisplayModeID;
+
+        entry = &table->modes[num];
+        entry->info.nominalWidth  = info.csHorizontalPixels;
+        entry->info.nominalHeight = info.csVerticalLines;
+        entry->info.refreshRate   = info.csRefreshRate;
+        loadModeEntry( info.csDisplayModeID, entry );
+        entry->valid = true;
+
+        for (slot = ModeTableHash(info.csDisplayModeID, table->hashShift);
+                table->hash[slot];
+                slot = (slot + 1) & (table->hashCount - 1))
+            {}
+        table->hash[slot] = ++num;
+    }
+    table->modeCount = num;
+
+    DEBG(thisName, " %d modes\n", (int) num);
+
+    return (kIOReturnSuccess);
+}
+
+IONDRVModeEntry * IONDRVFramebuffer::lookupMode( IODisplayModeID modeID, bool slot )
+{
+    IONDRVModeTable * table;
+    IONDRVModeEntry * entry;
+    UInt32            hash, index;
+
+    if ((modeID == kDisplayModeIDBootProgrammable)
+        || (modeID == kDisplayModeIDPreflight)
+        || (modeID == kDisplayModeIDInvalid))
+        return (0);
+
+    if (!__private->modeTable && (kIOReturnSuccess != buildModeTable()))
+        return (0);
+    table = __private->modeTable;
+
+    if ((UInt32) modeID >= (UInt32) kDisplayModeIDReservedBase)
+    {
+        index = arbMode2Index(modeID);
+        if (index >= table->arbCount)
+            return (0);
+        entry = &table->arbModes[index];
+        if (slot || (entry->valid && (entry->modeID == modeID)))
+            return (entry);
+        return (0);
+    }
+
+    for (hash = ModeTableHash(modeID, table->hashShift);
+            (index = table->hash[hash]);
+            hash = (hash + 1) & (table->hashCount - 1))
+    {
+        entry = &table->modes[index - 1];
+        if (entry->modeID == modeID)
+            return (entry);
+    }
+
+    return (0);
+}
+
 UInt32 IONDRVFramebuffer::iterateAllModes( IODisplayModeID * displayModeIDs )
 {
     VDResolutionInfoRec info;
     UInt32              num = 0;
 
+    if (__private->modeTable || (kIOReturnSuccess == buildModeTable()))
+    {
+        IONDRVModeTable * table = __private->modeTable;
+
+        if (displayModeIDs)
+        {
+            for (num = 0; num < table->modeCount; num++)
+                displayModeIDs[num] = table->modes[num].modeID;
+        }
+        return (table->modeCount);
+    }
+
     info.csPreviousDisplayModeID = kDisplayModeIDFindFirstResolution;
 
     while (
@@ -1409,6 +1618,20 @@ IOIndex IONDRVFramebuffer::mapDepthIndex(
     VPBlock                     pixelInfo;
     IOIndex                     mapped, index, lastDepth, lastIndex;
     IOReturn                    err;
+    IONDRVModeEntry *           entry;
+
+    if ((entry = lookupMode(modeID, false)))
+    {
+        if (fromDepthMode)
+        {
+            if (depth > kDepthMode6)
+                depth = kDepthMode6;
+            return (entry->depthModeToIndex[depth - kDepthMode1]);
+        }
+        if (depth > (kDepthMode6 - kDepthMode1))
+            depth = (kDepthMode6 - kDepthMode1);
+        return (entry->indexToDepthMode[depth]);
+    }
 
     if ((modeID == kDisplayModeIDPreflight)
         || (modeID != __private->depthMapModeID))
@@ -1501,6 +1724,13 @@ IOReturn IONDRVFramebuffer::getResInfoForArbMode( IODisplayModeID modeID,
     IOReturn              err;
     VDDetailedTimingRec * detailed;
     VDDetailedTimingRec   _detailed;
+    IONDRVModeEntry *     entry;
+
+    if ((entry = lookupMode(modeID, false)))
+    {
+        *info = entry->info;
+        return (kIOReturnSuccess);
+    }
 
     if (modeID == kDisplayModeIDBootProgrammable)
     {
@@ -1513,20 +1743,36 @@ IOReturn IONDRVFramebuffer::getResInfoForArbMode( IODisplayModeID modeID,
     else
         err = validateDisplayMode( modeID, 0, &detailed );
 
+    if ((kIOReturnSuccess == err) && (entry = lookupMode(modeID, true)))
+        entry->valid = (kIOReturnSuccess == loadModeEntry(modeID, entry));
+
     if (kIOReturnSuccess == err)
         err = getResInfoForDetailed(modeID, detailed, info);
 
+    if (entry && entry->valid)
+        entry->info = *info;
+
     return (err);
 }
 
 IOReturn IONDRVFramebuffer::getResInfoForMode( IODisplayModeID modeID,
         IODisplayModeInformation * info )
 {
+    IONDRVModeEntry * entry;
+
     bzero( info, sizeof( *info));
 
     if ((UInt32) modeID >= (UInt32) kDisplayModeIDReservedBase)
         return (getResInfoForArbMode(modeID, info));
 
+    if (__private->modeTable || (kIOReturnSuccess == buildModeTable()))
+    {
+        if (!(entry = lookupMode(modeID, false)))
+            return (kIOReturnUnsupportedMode);
+        *info = entry->info;
+        return (kIOReturnSuccess);
+    }
+
     // unfortunately, there is no "kDisplayModeIDFindSpecific"
     if (cachedVDResolution.csDisplayModeID != modeID)
     {
@@ -1963,6 +2209,7 @@ IOReturn IONDRVFramebuffer::setDetailedTimings( OSArray * array )
         removeProperty( kIOFBDetailedTimingsKey );
         detailedTimings = 0;
         detailedTimingsSeed++;
+        freeModeTable();
         return (kIOReturnSuccess);
     }
 
@@ -1977,6 +2224,7 @@ IOReturn IONDRVFramebuffer::setDetailedTimings( OSArray * array )
         setProperty( kIOFBDetailedTimingsKey, array );  // retains
         detailedTimings = array;
         detailedTimingsSeed++;
+        freeModeTable();
 
 //      if (((UInt32) currentDisplayMode) >= ((UInt32) kDisplayModeIDReservedBase))
         if (currentDisplayMode == kDisplayModeIDBootProgrammable)
@@ -2091,6 +2339,8 @@ IOReturn IONDRVFramebuffer::getPixelInformation(
     VPBlock                     pixelInfo;
     UInt32                      pixelType;
     const char *                pixelFormat;
+    IONDRVModeEntry *           entry;
+    IOIndex                     depthMode;
     
 
     bzero( info, sizeof( *info));
@@ -2098,18 +2348,34 @@ IOReturn IONDRVFramebuffer::getPixelInformation(
     if (aperture)
         return (kIOReturnUnsupportedMode);
 
-    err = validateDisplayMode( displayMode, 0, 0 );
-    if (err)
-        return (err);
+    entry = lookupMode(displayMode, false);
+    if (!entry)
+    {
+        err = validateDisplayMode( displayMode, 0, 0 );
+        if (err)
+            return (err);
+    }
 
     do
     {
-        pixelParams.csDisplayModeID = displayMode;
-        pixelParams.csDepthMode     = mapDepthIndex(displayMode, depth, false);
-        pixelParams.csVPBlockPtr    = &pixelInfo;
-        err = _doStatus( this, cscGetVideoParameters, &pixelParams );
-        if (err)
-            continue;
+        depthMode = mapDepthIndex(displayMode, depth, false);
+        if (entry)
+        {
+            err = kIOReturnUnsupportedMode;
+            if (!(entry->depthValid & (1 << (depthMode - kDepthMode1))))
+                continue;
+            pixelInfo = entry->vpBlock[depthMode - kDepthMode1];
+            err = kIOReturnSuccess;
+        }
+        else
+        {
+            pixelParams.csDisplayModeID = displayMode;
+            pixelParams.csDepthMode     = depthMode;
+            pixelParams.csVPBlockPtr    = &pixelInfo;
+            err = _doStatus( this, cscGetVideoParameters, &pixelParams );
+            if (err)
+                continue;
+        }
 
         info->flags             = accessFlags;
 
@@ -3246,6 +3512,7 @@ IOReturn IONDRVFramebuffer::processConnectChange( uintptr_t * value )
     shouldDoI2CPower                   = 0;
     cachedVDResolution.csDisplayModeID = kDisplayModeIDInvalid;
     __private->depthMapModeID          = kDisplayModeIDInvalid;
+    freeModeTable();
 
     setInfoProperties();
     if (mirrored)
@@ -0,0 +1,102 @@
+/*
+cc -g -o /tmp/fbstats fbstats.c -framework IOKit -Wall -arch x86_64
+*/
+#include <IOKit/IOKitLib.h>
+#include <IOKit/graphics/IOGraphicsLib.h>
+#include <IOKit/graphics/IOGraphicsTypesPrivate.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define READ_GROUP(seqp, body)                              \
+    do                                                      \
+    {                                                       \
+        uint32_t _seq;                                      \
+        do                                                  \
+        {                                                   \
+            while ((_seq = *(seqp)) & 1) {}                 \
+            __sync_synchronize();                           \
+            body;                                           \
+            __sync_synchronize();                           \
+        }                                                   \
+        while (_seq != *(seqp));                            \
+    }                                                       \
+    while (0)
+
+int main(int argc, char * argv[])
+{
+    kern_return_t             kr;
+    io_iterator_t             iter;
+    io_service_t              framebuffer;
+    io_connect_t              connect;
+    mach_vm_address_t         mapAddr = 0;
+    mach_vm_size_t            size;
+    mach_timebase_info_data_t timebase;
+    IOFBStatistics *          stats;
+    IOFBStatistics            copy;
+    int                       index;
+    int                       loops = (argc > 1) ? atoi(argv[1]) : 10;
+
+    kr = IOServiceGetMatchingServices(kIOMasterPortDefault, IOServiceMatching(
+                IOFRAMEBUFFER_CONFORMSTO), &iter);
+    if (KERN_SUCCESS != kr)
+        exit(1);
+    framebuffer = IOIteratorNext(iter);
+    IOObjectRelease(iter);
+    if (!framebuffer)
+        exit(1);
+
+    kr = IOServiceOpen(framebuffer, mach_task_self(), kIOFBSharedConnectType, &connect);
+    if (kIOReturnSuccess != kr)
+    {
+        printf("IOServiceOpen(%x)\n", kr);
+        exit(1);
+    }
+    kr = IOConnectMapMemory64(connect, kIOFBStatisticsMemory, mach_task_self(),
+                              &mapAddr, &size, kIOMapAnywhere | kIOMapReadOnly);
+    if (kIOReturnSuccess != kr)
+    {
+        printf("IOConnectMapMemory(%x)\n", kr);
+        exit(1);
+    }
+    stats = (IOFBStatistics *)(uintptr_t) mapAddr;
+    if (stats->version != kIOFBStatisticsVersion)
+    {
+        printf("version %d\n", stats->version);
+        exit(1);
+    }
+    mach_timebase_info(&timebase);
+
+    for (index = 0; index < loops; index++)
+    {
+        READ_GROUP(&stats->vblSeq,
+                   copy.vblCount = stats->vblCount;
+                   copy.vblTime  = stats->vblTime);
+        READ_GROUP(&stats->flushSeq,
+                   copy.flushCount  = stats->flushCount;
+                   copy.flushPixels = stats->flushPixels);
+        READ_GROUP(&stats->modeSeq,
+                   copy.modeSwitchCount     = stats->modeSwitchCount;
+                   copy.modeSwitchLastTime  = stats->modeSwitchLastTime;
+                   copy.modeSwitchMaxTime   = stats->modeSwitchMaxTime;
+                   copy.modeSwitchTotalTime = stats->modeSwitchTotalTime);
+        copy.cursorUpdates = stats->cursorUpdates;
+
+        printf("vbl %qd @ %qd, flush %qd (%qd px), cursor %qd, "
+               "modes %qd last %qd us max %qd us\n",
+               copy.vblCount, copy.vblTime,
+               copy.flushCount, copy.flushPixels, copy.cursorUpdates,
+               copy.modeSwitchCount,
+               copy.modeSwitchLastTime * timebase.numer / timebase.denom / 1000,
+               copy.modeSwitchMaxTime  * timebase.numer / timebase.denom / 1000);
+        sleep(1);
+    }
+
+    IOServiceClose(connect);
+    IOObjectRelease(framebuffer);
+
+    exit(0);
+    return (0);
+}